@@ -0,0 +1,507 @@
+#include "batch.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <libgen.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavutil/time.h>
+
+#include "pool.h"
+#include "raylib.h"
+
+void batch_usage(void) {
+    fprintf(stderr,
+            "usage: avp batch <probe|poster|verify> [-j threads] [-o dir] "
+            "<file|dir>...\n");
+}
+
+void batch_json_string(FILE *json, const char *str) {
+    fputc('"', json);
+    for (const unsigned char *c = (const unsigned char *)str; *c; c++) {
+        if (*c == '"' || *c == '\\') {
+            fprintf(json, "\\%c", *c);
+        } else if (*c < 0x20) {
+            fprintf(json, "\\u%04x", *c);
+        } else {
+            fputc(*c, json);
+        }
+    }
+    fputc('"', json);
+}
+
+// Reports a path that could not be collected like a file that failed, so it
+// shows in the output and the exit status.
+void batch_collect_failed(const char *path, const char *error,
+                          BatchOptions *options) {
+    fprintf(stderr, "batch_collect: %s %s: %s\n", error, path, strerror(errno));
+
+    fprintf(options->out, "{\"path\":");
+    batch_json_string(options->out, path);
+    fprintf(options->out, ",\"ok\":false,\"error\":");
+    batch_json_string(options->out, error);
+    fprintf(options->out, "}\n");
+
+    atomic_fetch_add(&options->files, 1);
+    atomic_fetch_add(&options->failed, 1);
+}
+
+// Adds `path` to the jobs, or every file under it if it is a directory.
+// Hidden files are skipped.
+int batch_collect(const char *path, BatchJob **jobs, int *count, int *capacity,
+                  BatchOptions *options) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        batch_collect_failed(path, "cannot stat", options);
+        return -1;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path);
+        if (!dir) {
+            batch_collect_failed(path, "cannot open", options);
+            return -1;
+        }
+
+        struct dirent *entry;
+        while ((entry = readdir(dir))) {
+            if (entry->d_name[0] == '.') {
+                continue;
+            }
+
+            char child[4096];
+            snprintf(child, sizeof(child), "%s/%s", path, entry->d_name);
+
+            // Symlinked directories are not followed, so a link back up the
+            // tree cannot recurse forever.
+            struct stat link;
+            if (lstat(child, &link) == 0 && S_ISLNK(link.st_mode) &&
+                stat(child, &link) == 0 && S_ISDIR(link.st_mode)) {
+                continue;
+            }
+            batch_collect(child, jobs, count, capacity, options);
+        }
+        closedir(dir);
+
+        return 0;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        return 0;
+    }
+
+    if (*count == *capacity) {
+        int new_capacity = *capacity ? *capacity * 2 : 64;
+        BatchJob *new_jobs = realloc(*jobs, new_capacity * sizeof(BatchJob));
+        if (!new_jobs) {
+            fprintf(stderr, "batch_collect: failed to grow the job list\n");
+            return -1;
+        }
+
+        *jobs = new_jobs;
+        *capacity = new_capacity;
+    }
+
+    BatchJob *job = &(*jobs)[(*count)++];
+    job->options = options;
+    job->path = strdup(path);
+    job->size = st.st_size;
+
+    return 0;
+}
+
+// Duration, streams, and the number of video keyframes, which takes reading
+// every packet of the video stream.
+int batch_probe(BatchJob *job, Media *media, FILE *json, const char **error) {
+    AVFormatContext *fmt_ctx = media->fmt_ctx;
+    (void)job;
+
+    fprintf(json, ",\"format\":");
+    batch_json_string(json, fmt_ctx->iformat->name);
+    fprintf(json, ",\"duration\":%.3f,\"bit_rate\":%lld",
+            fmt_ctx->duration > 0 ? (double)fmt_ctx->duration / AV_TIME_BASE
+                                  : 0.0,
+            (long long)fmt_ctx->bit_rate);
+
+    fprintf(json, ",\"streams\":[");
+    for (int i = 0; i < (int)fmt_ctx->nb_streams; i++) {
+        AVStream *stream = fmt_ctx->streams[i];
+        AVCodecParameters *par = stream->codecpar;
+
+        const char *type = av_get_media_type_string(par->codec_type);
+        fprintf(json, "%s{\"index\":%d,\"type\":\"%s\",\"codec\":", i ? "," : "",
+                i, type ? type : "unknown");
+        batch_json_string(json, avcodec_get_name(par->codec_id));
+
+        if (par->codec_type == AVMEDIA_TYPE_VIDEO) {
+            AVRational rate = av_guess_frame_rate(fmt_ctx, stream, NULL);
+            fprintf(json, ",\"width\":%d,\"height\":%d,\"frame_rate\":%.3f",
+                    par->width, par->height, rate.den ? av_q2d(rate) : 0.0);
+        } else if (par->codec_type == AVMEDIA_TYPE_AUDIO) {
+            fprintf(json, ",\"sample_rate\":%d,\"channels\":%d", par->sample_rate,
+                    par->ch_layout.nb_channels);
+        }
+        fputc('}', json);
+    }
+    fputc(']', json);
+
+    if (media->video_stream_idx < 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < (int)fmt_ctx->nb_streams; i++) {
+        if (i != media->video_stream_idx) {
+            fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    int64_t keyframes = 0;
+    int ret;
+    while ((ret = media_read_frame(media)) == 0) {
+        if (media->pkt->stream_index == media->video_stream_idx &&
+            media->pkt->flags & AV_PKT_FLAG_KEY) {
+            keyframes++;
+        }
+    }
+
+    if (ret != MEDIA_ERR_EOF) {
+        *error = "failed to read packets";
+        return ret;
+    }
+
+    fprintf(json, ",\"keyframes\":%lld", (long long)keyframes);
+    return 0;
+}
+
+// Writes the frame at BATCH_POSTER_POSITION as <output_dir>/<name>-<hash>.png,
+// where the hash is of the whole path, so files with the same name in
+// different directories do not overwrite each other's poster.
+int batch_poster(BatchJob *job, Media *media, FILE *json, const char **error) {
+    if (!media->video_ctx) {
+        *error = "no video stream";
+        return MEDIA_ERR_NO_STREAM;
+    }
+
+    AVCodecParameters *par =
+        media->fmt_ctx->streams[media->video_stream_idx]->codecpar;
+    AVRational sar = par->sample_aspect_ratio;
+    double aspect = (double)par->width / par->height;
+    if (sar.num > 0 && sar.den > 0) {
+        aspect *= av_q2d(sar);
+    }
+
+    int height = (int)(BATCH_POSTER_WIDTH / aspect) & ~1;
+    if (height < 2) {
+        height = 2;
+    }
+
+    int ret = media_set_output_size(media, BATCH_POSTER_WIDTH, height);
+    if (ret < 0) {
+        *error = "failed to set the output size";
+        return ret;
+    }
+
+    int64_t timestamp =
+        media->fmt_ctx->duration > 0
+            ? (int64_t)(media->fmt_ctx->duration * BATCH_POSTER_POSITION)
+            : 0;
+
+    AVFrame *frame = NULL;
+    if ((ret = media_seek_frame(media, timestamp, 0, &frame)) < 0 || !frame) {
+        *error = "failed to decode a frame";
+        return ret < 0 ? ret : MEDIA_ERR_INTERNAL;
+    }
+
+    char name[1024];
+    snprintf(name, sizeof(name), "%s", job->path);
+
+    // FNV-1a, like the disk cache.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = job->path; *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 0x100000001b3ULL;
+    }
+
+    char poster[4096];
+    snprintf(poster, sizeof(poster), "%s/%s-%08llx.png",
+             job->options->output_dir, basename(name),
+             (unsigned long long)(hash & 0xffffffff));
+
+    // Frames are converted tightly packed, as raylib expects its images.
+    Image image = {.data = frame->data[0],
+                   .width = frame->width,
+                   .height = frame->height,
+                   .mipmaps = 1,
+                   .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+    int saved = ExportImage(image, poster);
+
+    int64_t pts = frame->best_effort_timestamp;
+    AVRational time_base =
+        media->fmt_ctx->streams[media->video_stream_idx]->time_base;
+    av_frame_free(&frame);
+
+    if (!saved) {
+        *error = "failed to write the poster";
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    fprintf(json, ",\"poster\":");
+    batch_json_string(json, poster);
+    fprintf(json, ",\"timestamp\":%.3f",
+            pts != AV_NOPTS_VALUE ? pts * av_q2d(time_base) : 0.0);
+
+    return 0;
+}
+
+// Counts the frames ready in the queue of `media` and drops them.
+void batch_count_frames(Media *media, int64_t *video_frames,
+                        int64_t *audio_frames) {
+    Node *node;
+    while ((node = fq_dequeue(media->queue))) {
+        if (node->type == FRAME_TYPE_VIDEO) {
+            (*video_frames)++;
+        } else {
+            (*audio_frames)++;
+        }
+        node_free(node);
+    }
+}
+
+// Decodes every packet, draining the decoders at the end. Packets the
+// decoders reject are counted, not fatal.
+int batch_verify(BatchJob *job, Media *media, FILE *json, const char **error) {
+    // Only decoding is verified, so the conversion is made as cheap as it gets.
+    media->sws_flags = SWS_POINT;
+    if (media->video_ctx) {
+        media_set_output_size(media, 16, 16);
+    }
+
+    int64_t video_frames = 0, audio_frames = 0, errors = 0;
+    int ret;
+
+    while ((ret = media_read_frame(media)) == 0) {
+        if (media->pkt->stream_index != media->video_stream_idx &&
+            media->pkt->stream_index != media->audio_stream_idx) {
+            continue;
+        }
+
+        ret = media_decode(media);
+        if (ret < 0 && ret != MEDIA_ERR_MORE_DATA) {
+            errors++;
+        }
+        batch_count_frames(media, &video_frames, &audio_frames);
+    }
+
+    if (ret != MEDIA_ERR_EOF) {
+        *error = "failed to read packets";
+        return ret;
+    }
+
+    if (media->video_ctx) {
+        avcodec_send_packet(media->video_ctx, NULL);
+        media_receive_frames(media, media->video_ctx, 1);
+    }
+    if (media->audio_ctx) {
+        avcodec_send_packet(media->audio_ctx, NULL);
+        media_receive_frames(media, media->audio_ctx, 0);
+    }
+    batch_count_frames(media, &video_frames, &audio_frames);
+
+    atomic_fetch_add(&job->options->frames, video_frames);
+
+    fprintf(json, ",\"video_frames\":%lld,\"audio_frames\":%lld,\"errors\":%lld",
+            (long long)video_frames, (long long)audio_frames, (long long)errors);
+
+    if (errors > 0) {
+        *error = "decoding errors";
+        return MEDIA_ERR_LIBAV;
+    }
+
+    return 0;
+}
+
+void batch_run(void *arg) {
+    BatchJob *job = arg;
+    BatchOptions *options = job->options;
+
+    char *line = NULL;
+    size_t line_size = 0;
+    FILE *json = open_memstream(&line, &line_size);
+    if (!json) {
+        fprintf(stderr, "batch_run: open_memstream failed\n");
+        atomic_fetch_add(&options->failed, 1);
+        return;
+    }
+
+    int64_t start = av_gettime_relative();
+    const char *error = NULL;
+    int ret;
+
+    fprintf(json, "{\"path\":");
+    batch_json_string(json, job->path);
+    fprintf(json, ",\"size\":%lld", (long long)job->size);
+
+    Media *media = media_alloc();
+    if (!media) {
+        error = "out of memory";
+        ret = MEDIA_ERR_INTERNAL;
+    } else {
+        media->io_mode = options->io_mode;
+        media->io_buffer_size = options->io_buffer_size;
+
+        ret = media_init(media, BATCH_POSTER_WIDTH, BATCH_POSTER_WIDTH,
+                         AV_PIX_FMT_RGBA, job->path);
+        if (ret < 0) {
+            error = "failed to open";
+        } else if (options->operation == BATCH_PROBE) {
+            ret = batch_probe(job, media, json, &error);
+        } else if (options->operation == BATCH_POSTER) {
+            ret = batch_poster(job, media, json, &error);
+        } else {
+            ret = batch_verify(job, media, json, &error);
+        }
+    }
+    media_free(media);
+
+    double elapsed = (av_gettime_relative() - start) / 1e6;
+    fprintf(json, ",\"time\":%.3f,\"ok\":%s", elapsed, ret < 0 ? "false" : "true");
+    if (ret < 0) {
+        fprintf(json, ",\"error\":");
+        batch_json_string(json, error ? error : "unknown");
+    }
+    fprintf(json, "}\n");
+    fclose(json);
+
+    atomic_fetch_add(&options->files, 1);
+    atomic_fetch_add(&options->bytes, job->size);
+    if (ret < 0) {
+        atomic_fetch_add(&options->failed, 1);
+    }
+
+    pthread_mutex_lock(&options->out_lock);
+    fwrite(line, 1, line_size, options->out);
+    fflush(options->out);
+    pthread_mutex_unlock(&options->out_lock);
+
+    free(line);
+}
+
+int batch_main(int argc, char **argv) {
+    if (argc < 2) {
+        batch_usage();
+        return 2;
+    }
+
+    BatchOptions options = {.output_dir = ".", .threads = 0};
+
+    if (strcmp(argv[1], "probe") == 0) {
+        options.operation = BATCH_PROBE;
+    } else if (strcmp(argv[1], "poster") == 0) {
+        options.operation = BATCH_POSTER;
+    } else if (strcmp(argv[1], "verify") == 0) {
+        options.operation = BATCH_VERIFY;
+    } else {
+        batch_usage();
+        return 2;
+    }
+
+    int first_path = 2;
+    while (first_path < argc && argv[first_path][0] == '-') {
+        if (strcmp(argv[first_path], "-j") == 0 && first_path + 1 < argc) {
+            options.threads = atoi(argv[first_path + 1]);
+        } else if (strcmp(argv[first_path], "-o") == 0 && first_path + 1 < argc) {
+            options.output_dir = argv[first_path + 1];
+        } else {
+            batch_usage();
+            return 2;
+        }
+        first_path += 2;
+    }
+
+    if (first_path == argc) {
+        batch_usage();
+        return 2;
+    }
+
+    options.io_mode = media_io_mode_from_string(getenv("AVP_IO"));
+    const char *io_buffer_mb = getenv("AVP_IO_BUFFER_MB");
+    options.io_buffer_size =
+        io_buffer_mb ? (size_t)atoi(io_buffer_mb) * 1024 * 1024 : 0;
+
+    // The media functions report their errors on stdout, so the JSON gets
+    // its own copy of it and everything else is sent to stderr.
+    int json_fd = dup(STDOUT_FILENO);
+    options.out = json_fd >= 0 ? fdopen(json_fd, "w") : NULL;
+    if (!options.out) {
+        fprintf(stderr, "batch_main: cannot duplicate stdout\n");
+        return 1;
+    }
+    fflush(stdout);
+    dup2(STDERR_FILENO, STDOUT_FILENO);
+
+    av_log_set_level(AV_LOG_ERROR);
+    SetTraceLogLevel(LOG_WARNING);
+
+    pthread_mutex_init(&options.out_lock, NULL);
+    atomic_init(&options.files, 0);
+    atomic_init(&options.failed, 0);
+    atomic_init(&options.bytes, 0);
+    atomic_init(&options.frames, 0);
+
+    BatchJob *jobs = NULL;
+    int count = 0, capacity = 0;
+    for (int i = first_path; i < argc; i++) {
+        batch_collect(argv[i], &jobs, &count, &capacity, &options);
+    }
+
+    if (pool_global_init(options.threads) < 0) {
+        return 1;
+    }
+
+    int64_t start = av_gettime_relative();
+
+    PoolGroup group;
+    pool_group_init(&group);
+    for (int i = 0; i < count; i++) {
+        PoolTask task = {.run = batch_run,
+                         .arg = &jobs[i],
+                         .priority = POOL_PRIORITY_BACKGROUND,
+                         .deadline = POOL_NO_DEADLINE,
+                         .owner = NULL,
+                         .group = &group};
+        if (pool_submit(pool_global(), task) < 0) {
+            batch_run(&jobs[i]);
+        }
+    }
+    pool_group_wait(pool_global(), &group);
+    pool_group_destroy(&group);
+
+    double elapsed = (av_gettime_relative() - start) / 1e6;
+    int nb_workers = pool_global()->nb_workers;
+    pool_global_free();
+
+    long long files = atomic_load(&options.files);
+    long long failed = atomic_load(&options.failed);
+    long long bytes = atomic_load(&options.bytes);
+    long long frames = atomic_load(&options.frames);
+    double seconds = elapsed > 0 ? elapsed : 1e-6;
+
+    fprintf(options.out,
+            "{\"summary\":{\"files\":%lld,\"failed\":%lld,\"bytes\":%lld,"
+            "\"frames\":%lld,\"threads\":%d,\"time\":%.3f,"
+            "\"files_per_second\":%.2f,\"mb_per_second\":%.2f,"
+            "\"frames_per_second\":%.1f}}\n",
+            files, failed, bytes, frames, nb_workers, elapsed, files / seconds,
+            bytes / seconds / (1024 * 1024), frames / seconds);
+    fclose(options.out);
+
+    for (int i = 0; i < count; i++) {
+        free(jobs[i].path);
+    }
+    free(jobs);
+    pthread_mutex_destroy(&options.out_lock);
+
+    return failed > 0 ? 1 : 0;
+}
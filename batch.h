@@ -0,0 +1,53 @@
+// Headless mode of the player, started with `avp batch ...`. It runs one
+// operation over a list of files (directories are walked recursively) on the
+// shared thread pool, one file per task, and writes a JSON object per file to
+// stdout followed by a summary with the throughput. Diagnostics go to stderr.
+//
+// Operations:
+//   probe   duration, bit rate, streams and codecs, video keyframe count.
+//   poster  writes a PNG of the frame at 10% of the media to the output dir.
+//   verify  decodes every packet, counting frames and decoding errors.
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "media.h"
+
+// Width of the poster frames; the height follows the aspect ratio.
+#define BATCH_POSTER_WIDTH 320
+// Where in the media the poster frame is taken, as a fraction of its length.
+#define BATCH_POSTER_POSITION 0.1
+
+enum BatchOperation {
+    BATCH_PROBE,
+    BATCH_POSTER,
+    BATCH_VERIFY,
+};
+
+typedef struct BatchOptions {
+    enum BatchOperation operation;
+    const char *output_dir;
+    int threads;
+
+    enum MediaIOMode io_mode;
+    size_t io_buffer_size;
+
+    // JSON output, shared by every task.
+    FILE *out;
+    pthread_mutex_t out_lock;
+
+    // Totals for the summary.
+    atomic_llong files, failed, bytes, frames;
+} BatchOptions;
+
+typedef struct BatchJob {
+    BatchOptions *options;
+    char *path;
+    int64_t size;
+} BatchJob;
+
+int batch_main(int argc, char **argv);
+
+#endif  // BATCH_H
@@ -0,0 +1,501 @@
+// Microbenchmarks of the hot paths of the player: the frame queue, the video
+// and audio conversions at the formats the player uses, timestamp formatting
+// and frame allocation.
+//
+// Each benchmark is calibrated to run enough iterations per repetition to be
+// measurable, warmed up, and then repeated; the median and 99th percentile
+// time per iteration are written as JSON (one benchmark per line). Given a
+// baseline written by a previous run, benchmarks whose median got slower than
+// the threshold are reported and the exit status is 1.
+//
+//   make bench
+//   ./bench/avp_bench -o baseline.json
+//   ./bench/avp_bench -b baseline.json -t 10
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <libavutil/samplefmt.h>
+
+#include "media.h"
+#include "queue.h"
+
+#define BENCH_WARMUP_REPS 10
+#define BENCH_REPS 200
+
+// A repetition runs for at least this long (nanoseconds), so the clock
+// resolution does not show in the results.
+#define BENCH_MIN_REP_TIME 200000
+
+#define BENCH_MAX_BASELINE 128
+
+// Size of the video area of the default window, which frames are converted to.
+#define BENCH_PLAYER_W 829
+#define BENCH_PLAYER_H 616
+
+typedef struct Benchmark {
+    const char *name;
+    int param;
+
+    void *(*setup)(int param);
+    void (*run)(void *ctx);
+    void (*teardown)(void *ctx);
+} Benchmark;
+
+typedef struct {
+    char name[64];
+    int64_t iterations;
+    double median, p99, min;
+} BenchResult;
+
+int64_t bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+int bench_compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// ##################### QUEUE #####################
+
+// Queue holding `depth` frames; each iteration adds one and takes one out.
+void *bench_queue_setup(int depth) {
+    FrameQueue *fq = fq_alloc();
+    for (int i = 0; i < depth; i++) {
+        fq_enqueue(fq, NULL, FRAME_TYPE_VIDEO);
+    }
+
+    return fq;
+}
+
+void bench_queue_run(void *ctx) {
+    FrameQueue *fq = ctx;
+    fq_enqueue(fq, NULL, FRAME_TYPE_AUDIO);
+    node_free(fq_dequeue(fq));
+}
+
+void bench_queue_teardown(void *ctx) { fq_free(ctx); }
+
+// ##################### VIDEO CONVERSION #####################
+
+typedef struct {
+    struct SwsContext *sws_ctx;
+    AVFrame *src, *dst;
+} BenchSws;
+
+// Decoded 4:2:0 frame of `height` lines (16:9) to the RGBA of the player.
+void *bench_sws_setup(int height) {
+    BenchSws *bench = malloc(sizeof(BenchSws));
+
+    bench->src = av_frame_alloc();
+    bench->src->width = height * 16 / 9;
+    bench->src->height = height;
+    bench->src->format = AV_PIX_FMT_YUV420P;
+    av_frame_get_buffer(bench->src, 0);
+
+    // Mid grey, so the conversion does real work.
+    for (int plane = 0; plane < 3; plane++) {
+        int lines = plane ? height / 2 : height;
+        memset(bench->src->data[plane], 128,
+               (size_t)bench->src->linesize[plane] * lines);
+    }
+
+    bench->dst = av_frame_alloc();
+    bench->dst->width = BENCH_PLAYER_W;
+    bench->dst->height = BENCH_PLAYER_H;
+    bench->dst->format = AV_PIX_FMT_RGBA;
+    av_frame_get_buffer(bench->dst, 1);
+
+    bench->sws_ctx = sws_getContext(bench->src->width, bench->src->height,
+                                    AV_PIX_FMT_YUV420P, BENCH_PLAYER_W,
+                                    BENCH_PLAYER_H, AV_PIX_FMT_RGBA, SWS_BILINEAR,
+                                    NULL, NULL, NULL);
+
+    return bench;
+}
+
+void bench_sws_run(void *ctx) {
+    BenchSws *bench = ctx;
+    sws_scale(bench->sws_ctx, (const uint8_t *const *)bench->src->data,
+              bench->src->linesize, 0, bench->src->height, bench->dst->data,
+              bench->dst->linesize);
+}
+
+void bench_sws_teardown(void *ctx) {
+    BenchSws *bench = ctx;
+    sws_freeContext(bench->sws_ctx);
+    av_frame_free(&bench->src);
+    av_frame_free(&bench->dst);
+    free(bench);
+}
+
+// Duplicate detection hashes every decoded frame, so it must stay well under
+// the conversion it saves. Reuses the sws setup for the same source frames.
+volatile uint64_t bench_hash;
+
+void bench_hash_run(void *ctx) {
+    BenchSws *bench = ctx;
+    bench_hash = media_frame_hash(bench->src);
+}
+
+// The player's conversion of a 2160p frame, seen at the given zoom: only the
+// visible crop is converted.
+typedef struct {
+    Media *media;
+    AVFrame *src;
+} BenchConvert;
+
+void *bench_convert_setup(int zoom) {
+    BenchConvert *bench = malloc(sizeof(BenchConvert));
+
+    bench->src = av_frame_alloc();
+    bench->src->width = 3840;
+    bench->src->height = 2160;
+    bench->src->format = AV_PIX_FMT_YUV420P;
+    av_frame_get_buffer(bench->src, 0);
+    for (int plane = 0; plane < 3; plane++) {
+        int lines = plane ? 1080 : 2160;
+        memset(bench->src->data[plane], 128,
+               (size_t)bench->src->linesize[plane] * lines);
+    }
+
+    bench->media = media_alloc();
+    bench->media->dst_frame_w = BENCH_PLAYER_W;
+    bench->media->dst_frame_h = BENCH_PLAYER_W * 9 / 16 & ~1;
+    bench->media->dst_frame_fmt = AV_PIX_FMT_RGBA;
+
+    double size = 1.0 / zoom;
+    media_set_crop(bench->media, (1 - size) / 2, (1 - size) / 2, size, size);
+
+    return bench;
+}
+
+// 2160p to 1080p, converted in slices on up to `threads` threads of the pool.
+void *bench_slices_setup(int threads) {
+    BenchConvert *bench = bench_convert_setup(1);
+    bench->media->dst_frame_w = 1920;
+    bench->media->dst_frame_h = 1080;
+    bench->media->slice_threads = threads;
+
+    return bench;
+}
+
+void bench_convert_run(void *ctx) {
+    BenchConvert *bench = ctx;
+    AVFrame *frame = NULL;
+    media_convert_frame(bench->media, bench->src, &frame);
+    av_frame_free(&frame);
+}
+
+void bench_convert_teardown(void *ctx) {
+    BenchConvert *bench = ctx;
+    media_free(bench->media);
+    av_frame_free(&bench->src);
+    free(bench);
+}
+
+// ##################### AUDIO CONVERSION #####################
+
+typedef struct {
+    struct SwrContext *swr_ctx;
+    AVFrame *src, *dst;
+} BenchSwr;
+
+// A typical decoded audio frame (1024 samples) to the packed stereo float the
+// player queues. `format` is the decoder output format.
+void *bench_swr_setup(int format) {
+    BenchSwr *bench = malloc(sizeof(BenchSwr));
+    AVChannelLayout stereo = AV_CHANNEL_LAYOUT_STEREO;
+
+    bench->src = av_frame_alloc();
+    bench->src->format = format;
+    bench->src->sample_rate = 48000;
+    bench->src->nb_samples = 1024;
+    av_channel_layout_copy(&bench->src->ch_layout, &stereo);
+    av_frame_get_buffer(bench->src, 0);
+    av_samples_set_silence(bench->src->extended_data, 0, 1024, 2, format);
+
+    bench->dst = av_frame_alloc();
+    bench->dst->format = OUT_SAMPLE_FMT;
+    bench->dst->sample_rate = 48000;
+    bench->dst->nb_samples = 1024;
+    av_channel_layout_copy(&bench->dst->ch_layout, &stereo);
+    av_frame_get_buffer(bench->dst, 0);
+
+    bench->swr_ctx = NULL;
+    swr_alloc_set_opts2(&bench->swr_ctx, &stereo, OUT_SAMPLE_FMT, 48000, &stereo,
+                        format, 48000, 0, NULL);
+    swr_init(bench->swr_ctx);
+
+    return bench;
+}
+
+void bench_swr_run(void *ctx) {
+    BenchSwr *bench = ctx;
+    swr_convert(bench->swr_ctx, bench->dst->data, bench->dst->nb_samples,
+                (const uint8_t **)bench->src->data, bench->src->nb_samples);
+}
+
+void bench_swr_teardown(void *ctx) {
+    BenchSwr *bench = ctx;
+    swr_free(&bench->swr_ctx);
+    av_frame_free(&bench->src);
+    av_frame_free(&bench->dst);
+    free(bench);
+}
+
+// ##################### TIMESTAMPS #####################
+
+typedef struct {
+    Media *media;
+    int64_t timestamp;
+} BenchTime;
+
+void *bench_time_setup(int param) {
+    (void)param;
+
+    BenchTime *bench = malloc(sizeof(BenchTime));
+    bench->media = media_alloc();
+    bench->timestamp = 0;
+
+    return bench;
+}
+
+void bench_time_run(void *ctx) {
+    BenchTime *bench = ctx;
+
+    // About a frame at a time, as during playback.
+    bench->timestamp += 16683;
+    media_get_formatted_time(bench->media, bench->timestamp, AV_TIME_BASE,
+                             bench->media->formatted_position);
+}
+
+void bench_time_teardown(void *ctx) {
+    BenchTime *bench = ctx;
+    media_free(bench->media);
+    free(bench);
+}
+
+// ##################### FRAME ALLOCATION #####################
+
+// What the player does for every converted video frame.
+void bench_frame_run(void *ctx) {
+    (void)ctx;
+
+    AVFrame *frame = av_frame_alloc();
+    frame->width = BENCH_PLAYER_W;
+    frame->height = BENCH_PLAYER_H;
+    frame->format = AV_PIX_FMT_RGBA;
+    av_frame_get_buffer(frame, 1);
+    av_frame_free(&frame);
+}
+
+static const Benchmark benchmarks[] = {
+    {"fq_enqueue_dequeue/depth=0", 0, bench_queue_setup, bench_queue_run,
+     bench_queue_teardown},
+    {"fq_enqueue_dequeue/depth=16", 16, bench_queue_setup, bench_queue_run,
+     bench_queue_teardown},
+    {"fq_enqueue_dequeue/depth=256", 256, bench_queue_setup, bench_queue_run,
+     bench_queue_teardown},
+    {"sws_scale/yuv420p_720p_to_rgba", 720, bench_sws_setup, bench_sws_run,
+     bench_sws_teardown},
+    {"sws_scale/yuv420p_1080p_to_rgba", 1080, bench_sws_setup, bench_sws_run,
+     bench_sws_teardown},
+    {"sws_scale/yuv420p_2160p_to_rgba", 2160, bench_sws_setup, bench_sws_run,
+     bench_sws_teardown},
+    {"media_frame_hash/yuv420p_1080p", 1080, bench_sws_setup, bench_hash_run,
+     bench_sws_teardown},
+    {"media_frame_hash/yuv420p_2160p", 2160, bench_sws_setup, bench_hash_run,
+     bench_sws_teardown},
+    {"media_convert_frame/2160p_zoom=1", 1, bench_convert_setup,
+     bench_convert_run, bench_convert_teardown},
+    {"media_convert_frame/2160p_zoom=4", 4, bench_convert_setup,
+     bench_convert_run, bench_convert_teardown},
+    {"media_convert_frame/2160p_to_1080p_threads=1", 1, bench_slices_setup,
+     bench_convert_run, bench_convert_teardown},
+    {"media_convert_frame/2160p_to_1080p_threads=4", 4, bench_slices_setup,
+     bench_convert_run, bench_convert_teardown},
+    {"media_convert_frame/2160p_to_1080p_threads=8", 8, bench_slices_setup,
+     bench_convert_run, bench_convert_teardown},
+    {"swr_convert/fltp_to_flt", AV_SAMPLE_FMT_FLTP, bench_swr_setup,
+     bench_swr_run, bench_swr_teardown},
+    {"swr_convert/s16_to_flt", AV_SAMPLE_FMT_S16, bench_swr_setup,
+     bench_swr_run, bench_swr_teardown},
+    {"media_get_formatted_time", 0, bench_time_setup, bench_time_run,
+     bench_time_teardown},
+    {"frame_alloc_rgba", 0, NULL, bench_frame_run, NULL},
+};
+
+// Time per iteration (nanoseconds) of one repetition.
+double bench_rep(const Benchmark *bench, void *ctx, int64_t iterations) {
+    int64_t start = bench_now();
+    for (int64_t i = 0; i < iterations; i++) {
+        bench->run(ctx);
+    }
+
+    return (double)(bench_now() - start) / iterations;
+}
+
+void bench_run(const Benchmark *bench, BenchResult *result) {
+    void *ctx = bench->setup ? bench->setup(bench->param) : NULL;
+
+    int64_t iterations = 1;
+    while (bench_rep(bench, ctx, iterations) * iterations < BENCH_MIN_REP_TIME) {
+        iterations *= 2;
+    }
+
+    for (int i = 0; i < BENCH_WARMUP_REPS; i++) {
+        bench_rep(bench, ctx, iterations);
+    }
+
+    double times[BENCH_REPS];
+    for (int i = 0; i < BENCH_REPS; i++) {
+        times[i] = bench_rep(bench, ctx, iterations);
+    }
+    qsort(times, BENCH_REPS, sizeof(double), bench_compare_double);
+
+    snprintf(result->name, sizeof(result->name), "%s", bench->name);
+    result->iterations = iterations;
+    result->median = times[BENCH_REPS / 2];
+    result->p99 = times[BENCH_REPS * 99 / 100];
+    result->min = times[0];
+
+    if (bench->teardown) {
+        bench->teardown(ctx);
+    }
+}
+
+void bench_write(FILE *out, BenchResult *results, int count) {
+    fprintf(out, "{\"reps\": %d, \"benchmarks\": [\n", BENCH_REPS);
+    for (int i = 0; i < count; i++) {
+        fprintf(out,
+                "{\"name\": \"%s\", \"iterations\": %lld, \"median_ns\": %.2f, "
+                "\"p99_ns\": %.2f, \"min_ns\": %.2f}%s\n",
+                results[i].name, (long long)results[i].iterations,
+                results[i].median, results[i].p99, results[i].min,
+                i + 1 < count ? "," : "");
+    }
+    fprintf(out, "]}\n");
+}
+
+// Reads the medians of a file written by bench_write.
+int bench_read_baseline(const char *path, BenchResult *baseline) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        fprintf(stderr, "bench_read_baseline: cannot open %s\n", path);
+        return -1;
+    }
+
+    int count = 0;
+    char line[512];
+    while (count < BENCH_MAX_BASELINE && fgets(line, sizeof(line), file)) {
+        char *name = strstr(line, "\"name\": \"");
+        char *median = strstr(line, "\"median_ns\": ");
+        if (!name || !median) {
+            continue;
+        }
+
+        name += strlen("\"name\": \"");
+        char *end = strchr(name, '"');
+        if (!end || end - name >= (int)sizeof(baseline[count].name)) {
+            continue;
+        }
+
+        memcpy(baseline[count].name, name, end - name);
+        baseline[count].name[end - name] = '\0';
+        baseline[count].median = strtod(median + strlen("\"median_ns\": "), NULL);
+        count++;
+    }
+    fclose(file);
+
+    return count;
+}
+
+// Prints how every benchmark moved against the baseline. Returns how many got
+// slower than `threshold` percent.
+int bench_compare(BenchResult *results, int count, BenchResult *baseline,
+                  int baseline_count, double threshold) {
+    int regressions = 0;
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < baseline_count; j++) {
+            if (strcmp(results[i].name, baseline[j].name) != 0 ||
+                baseline[j].median <= 0) {
+                continue;
+            }
+
+            double change = (results[i].median / baseline[j].median - 1) * 100;
+            int regressed = change > threshold;
+            regressions += regressed;
+
+            fprintf(stderr, "%-36s %12.1f ns %12.1f ns %+7.1f%%%s\n",
+                    results[i].name, baseline[j].median, results[i].median,
+                    change, regressed ? "  REGRESSION" : "");
+        }
+    }
+
+    return regressions;
+}
+
+int main(int argc, char **argv) {
+    const char *output = NULL, *baseline_path = NULL, *filter = NULL;
+    double threshold = 10;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            baseline_path = argv[++i];
+        } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            threshold = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            filter = argv[++i];
+        } else {
+            fprintf(stderr,
+                    "usage: %s [-o results.json] [-b baseline.json] "
+                    "[-t threshold%%] [-f name filter]\n",
+                    argv[0]);
+            return 2;
+        }
+    }
+
+    int nb_benchmarks = sizeof(benchmarks) / sizeof(benchmarks[0]);
+    BenchResult results[sizeof(benchmarks) / sizeof(benchmarks[0])];
+    int count = 0;
+
+    for (int i = 0; i < nb_benchmarks; i++) {
+        if (filter && !strstr(benchmarks[i].name, filter)) {
+            continue;
+        }
+
+        fprintf(stderr, "running %s\n", benchmarks[i].name);
+        bench_run(&benchmarks[i], &results[count++]);
+    }
+
+    FILE *out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "cannot open %s\n", output);
+        return 1;
+    }
+    bench_write(out, results, count);
+    if (output) {
+        fclose(out);
+    }
+
+    if (!baseline_path) {
+        return 0;
+    }
+
+    BenchResult baseline[BENCH_MAX_BASELINE];
+    int baseline_count = bench_read_baseline(baseline_path, baseline);
+    if (baseline_count < 0) {
+        return 1;
+    }
+
+    return bench_compare(results, count, baseline, baseline_count, threshold) > 0
+               ? 1
+               : 0;
+}
@@ -1,11 +1,14 @@
 #ifndef COMMON_H
 #define COMMON_H
 
-#define MAX_MEDIA 10
+#define MAX_MEDIA 16
 
 enum FrameType {
     FRAME_TYPE_AUDIO,
     FRAME_TYPE_VIDEO,
+    // A video frame identical to the previous one. It only has timestamps:
+    // the previous frame stays on screen for its duration.
+    FRAME_TYPE_REPEAT,
 };
 
 #endif // COMMON_H
\ No newline at end of file
@@ -0,0 +1,76 @@
+#include "disk_cache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+int disk_cache_mkdir(const char *path) {
+    char parent[1024];
+    snprintf(parent, sizeof(parent), "%s", path);
+
+    char *slash = strrchr(parent, '/');
+    if (slash && slash != parent) {
+        *slash = '\0';
+        if (mkdir(parent, 0755) < 0 && errno != EEXIST) {
+            return -1;
+        }
+    }
+
+    if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+        return -1;
+    }
+
+    return 0;
+}
+
+int disk_cache_identity(const char *filename, int64_t *file_size,
+                        int64_t *file_mtime) {
+    struct stat st;
+    if (stat(filename, &st) < 0) {
+        return -1;
+    }
+
+    *file_size = st.st_size;
+    *file_mtime = st.st_mtime;
+
+    return 0;
+}
+
+char *disk_cache_path(const char *kind, const char *ext, const char *filename,
+                      int64_t file_size, int64_t file_mtime) {
+    char dir[1024];
+    const char *base = getenv("AVP_CACHE_DIR");
+    if (base) {
+        snprintf(dir, sizeof(dir), "%s", base);
+    } else if ((base = getenv("XDG_CACHE_HOME"))) {
+        snprintf(dir, sizeof(dir), "%s/avp", base);
+    } else if ((base = getenv("HOME"))) {
+        snprintf(dir, sizeof(dir), "%s/.cache/avp", base);
+    } else {
+        return NULL;
+    }
+
+    if (disk_cache_mkdir(dir) < 0) {
+        printf("disk_cache_path: cannot create %s\n", dir);
+        return NULL;
+    }
+
+    // FNV-1a of the path, mixed with the size and modification time.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (const char *c = filename; *c; c++) {
+        hash = (hash ^ (uint8_t)*c) * 0x100000001b3ULL;
+    }
+    hash ^= (uint64_t)file_size * 0x9e3779b97f4a7c15ULL;
+    hash ^= (uint64_t)file_mtime;
+
+    char *path = malloc(1024);
+    if (!path) {
+        return NULL;
+    }
+    snprintf(path, 1024, "%s/%s-%016llx.%s", dir, kind, (unsigned long long)hash,
+             ext);
+
+    return path;
+}
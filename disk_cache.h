@@ -0,0 +1,22 @@
+// Location of the files the player caches between runs: $AVP_CACHE_DIR, or
+// the user cache directory. Entries are named after the media they describe
+// and its identity (path, size and modification time), so a replaced file
+// gets new entries instead of reusing stale ones.
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <stdint.h>
+
+// Creates `path` and its parent if needed.
+int disk_cache_mkdir(const char *path);
+
+// Returns the size and modification time of `filename`.
+int disk_cache_identity(const char *filename, int64_t *file_size,
+                        int64_t *file_mtime);
+
+// Returns "<cache dir>/<kind>-<hash>.<ext>" for the given media, or NULL if
+// there is no cache directory. The result must be freed by the caller.
+char *disk_cache_path(const char *kind, const char *ext, const char *filename,
+                      int64_t file_size, int64_t file_mtime);
+
+#endif  // DISK_CACHE_H
@@ -0,0 +1,114 @@
+#include "file_watch.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <sys/inotify.h>
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+#include <sys/event.h>
+#endif
+
+FileWatch *file_watch_open(const char *path) {
+    FileWatch *watch = malloc(sizeof(FileWatch));
+    if (!watch) {
+        return NULL;
+    }
+
+    watch->fd = -1;
+    watch->wd = -1;
+    watch->file_fd = -1;
+
+#if defined(__linux__)
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd >= 0) {
+        watch->wd =
+            inotify_add_watch(watch->fd, path, IN_MODIFY | IN_CLOSE_WRITE);
+    }
+    if (watch->wd < 0) {
+        printf("file_watch_open: inotify failed for %s: %s\n", path,
+               strerror(errno));
+    }
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+    watch->fd = kqueue();
+    watch->file_fd = open(path, O_RDONLY);
+    if (watch->fd >= 0 && watch->file_fd >= 0) {
+        struct kevent change;
+        EV_SET(&change, watch->file_fd, EVFILT_VNODE, EV_ADD | EV_CLEAR,
+               NOTE_WRITE | NOTE_EXTEND, 0, NULL);
+        if (kevent(watch->fd, &change, 1, NULL, 0, NULL) == 0) {
+            watch->wd = 0;
+        }
+    }
+    if (watch->wd < 0) {
+        printf("file_watch_open: kqueue failed for %s: %s\n", path,
+               strerror(errno));
+    }
+#else
+    (void)path;
+#endif
+
+    return watch;
+}
+
+int file_watch_poll(FileWatch *watch) {
+    if (!watch || watch->wd < 0) {
+        return FILE_WATCH_MODIFIED;
+    }
+
+    int events = 0;
+
+#if defined(__linux__)
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    ssize_t len;
+    while ((len = read(watch->fd, buf, sizeof(buf))) > 0) {
+        for (char *p = buf; p < buf + len;) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->mask & IN_MODIFY) {
+                events |= FILE_WATCH_MODIFIED;
+            }
+            if (event->mask & IN_CLOSE_WRITE) {
+                events |= FILE_WATCH_CLOSED;
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+    struct kevent event;
+    struct timespec timeout = {0, 0};
+    while (kevent(watch->fd, NULL, 0, &event, 1, &timeout) > 0) {
+        events |= FILE_WATCH_MODIFIED;
+    }
+#endif
+
+    return events;
+}
+
+void file_watch_close(FileWatch *watch) {
+    if (!watch) {
+        return;
+    }
+
+    if (watch->file_fd >= 0) {
+        close(watch->file_fd);
+    }
+    if (watch->fd >= 0) {
+        close(watch->fd);
+    }
+    free(watch);
+}
+
+int file_watch_recent(const char *path, double seconds) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        return 0;
+    }
+
+    return difftime(time(NULL), st.st_mtime) <= seconds;
+}
@@ -0,0 +1,31 @@
+// Tells when a file is written to or closed by its writer, without stat'ing
+// it over and over. Uses inotify on Linux and kqueue on macOS and the BSDs;
+// elsewhere every check reports the file as modified, and the caller ends up
+// polling its size.
+#ifndef FILE_WATCH_H
+#define FILE_WATCH_H
+
+enum FileWatchEvent {
+    FILE_WATCH_MODIFIED = 1,
+    // A writer closed the file. Only reported by inotify.
+    FILE_WATCH_CLOSED = 2,
+};
+
+typedef struct FileWatch {
+    // inotify or kqueue descriptor, and what it watches.
+    int fd, wd, file_fd;
+} FileWatch;
+
+FileWatch *file_watch_open(const char *path);
+
+// Returns the FileWatchEvent flags of what happened to the file since the last
+// call, 0 if nothing did. Never blocks.
+int file_watch_poll(FileWatch *watch);
+
+void file_watch_close(FileWatch *watch);
+
+// Returns 1 if the file was modified in the last `seconds`, as a file still
+// being written would be.
+int file_watch_recent(const char *path, double seconds);
+
+#endif  // FILE_WATCH_H
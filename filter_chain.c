@@ -0,0 +1,335 @@
+#include "filter_chain.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
+#include <libavutil/time.h>
+
+#include "media.h"
+
+FilterChain *filter_chain_alloc(enum AVMediaType type, const char *description) {
+    if (!description || !*description) {
+        return NULL;
+    }
+
+    FilterChain *chain = malloc(sizeof(FilterChain));
+    if (!chain) {
+        return NULL;
+    }
+
+    chain->type = type;
+    chain->nb_stages = 0;
+    chain->time_base = (AVRational){1, AV_TIME_BASE};
+    chain->flushing = 0;
+    chain->broken = 0;
+
+    // Commas inside quotes or escaped with a backslash belong to the options
+    // of a filter.
+    const char *start = description;
+    int quoted = 0;
+    for (const char *c = description;; c++) {
+        if (*c == '\\' && c[1]) {
+            c++;
+            continue;
+        }
+        if (*c == '\'') {
+            quoted = !quoted;
+        }
+        if ((*c != ',' || quoted) && *c != '\0') {
+            continue;
+        }
+
+        if (c > start) {
+            if (chain->nb_stages == FILTER_CHAIN_MAX_STAGES) {
+                printf("filter_chain_alloc: more than %d filters\n",
+                       FILTER_CHAIN_MAX_STAGES);
+                filter_chain_free(chain);
+                return NULL;
+            }
+
+            FilterStage *stage = &chain->stages[chain->nb_stages++];
+            memset(stage, 0, sizeof(FilterStage));
+            stage->description = strndup(start, c - start);
+            if (!stage->description) {
+                filter_chain_free(chain);
+                return NULL;
+            }
+        }
+
+        if (*c == '\0') {
+            break;
+        }
+        start = c + 1;
+    }
+
+    if (chain->nb_stages == 0) {
+        free(chain);
+        return NULL;
+    }
+
+    return chain;
+}
+
+void filter_stage_release(FilterStage *stage) {
+    avfilter_graph_free(&stage->graph);
+    stage->src = NULL;
+    stage->sink = NULL;
+    stage->flushed = 0;
+    av_channel_layout_uninit(&stage->ch_layout);
+}
+
+int filter_stage_matches(FilterChain *chain, FilterStage *stage,
+                         const AVFrame *frame, AVRational time_base) {
+    if (av_cmp_q(stage->time_base, time_base) != 0 ||
+        stage->format != frame->format) {
+        return 0;
+    }
+
+    if (chain->type == AVMEDIA_TYPE_VIDEO) {
+        return stage->width == frame->width && stage->height == frame->height &&
+               av_cmp_q(stage->sample_aspect_ratio,
+                        frame->sample_aspect_ratio) == 0;
+    }
+
+    return stage->sample_rate == frame->sample_rate &&
+           av_channel_layout_compare(&stage->ch_layout, &frame->ch_layout) == 0;
+}
+
+int filter_stage_build(FilterChain *chain, FilterStage *stage,
+                       const AVFrame *frame, AVRational time_base) {
+    filter_stage_release(stage);
+
+    char args[512];
+    const AVFilter *src_filter, *sink_filter;
+    if (chain->type == AVMEDIA_TYPE_VIDEO) {
+        AVRational sar = frame->sample_aspect_ratio;
+        if (sar.num <= 0 || sar.den <= 0) {
+            sar = (AVRational){0, 1};
+        }
+
+        snprintf(args, sizeof(args),
+                 "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:"
+                 "pixel_aspect=%d/%d",
+                 frame->width, frame->height, frame->format, time_base.num,
+                 time_base.den, sar.num, sar.den);
+        src_filter = avfilter_get_by_name("buffer");
+        sink_filter = avfilter_get_by_name("buffersink");
+    } else {
+        char layout[64];
+        av_channel_layout_describe(&frame->ch_layout, layout, sizeof(layout));
+
+        snprintf(args, sizeof(args),
+                 "time_base=%d/%d:sample_rate=%d:sample_fmt=%s:"
+                 "channel_layout=%s",
+                 time_base.num, time_base.den, frame->sample_rate,
+                 av_get_sample_fmt_name(frame->format), layout);
+        src_filter = avfilter_get_by_name("abuffer");
+        sink_filter = avfilter_get_by_name("abuffersink");
+    }
+
+    stage->graph = avfilter_graph_alloc();
+    if (!stage->graph) {
+        printf("filter_stage_build: avfilter_graph_alloc failed\n");
+        return MEDIA_ERR_LIBAV;
+    }
+
+    if (avfilter_graph_create_filter(&stage->src, src_filter, "in", args, NULL,
+                                     stage->graph) < 0 ||
+        avfilter_graph_create_filter(&stage->sink, sink_filter, "out", NULL,
+                                     NULL, stage->graph) < 0) {
+        printf("filter_stage_build: failed to create the buffer filters\n");
+        filter_stage_release(stage);
+        return MEDIA_ERR_LIBAV;
+    }
+
+    // The description goes between the source, which feeds its first input,
+    // and the sink, fed by its last output.
+    AVFilterInOut *outputs = avfilter_inout_alloc();
+    AVFilterInOut *inputs = avfilter_inout_alloc();
+    int ret = MEDIA_ERR_LIBAV;
+    if (outputs && inputs) {
+        outputs->name = av_strdup("in");
+        outputs->filter_ctx = stage->src;
+        outputs->pad_idx = 0;
+        outputs->next = NULL;
+
+        inputs->name = av_strdup("out");
+        inputs->filter_ctx = stage->sink;
+        inputs->pad_idx = 0;
+        inputs->next = NULL;
+
+        if (avfilter_graph_parse_ptr(stage->graph, stage->description, &inputs,
+                                     &outputs, NULL) >= 0 &&
+            avfilter_graph_config(stage->graph, NULL) >= 0) {
+            ret = 0;
+        }
+    }
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+
+    if (ret < 0) {
+        printf("filter_stage_build: failed to build \"%s\"\n",
+               stage->description);
+        filter_stage_release(stage);
+        return ret;
+    }
+
+    stage->width = frame->width;
+    stage->height = frame->height;
+    stage->format = frame->format;
+    stage->sample_rate = frame->sample_rate;
+    stage->sample_aspect_ratio = frame->sample_aspect_ratio;
+    stage->time_base = time_base;
+    if (chain->type == AVMEDIA_TYPE_AUDIO) {
+        av_channel_layout_copy(&stage->ch_layout, &frame->ch_layout);
+    }
+    stage->builds++;
+
+    return 0;
+}
+
+// Sends a frame into the graph of stage `i`, building the graph first when it
+// does not exist yet or was built for frames of another format.
+int filter_stage_push(FilterChain *chain, int i, AVFrame *frame,
+                      AVRational time_base) {
+    FilterStage *stage = &chain->stages[i];
+
+    if (!stage->graph || stage->flushed ||
+        !filter_stage_matches(chain, stage, frame, time_base)) {
+        int ret = filter_stage_build(chain, stage, frame, time_base);
+        if (ret < 0) {
+            chain->broken = 1;
+            return ret;
+        }
+    }
+
+    int64_t start = av_gettime_relative();
+    int ret = av_buffersrc_add_frame_flags(stage->src, frame,
+                                           AV_BUFFERSRC_FLAG_KEEP_REF);
+    stage->time += (av_gettime_relative() - start) / 1e6;
+
+    if (ret < 0) {
+        printf("filter_stage_push: av_buffersrc_add_frame_flags failed: %s\n",
+               av_err2str(ret));
+        return MEDIA_ERR_LIBAV;
+    }
+
+    return 0;
+}
+
+// Gets a frame out of stage `i`, feeding it from the stages before as long as
+// it asks for more. `time_base` is set to the one of the frame.
+int filter_stage_pull(FilterChain *chain, int i, AVFrame *frame,
+                      AVRational *time_base) {
+    FilterStage *stage = &chain->stages[i];
+
+    while (1) {
+        if (stage->graph) {
+            int64_t start = av_gettime_relative();
+            int ret = av_buffersink_get_frame(stage->sink, frame);
+            stage->time += (av_gettime_relative() - start) / 1e6;
+
+            if (ret >= 0) {
+                *time_base = av_buffersink_get_time_base(stage->sink);
+                stage->frames++;
+                return 0;
+            } else if (ret == AVERROR_EOF) {
+                filter_stage_release(stage);
+                return MEDIA_ERR_EOF;
+            } else if (ret != AVERROR(EAGAIN)) {
+                printf("filter_stage_pull: av_buffersink_get_frame failed: "
+                       "%s\n",
+                       av_err2str(ret));
+                return MEDIA_ERR_LIBAV;
+            }
+        }
+
+        if (i == 0) {
+            return chain->flushing && !stage->graph ? MEDIA_ERR_EOF
+                                                    : MEDIA_ERR_MORE_DATA;
+        }
+
+        AVRational in_time_base;
+        int ret = filter_stage_pull(chain, i - 1, frame, &in_time_base);
+        if (ret == MEDIA_ERR_EOF) {
+            // What came before is drained; this graph gives out what it still
+            // holds and then ends as well.
+            if (!stage->graph) {
+                return MEDIA_ERR_EOF;
+            }
+            av_buffersrc_add_frame_flags(stage->src, NULL, 0);
+            stage->flushed = 1;
+            continue;
+        } else if (ret < 0) {
+            return ret;
+        }
+
+        ret = filter_stage_push(chain, i, frame, in_time_base);
+        av_frame_unref(frame);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+}
+
+int filter_chain_send(FilterChain *chain, AVFrame *frame, AVRational time_base) {
+    if (!frame) {
+        FilterStage *stage = &chain->stages[0];
+        if (stage->graph && !stage->flushed) {
+            av_buffersrc_add_frame_flags(stage->src, NULL, 0);
+            stage->flushed = 1;
+        }
+        chain->flushing = 1;
+        return 0;
+    }
+
+    chain->time_base = time_base;
+    return filter_stage_push(chain, 0, frame, time_base);
+}
+
+int filter_chain_receive(FilterChain *chain, AVFrame *frame) {
+    AVRational time_base;
+    int ret = filter_stage_pull(chain, chain->nb_stages - 1, frame, &time_base);
+    if (ret == MEDIA_ERR_EOF) {
+        chain->flushing = 0;
+        return ret;
+    } else if (ret < 0) {
+        return ret;
+    }
+
+    // Filters may change the time base, e.g. a deinterlacer giving a frame per
+    // field; the player only knows the one of the stream.
+    if (frame->pts != AV_NOPTS_VALUE) {
+        frame->pts = av_rescale_q(frame->pts, time_base, chain->time_base);
+    }
+    frame->duration = av_rescale_q(frame->duration, time_base, chain->time_base);
+    frame->best_effort_timestamp = frame->pts;
+
+    return 0;
+}
+
+void filter_chain_reset(FilterChain *chain) {
+    if (!chain) {
+        return;
+    }
+
+    for (int i = 0; i < chain->nb_stages; i++) {
+        filter_stage_release(&chain->stages[i]);
+    }
+    chain->flushing = 0;
+}
+
+void filter_chain_free(FilterChain *chain) {
+    if (!chain) {
+        return;
+    }
+
+    for (int i = 0; i < chain->nb_stages; i++) {
+        filter_stage_release(&chain->stages[i]);
+        free(chain->stages[i].description);
+    }
+    free(chain);
+}
@@ -0,0 +1,78 @@
+// Chain of libavfilter filters run on the decoded frames of one stream, before
+// they are converted and queued. The chain is described like an ffmpeg -vf or
+// -af option ("bwdif,hqdn3d"); every filter of it runs in its own graph, so the
+// time spent in each can be measured. A graph is built from the first frame
+// that reaches it, and only built again when the frames going in change
+// format: size, pixel format or aspect ratio for video, sample rate, sample
+// format or channel layout for audio.
+#ifndef FILTER_CHAIN_H
+#define FILTER_CHAIN_H
+
+#include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+
+#define FILTER_CHAIN_MAX_STAGES 8
+
+// Deinterlacer used for interlaced video when no video filters were given.
+// It gives one frame per frame, not per field, and leaves progressive frames of
+// mixed content alone.
+#define FILTER_CHAIN_DEINTERLACE "bwdif=mode=send_frame:deint=interlaced"
+
+typedef struct {
+    char *description;
+
+    AVFilterGraph *graph;
+    AVFilterContext *src, *sink;
+
+    // Input the graph was built for.
+    int width, height, format, sample_rate;
+    AVRational sample_aspect_ratio, time_base;
+    AVChannelLayout ch_layout;
+
+    // Set once the end of the input was sent into the graph.
+    int flushed;
+
+    // Time spent in the filter (seconds), frames it produced, and how many
+    // times the graph was built.
+    double time;
+    int64_t frames, builds;
+} FilterStage;
+
+typedef struct FilterChain {
+    enum AVMediaType type;
+
+    FilterStage stages[FILTER_CHAIN_MAX_STAGES];
+    int nb_stages;
+
+    // Time base of the frames sent in. Filtered frames are given back in it.
+    AVRational time_base;
+
+    // Set from a flush until the chain gave out its last frame.
+    int flushing;
+
+    // Set when a graph could not be built, because the description is wrong
+    // or the filters do not take the frames. It would fail again for every
+    // frame.
+    int broken;
+} FilterChain;
+
+// Splits `description` on its unescaped commas. Returns NULL if it is empty
+// or has too many filters.
+FilterChain *filter_chain_alloc(enum AVMediaType type, const char *description);
+
+// Sends a decoded frame in `time_base`, which is kept by the caller. A NULL
+// frame flushes the chain: the filters give out what they still hold, and the
+// graphs are built again for the frames after it.
+int filter_chain_send(FilterChain *chain, AVFrame *frame, AVRational time_base);
+
+// Gets the next filtered frame. Returns MEDIA_ERR_MORE_DATA when the chain
+// needs more input, and MEDIA_ERR_EOF once a flush went through.
+int filter_chain_receive(FilterChain *chain, AVFrame *frame);
+
+// Drops whatever the filters hold, e.g. after a seek. The graphs are built
+// again from the next frame.
+void filter_chain_reset(FilterChain *chain);
+
+void filter_chain_free(FilterChain *chain);
+
+#endif  // FILTER_CHAIN_H
@@ -0,0 +1,472 @@
+#include "gop_cache.h"
+
+GopCache *gop_cache_alloc(size_t max_bytes) {
+    GopCache *cache = malloc(sizeof(GopCache));
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->media = NULL;
+    cache->owner = NULL;
+
+    cache->time_base = (AVRational){1, 1};
+    cache->start_pts = 0;
+    cache->frame_duration = 1;
+
+    cache->frames = NULL;
+    cache->count = 0;
+    cache->capacity = 0;
+    cache->bytes = 0;
+    cache->max_bytes = max_bytes;
+
+    cache->position = 0;
+    cache->request = AV_NOPTS_VALUE;
+    cache->exhausted = AV_NOPTS_VALUE;
+    cache->busy = 0;
+    cache->decoding = 0;
+    cache->running = 0;
+
+    pool_group_init(&cache->group);
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->cond, NULL);
+
+    return cache;
+}
+
+// Index of the first cached frame with a pts greater or equal to `pts`.
+int gop_cache_lower_bound(GopCache *cache, int64_t pts) {
+    int lo = 0, hi = cache->count;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (cache->frames[mid].pts < pts) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
+
+// Frames behind the position were already shown when playing backwards, so
+// they are worth half as much as the ones ahead of it.
+int64_t gop_cache_distance(GopCache *cache, int64_t pts) {
+    return pts >= cache->position ? 2 * (pts - cache->position)
+                                  : cache->position - pts;
+}
+
+size_t gop_cache_frame_size(AVFrame *frame) {
+    return av_image_get_buffer_size(frame->format, frame->width, frame->height,
+                                    1);
+}
+
+void gop_cache_evict(GopCache *cache, int idx) {
+    cache->bytes -= gop_cache_frame_size(cache->frames[idx].frame);
+    av_frame_free(&cache->frames[idx].frame);
+
+    memmove(&cache->frames[idx], &cache->frames[idx + 1],
+            (cache->count - idx - 1) * sizeof(CachedFrame));
+    cache->count--;
+
+    // The frame that followed the evicted one lost its predecessor.
+    if (idx < cache->count) {
+        cache->frames[idx].has_prev = 0;
+    }
+}
+
+// Adds a decoded frame to the cache, taking ownership of it. `prev_pts` is
+// the pts of the frame decoded right before it, if any. Must be called with
+// the lock held.
+void gop_cache_insert(GopCache *cache, AVFrame *frame, int64_t pts,
+                      int64_t prev_pts) {
+    int idx = gop_cache_lower_bound(cache, pts);
+
+    // Already cached: only link it with the frame that was decoded before it.
+    if (idx < cache->count && cache->frames[idx].pts == pts) {
+        if (prev_pts != AV_NOPTS_VALUE && idx > 0 &&
+            cache->frames[idx - 1].pts == prev_pts) {
+            cache->frames[idx].has_prev = 1;
+        }
+        av_frame_free(&frame);
+        return;
+    }
+
+    size_t size = gop_cache_frame_size(frame);
+    while (cache->count > 0 && cache->bytes + size > cache->max_bytes) {
+        int victim = gop_cache_distance(cache, cache->frames[0].pts) >
+                             gop_cache_distance(cache,
+                                                cache->frames[cache->count - 1].pts)
+                         ? 0
+                         : cache->count - 1;
+
+        // The new frame is the least useful one, so just drop it.
+        if (gop_cache_distance(cache, pts) >=
+            gop_cache_distance(cache, cache->frames[victim].pts)) {
+            av_frame_free(&frame);
+            return;
+        }
+
+        gop_cache_evict(cache, victim);
+        if (victim < idx) {
+            idx--;
+        }
+    }
+
+    if (cache->count == cache->capacity) {
+        int capacity = cache->capacity ? cache->capacity * 2 : 64;
+        CachedFrame *frames =
+            realloc(cache->frames, capacity * sizeof(CachedFrame));
+        if (!frames) {
+            av_frame_free(&frame);
+            return;
+        }
+
+        cache->frames = frames;
+        cache->capacity = capacity;
+    }
+
+    memmove(&cache->frames[idx + 1], &cache->frames[idx],
+            (cache->count - idx) * sizeof(CachedFrame));
+    cache->frames[idx].frame = frame;
+    cache->frames[idx].pts = pts;
+    cache->frames[idx].has_prev = prev_pts != AV_NOPTS_VALUE && idx > 0 &&
+                                  cache->frames[idx - 1].pts == prev_pts;
+    cache->count++;
+    cache->bytes += size;
+
+    // Whatever followed the insertion point is not adjacent to its old
+    // predecessor anymore. It gets linked again when it is decoded next.
+    if (idx + 1 < cache->count) {
+        cache->frames[idx + 1].has_prev = 0;
+    }
+}
+
+// Decodes forward from the current demuxer position, caching every frame,
+// until the frame at `end` is reached. Returns the number of frames found
+// before `end`.
+int gop_cache_decode_run(GopCache *cache, int64_t end) {
+    Media *media = cache->media;
+    int64_t prev_pts = AV_NOPTS_VALUE;
+    int decoded = 0, done = 0, drained = 0;
+
+    while (!done) {
+        int ret = media_read_frame(media);
+        if (ret == MEDIA_ERR_EOF && !drained) {
+            avcodec_send_packet(media->video_ctx, NULL);
+            drained = 1;
+            ret = media_receive_frames(media, media->video_ctx, 1);
+        } else if (ret < 0) {
+            return ret;
+        } else if (media->pkt->stream_index != media->video_stream_idx) {
+            continue;
+        } else {
+            ret = media_decode(media);
+        }
+
+        if (ret < 0 && ret != MEDIA_ERR_MORE_DATA && ret != MEDIA_ERR_EOF) {
+            return ret;
+        }
+
+        while (!fq_empty(media->queue)) {
+            Node *node = fq_dequeue(media->queue);
+            int64_t pts = node->frame->best_effort_timestamp;
+            if (done || node->type != FRAME_TYPE_VIDEO ||
+                pts == AV_NOPTS_VALUE) {
+                node_free(node);
+                continue;
+            }
+
+            pthread_mutex_lock(&cache->lock);
+            gop_cache_insert(cache, node->frame, pts, prev_pts);
+            pthread_mutex_unlock(&cache->lock);
+
+            node->frame = NULL;
+            node_free(node);
+
+            prev_pts = pts;
+            if (pts >= end) {
+                done = 1;
+            } else {
+                decoded++;
+            }
+        }
+
+        // The tail frames the drain returned are cached by now.
+        if (drained) {
+            done = 1;
+        }
+    }
+
+    if (drained) {
+        avcodec_flush_buffers(media->video_ctx);
+    }
+
+    return decoded;
+}
+
+// Decodes the GOP that holds the frame right before `end`.
+int gop_cache_decode(GopCache *cache, int64_t end) {
+    int64_t target = end - cache->frame_duration;
+    int64_t backoff = av_rescale_q(AV_TIME_BASE, AV_TIME_BASE_Q, cache->time_base);
+
+    for (int attempt = 0; attempt < 4; attempt++) {
+        if (target < cache->start_pts) {
+            target = cache->start_pts;
+        }
+
+        int ret = media_seek_to(
+            cache->media, av_rescale_q(target, cache->time_base, AV_TIME_BASE_Q));
+        if (ret < 0) {
+            return ret;
+        }
+
+        ret = gop_cache_decode_run(cache, end);
+        if (ret != 0 || target <= cache->start_pts) {
+            return ret;
+        }
+
+        // Without an index the seek may land on the GOP at `end` itself, so
+        // look further back.
+        target -= backoff;
+        backoff *= 2;
+    }
+
+    return 0;
+}
+
+// Runs on the pool, and handles requests until there are none left.
+void gop_cache_job(void *arg) {
+    GopCache *cache = arg;
+
+    pthread_mutex_lock(&cache->lock);
+
+    // The job may have been submitted again at a higher priority; the copy
+    // that starts first does the work.
+    if (cache->decoding || !cache->busy) {
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    cache->decoding = 1;
+
+    while (cache->running && cache->request != AV_NOPTS_VALUE) {
+        int64_t end = cache->request;
+        cache->request = AV_NOPTS_VALUE;
+        pthread_mutex_unlock(&cache->lock);
+
+        int ret = gop_cache_decode(cache, end);
+
+        pthread_mutex_lock(&cache->lock);
+        if (ret <= 0) {
+            cache->exhausted = end;
+        }
+    }
+
+    cache->decoding = 0;
+    cache->busy = 0;
+    pthread_cond_broadcast(&cache->cond);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+int gop_cache_submit(GopCache *cache, enum PoolPriority priority) {
+    PoolTask task = {.run = gop_cache_job,
+                     .arg = cache,
+                     .priority = priority,
+                     .deadline = POOL_NO_DEADLINE,
+                     .owner = cache->owner,
+                     .group = &cache->group};
+    return pool_submit(pool_global(), task);
+}
+
+// Asks for the GOP before `end`. Only one job runs at a time, since they share
+// the private media. Must be called with the lock held.
+void gop_cache_request(GopCache *cache, int64_t end,
+                       enum PoolPriority priority) {
+    cache->request = end;
+    if (cache->busy) {
+        return;
+    }
+
+    cache->busy = 1;
+    if (gop_cache_submit(cache, priority) < 0) {
+        cache->busy = 0;
+        cache->request = AV_NOPTS_VALUE;
+    }
+}
+
+int gop_cache_init(GopCache *cache, Media *media) {
+    if (!cache || !media) {
+        printf("gop_cache_init: cache or media is NULL\n");
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    if (!media->video_ctx) {
+        return MEDIA_ERR_NO_STREAM;
+    }
+
+    cache->media = media_alloc();
+    if (!cache->media) {
+        printf("gop_cache_init: media_alloc failed\n");
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    cache->media->io_mode = media->io_mode;
+    cache->media->io_buffer_size = media->io_buffer_size;
+    cache->media->video_filters = media->video_filters;
+    cache->media->deinterlace = media->deinterlace;
+    cache->media->fast_open = media->fast_open;
+    cache->media->sws_flags = media->sws_flags;
+    // Cached frames are shown in place of the parent's, so they must look
+    // the same.
+    media_set_crop(cache->media, media->crop_x, media->crop_y, media->crop_w,
+                   media->crop_h);
+
+    int ret = media_init(cache->media, media->dst_frame_w, media->dst_frame_h,
+                         media->dst_frame_fmt, media->filename);
+    if (ret < 0) {
+        printf("gop_cache_init: media_init failed\n");
+        media_free(cache->media);
+        cache->media = NULL;
+        return ret;
+    }
+
+    // The job only decodes video, so let the demuxer drop the audio.
+    if (cache->media->audio_stream_idx >= 0) {
+        cache->media->fmt_ctx->streams[cache->media->audio_stream_idx]->discard =
+            AVDISCARD_ALL;
+    }
+
+    AVStream *stream =
+        cache->media->fmt_ctx->streams[cache->media->video_stream_idx];
+    cache->time_base = stream->time_base;
+    cache->start_pts =
+        stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+
+    if (stream->avg_frame_rate.num > 0 && stream->avg_frame_rate.den > 0) {
+        cache->frame_duration = av_rescale_q(1, av_inv_q(stream->avg_frame_rate),
+                                             cache->time_base);
+    }
+    if (cache->frame_duration <= 0) {
+        cache->frame_duration = 1;
+    }
+
+    cache->owner = &media->pool_owner;
+    cache->running = 1;
+
+    return 0;
+}
+
+// Asks for the GOP before the contiguous run of frames that holds
+// `idx`, so it is ready by the time playback gets there. Must be called with
+// the lock held.
+void gop_cache_prefetch(GopCache *cache, int idx) {
+    while (idx > 0 && cache->frames[idx].has_prev) {
+        idx--;
+    }
+
+    int64_t start = cache->frames[idx].pts;
+    if (start <= cache->start_pts || start == cache->exhausted ||
+        cache->busy) {
+        return;
+    }
+
+    gop_cache_request(cache, start, POOL_PRIORITY_BACKGROUND);
+}
+
+int gop_cache_prev(GopCache *cache, int64_t pts, AVFrame **frame) {
+    if (!cache || !frame || !cache->running) {
+        printf("gop_cache_prev: cache is not running\n");
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    *frame = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->position = pts;
+
+    int requested = 0, raised = 0;
+    while (1) {
+        int idx = gop_cache_lower_bound(cache, pts);
+        if (idx > 0 && idx < cache->count && cache->frames[idx].has_prev) {
+            *frame = av_frame_clone(cache->frames[idx - 1].frame);
+            gop_cache_prefetch(cache, idx - 1);
+            pthread_mutex_unlock(&cache->lock);
+
+            return *frame ? 0 : MEDIA_ERR_LIBAV;
+        }
+
+        // Whatever the job is doing may be the GOP we are missing. A job still
+        // queued as a prefetch would wait behind the other background work,
+        // so it is submitted again at the priority of somebody waiting.
+        if (cache->busy) {
+            if (!cache->decoding && !raised) {
+                gop_cache_submit(cache, POOL_PRIORITY_AUDIBLE);
+                raised = 1;
+            }
+            pthread_cond_wait(&cache->cond, &cache->lock);
+            continue;
+        }
+
+        if (requested || pts <= cache->start_pts || pts == cache->exhausted) {
+            break;
+        }
+
+        // Somebody is waiting on this one.
+        gop_cache_request(cache, pts, POOL_PRIORITY_AUDIBLE);
+        requested = 1;
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    return MEDIA_ERR_EOF;
+}
+
+int gop_cache_next(GopCache *cache, int64_t pts, AVFrame **frame) {
+    if (!cache || !frame) {
+        printf("gop_cache_next: cache or frame is NULL\n");
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    *frame = NULL;
+
+    pthread_mutex_lock(&cache->lock);
+    cache->position = pts;
+
+    int idx = gop_cache_lower_bound(cache, pts + 1);
+    if (idx > 0 && idx < cache->count && cache->frames[idx].has_prev) {
+        *frame = av_frame_clone(cache->frames[idx].frame);
+    }
+
+    pthread_mutex_unlock(&cache->lock);
+
+    if (!*frame) {
+        return MEDIA_ERR_MORE_DATA;
+    }
+
+    return 0;
+}
+
+void gop_cache_free(GopCache *cache) {
+    if (!cache) {
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    cache->running = 0;
+    pthread_mutex_unlock(&cache->lock);
+
+    // A job still running finishes its current GOP first.
+    pool_group_wait(pool_global(), &cache->group);
+
+    for (int i = 0; i < cache->count; i++) {
+        av_frame_free(&cache->frames[i].frame);
+    }
+    free(cache->frames);
+
+    media_free(cache->media);
+
+    pool_group_destroy(&cache->group);
+    pthread_mutex_destroy(&cache->lock);
+    pthread_cond_destroy(&cache->cond);
+
+    free(cache);
+}
@@ -0,0 +1,72 @@
+// The GOP cache makes backward playback cheap. Since frames can only be
+// decoded forward from a keyframe, going back one frame means decoding the
+// whole GOP that holds it. Instead of throwing that work away, every converted
+// frame of the GOP is kept here (up to a byte limit), so the next backward
+// steps are served from memory while the previous GOP is decoded by a
+// background thread.
+#ifndef GOP_CACHE_H
+#define GOP_CACHE_H
+
+#include <pthread.h>
+
+#include "media.h"
+#include "pool.h"
+
+#define GOP_CACHE_MAX_BYTES (512 * 1024 * 1024)
+
+typedef struct {
+    AVFrame *frame;
+    int64_t pts;
+
+    // Whether the frame right before this one in the cache is also the frame
+    // right before it in the stream, i.e. there is no gap between them.
+    int has_prev;
+} CachedFrame;
+
+typedef struct GopCache {
+    // Private decoding instance. It is only used by the decode job, so the
+    // demuxer of the foreground media is never moved.
+    Media *media;
+
+    // Decode jobs are accounted to the foreground media.
+    PoolOwner *owner;
+
+    AVRational time_base;
+    int64_t start_pts, frame_duration;
+
+    // Cached frames, sorted by pts.
+    CachedFrame *frames;
+    int count, capacity;
+    size_t bytes, max_bytes;
+
+    // Frames far from this pts are evicted first.
+    int64_t position;
+
+    // Pending decode request: the job decodes the GOP that holds the frame
+    // right before `request`. `busy` is set while a job is queued or running,
+    // `decoding` while one runs.
+    int64_t request;
+    int busy, decoding, running;
+
+    // The last request that found no frame before it, i.e. the first GOP.
+    int64_t exhausted;
+
+    PoolGroup group;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} GopCache;
+
+GopCache *gop_cache_alloc(size_t max_bytes);
+int gop_cache_init(GopCache *cache, Media *media);
+
+// Returns a reference to the frame right before `pts`, decoding its GOP if it
+// is not cached yet. Returns MEDIA_ERR_EOF at the start of the stream.
+int gop_cache_prev(GopCache *cache, int64_t pts, AVFrame **frame);
+
+// Returns a reference to the frame right after `pts` if it is cached, or
+// MEDIA_ERR_MORE_DATA if it has to be decoded by the caller.
+int gop_cache_next(GopCache *cache, int64_t pts, AVFrame **frame);
+
+void gop_cache_free(GopCache *cache);
+
+#endif  // GOP_CACHE_H
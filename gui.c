@@ -1,19 +1,22 @@
 #include <libgen.h>
+#include <math.h>
+#include <time.h>
+#include <libavutil/time.h>
 #include "gui.h"
 
 // ##################### LAYOUT FUNCTIONS #####################
 
-void init_layout(GuiLayout *layout) {
+void init_layout(GuiLayout *layout, int width, int height) {
     layout->videoAreaBorder =
-        (Rectangle){.x = (int)(WINDOW_WIDTH / 3),
+        (Rectangle){.x = (int)(width / 3),
                     .y = 10,
-                    .width = (int)((2 * WINDOW_WIDTH) / 3) - 20,
-                    .height = WINDOW_HEIGHT - 100};
+                    .width = (int)((2 * width) / 3) - 20,
+                    .height = height - 100};
 
-    layout->videoArea = (Rectangle){.x = (int)(WINDOW_WIDTH / 3) + 2,
+    layout->videoArea = (Rectangle){.x = (int)(width / 3) + 2,
                                     .y = 12,
-                                    .width = (int)((2 * WINDOW_WIDTH) / 3) - 24,
-                                    .height = WINDOW_HEIGHT - 104};
+                                    .width = (int)((2 * width) / 3) - 24,
+                                    .height = height - 104};
 
     layout->videoProgressArea =
         (Rectangle){.x = layout->videoArea.x,
@@ -21,30 +24,99 @@ void init_layout(GuiLayout *layout) {
                     .width = layout->videoArea.width,
                     .height = 30};
 
+    // Below the progress bar, so clicking them never seeks.
+    int controls_y =
+        layout->videoProgressArea.y + layout->videoProgressArea.height + 5;
+
     layout->playButton =
-        (Rectangle){.x = (int)(WINDOW_WIDTH / 3 + WINDOW_WIDTH / 4),
-                    .y = layout->videoAreaBorder.height + 30,
+        (Rectangle){.x = (int)(width / 3 + width / 4),
+                    .y = controls_y,
                     .width = 100,
                     .height = 35};
 
     layout->resetButton =
-        (Rectangle){.x = (int)(WINDOW_WIDTH / 3 + WINDOW_WIDTH / 4) +
+        (Rectangle){.x = (int)(width / 3 + width / 4) +
                          layout->playButton.width + 10,
-                    .y = layout->videoAreaBorder.height + 30,
+                    .y = controls_y,
                     .width = 60,
                     .height = 35};
 
     layout->exportButton = (Rectangle){
-        .x = (int)(WINDOW_WIDTH / 3 + WINDOW_WIDTH / 4) +
+        .x = (int)(width / 3 + width / 4) +
              layout->resetButton.width + layout->playButton.width + 20,
-        .y = layout->videoAreaBorder.height + 30,
+        .y = controls_y,
         .width = 110,
         .height = 35};
 
     layout->mediaArea = (Rectangle){.x = 10,
                                     .y = 10,
-                                    .width = (int)(WINDOW_WIDTH / 3) - 20,
-                                    .height = WINDOW_HEIGHT - 20};
+                                    .width = (int)(width / 3) - 20,
+                                    .height = height - 20};
+}
+
+// Largest rectangle with the aspect ratio of `texture` centered in `area`.
+Rectangle gui_fit_rect(Rectangle area, Texture2D texture) {
+    if (texture.width <= 0 || texture.height <= 0) {
+        return area;
+    }
+
+    float scale = area.width / texture.width;
+    if (area.height / texture.height < scale) {
+        scale = area.height / texture.height;
+    }
+
+    float width = texture.width * scale;
+    float height = texture.height * scale;
+    return (Rectangle){.x = area.x + (area.width - width) / 2,
+                       .y = area.y + (area.height - height) / 2,
+                       .width = width,
+                       .height = height};
+}
+
+// Draws a video texture scaled to fit `area`.
+void gui_draw_video(Texture2D texture, Rectangle area) {
+    DrawTexturePro(texture, (Rectangle){0, 0, texture.width, texture.height},
+                   gui_fit_rect(area, texture), (Vector2){0, 0}, 0, WHITE);
+}
+
+// Lays the window out again after it was resized. The medias convert to the
+// new size once it settled, not at every step of the drag; meanwhile their
+// frames are stretched by the GPU.
+void gui_state_update_window(GuiState *state) {
+    if (IsWindowResized()) {
+        init_layout(&state->layout, GetScreenWidth(), GetScreenHeight());
+        state->video_area_width = state->layout.videoArea.width;
+        state->video_area_height = state->layout.videoArea.height;
+        state->resize_time = GetTime();
+        state->resize_pending = 1;
+    }
+
+    if (!state->resize_pending || GetTime() - state->resize_time < GUI_RESIZE_DELAY) {
+        return;
+    }
+    state->resize_pending = 0;
+
+    for (int i = 0; i < state->media_count; i++) {
+        MediaStateWrapper *media_state = state->medias[i];
+        if (state->grid_mode && i < state->grid_count) {
+            Rectangle tile = gui_state_grid_tile(state, i);
+            pool_group_wait(pool_global(), &media_state->decode_group);
+            media_state_resize(media_state, tile.width, tile.height);
+        } else {
+            media_state_resize(media_state, state->video_area_width,
+                               state->video_area_height);
+        }
+    }
+
+    // A paused media would keep showing the frame converted for the old size.
+    if (!state->grid_mode && state->media_count > 0) {
+        MediaStateWrapper *media_state = state->medias[state->current_media_idx];
+        if (!media_state->is_playing && !media_state->end_of_file &&
+            !media_state->audio_only && media_state->media->video_ctx &&
+            media_state->frame_pts != AV_NOPTS_VALUE) {
+            gui_state_present_seek(media_state, media_state->media->current_ts, 1);
+        }
+    }
 }
 
 // ##################### MEDIA STATE FUNCTIONS #####################
@@ -56,20 +128,78 @@ MediaStateWrapper *media_state_wrapper_alloc() {
         return NULL;
     }
 
+    media_state->audio_pending = fq_alloc();
+    if (!media_state->audio_pending) {
+        free(media_state);
+        return NULL;
+    }
+
     media_state->is_playing = 0;
     media_state->end_of_file = 0;
     media_state->start_timestamp = 0;
     media_state->end_timestamp = 0;
+    media_state->is_scrubbing = 0;
+    media_state->was_playing = 0;
+    media_state->scrub_target = 0;
+    media_state->scrub_shown = -1;
+    media_state->frame_pts = AV_NOPTS_VALUE;
+    media_state->gop_cache = NULL;
+    media_state->is_reversing = 0;
+    media_state->reverse_start_time = 0;
+    media_state->reverse_start_pts = 0;
+    media_state->needs_resync = 0;
+    media_state->grid_offset = 0;
+    media_state->decode_target = 0;
+    media_state->decode_eof = 0;
+    pool_group_init(&media_state->decode_group);
+    media_state->audio_only = 0;
+    media_state->loop_enabled = 0;
+    media_state->loop_cache = NULL;
+    media_state->waveform = NULL;
     media_state->media = NULL;
-    media_state->texture = (Texture2D){0};
+    for (int i = 0; i < MEDIA_STATE_TEXTURES; i++) {
+        media_state->textures[i] = (Texture2D){0};
+    }
+    media_state->texture_front = 0;
+    media_state->upload_time = 0;
+    media_state->upload_time_max = 0;
+    media_state->uploads = 0;
+    media_state->zoom = 1;
+    media_state->view_x = 0.5;
+    media_state->view_y = 0.5;
+    media_state->is_panning = 0;
+    media_state->library_entry = NULL;
+    media_state->poster = (Texture2D){0};
+    media_state->has_poster = 0;
+    media_state->open_time = 0;
+    media_state->first_frame_time = -1;
     media_state->audio = (AudioStream){0};
 
     return media_state;
 }
 
+// The rate of the audio may only be known from its first decoded frame. The
+// stream is loaded again at that rate, in the same playing state.
+void media_state_match_audio_rate(MediaStateWrapper *media_state) {
+    unsigned int rate = media_state->media->out_sample_rate;
+    if (media_state->audio.sampleRate == rate) {
+        return;
+    }
+
+    int playing = IsAudioStreamPlaying(media_state->audio);
+    UnloadAudioStream(media_state->audio);
+
+    media_state->audio = LoadAudioStream(rate, 32, 2);
+    SetAudioStreamVolume(media_state->audio, 1.0f);
+    PlayAudioStream(media_state->audio);
+    if (!playing) {
+        PauseAudioStream(media_state->audio);
+    }
+}
+
 int media_state_init(MediaStateWrapper *media_state, int dst_frame_w,
                      int dst_frame_h, enum AVPixelFormat dst_frame_fmt,
-                     const char *filename) {
+                     const char *filename, const MediaOpenOptions *options) {
     if (!media_state) {
         return -1;
     }
@@ -80,34 +210,293 @@ int media_state_init(MediaStateWrapper *media_state, int dst_frame_w,
         return -1;
     }
 
+    media->io_mode = options->io_mode;
+    media->io_buffer_size = options->io_buffer_size;
+    media->packet_cache_seconds = PACKET_CACHE_SECONDS;
+    media->video_filters = options->video_filters;
+    media->audio_filters = options->audio_filters;
+    media->deinterlace = options->deinterlace;
+    media->fast_open = options->fast_open;
+    media->probe_size = options->probe_size;
+    media->analyze_duration = options->analyze_duration;
+    media->skip_duplicates = options->skip_duplicates;
+    media->follow =
+        options->follow > 0 ||
+        (options->follow < 0 && file_watch_recent(filename, GUI_FOLLOW_RECENT));
+    if (options->follow_latency > 0) {
+        media->follow_latency = options->follow_latency;
+    }
+
+    // A file the library indexed already needs no probing when its header
+    // tells everything, and gets the keyframe index the container may lack.
+    LibraryEntry *entry = media_state->library_entry;
+    int indexed = entry && library_entry_state(entry) == LIBRARY_READY;
+    media->skip_stream_info = indexed && entry->header_complete;
+
     if (media_init(media, dst_frame_w, dst_frame_h, dst_frame_fmt, filename) <
         0) {
         printf("media_state_init: failed to initialize media\n");
+        media_free(media);
         return -1;
     }
 
+    if (indexed) {
+        if (media->fmt_ctx->duration <= 0 && entry->duration > 0) {
+            media->fmt_ctx->duration = entry->duration;
+            media_get_formatted_time(media, media->fmt_ctx->duration,
+                                     AV_TIME_BASE, media->formatted_duration);
+        }
+        media_add_keyframes(media, entry->keyframes, entry->nb_keyframes);
+    }
+
     media_state->is_playing = 0;
     media_state->end_of_file = 0;
     media_state->start_timestamp = 0;
     media_state->end_timestamp = media->fmt_ctx->duration;
     media_state->media = media;
 
-    Image img = GenImageColor(dst_frame_w, dst_frame_h, BLACK);
-    ImageFormat(&img, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
-
-    Texture2D tex = LoadTextureFromImage(img);
-    UnloadImage(img);
+    // Frames are converted at the size they are shown at, not the whole area.
+    int dst_w, dst_h;
+    media_fit_output_size(media, dst_frame_w, dst_frame_h, &dst_w, &dst_h);
+    media_set_output_size(media, dst_w, dst_h);
+    media_state_load_textures(media_state, dst_w, dst_h);
 
-    AudioStream audio = LoadAudioStream(media->audio_ctx->sample_rate, 32, 2);
+    AudioStream audio = LoadAudioStream(media->out_sample_rate, 32, 2);
     SetAudioStreamVolume(audio, 1.0f);
     PlayAudioStream(audio);
 
-    media_state->texture = tex;
     media_state->audio = audio;
 
     return 0;
 }
 
+// Computed in the background; a media without it just has a plain bar. It is
+// started once the media shows its first frame, not to compete with it.
+void media_state_start_waveform(MediaStateWrapper *media_state) {
+    if (media_state->waveform) {
+        return;
+    }
+
+    media_state->waveform = waveform_alloc(WAVEFORM_BUCKETS);
+    if (media_state->waveform &&
+        waveform_init(media_state->waveform, media_state->media) < 0) {
+        waveform_free(media_state->waveform);
+        media_state->waveform = NULL;
+    }
+}
+
+void media_state_log_filters(const char *filename, FilterChain *chain) {
+    if (!chain) {
+        return;
+    }
+
+    for (int i = 0; i < chain->nb_stages; i++) {
+        FilterStage *stage = &chain->stages[i];
+        TraceLog(LOG_INFO, "%s: filter %s: %lld frames, %.2f ms average, %lld builds",
+                 filename, stage->description, (long long)stage->frames,
+                 stage->frames ? stage->time * 1000 / stage->frames : 0,
+                 (long long)stage->builds);
+    }
+}
+
+void media_state_free(MediaStateWrapper *media_state) {
+    if (!media_state) {
+        return;
+    }
+
+    pool_group_wait(pool_global(), &media_state->decode_group);
+    pool_group_destroy(&media_state->decode_group);
+
+    gop_cache_free(media_state->gop_cache);
+    waveform_free(media_state->waveform);
+    loop_cache_free(media_state->loop_cache);
+
+    if (media_state->media && media_state->media->io) {
+        MediaIOStats stats;
+        media_io_get_stats(media_state->media->io, &stats);
+        TraceLog(LOG_INFO, "%s: read %lld bytes, %lld stalls (%.1f ms)",
+                 media_state->media->filename, (long long)stats.bytes_read,
+                 (long long)stats.stalls, stats.stall_time / 1000.0);
+    }
+
+    if (media_state->media && media_state->uploads > 0) {
+        TraceLog(LOG_INFO, "%s: %lld uploads, %.2f ms average, %.2f ms worst",
+                 media_state->media->filename, (long long)media_state->uploads,
+                 media_state->upload_time * 1000,
+                 media_state->upload_time_max * 1000);
+    }
+
+    if (media_state->media && media_state->media->video_ctx) {
+        TraceLog(LOG_INFO, "%s: %lld scaler contexts built",
+                 media_state->media->filename,
+                 (long long)media_state->media->scaler_builds);
+        TraceLog(LOG_INFO, "%s: %lld duplicate frames not converted",
+                 media_state->media->filename,
+                 (long long)media_state->media->duplicates);
+    }
+
+    if (media_state->media && media_state->media->packet_cache) {
+        PacketCache *cache = media_state->media->packet_cache;
+        TraceLog(LOG_INFO,
+                 "%s: packet cache served %lld of %lld seeks (%.0f%%), "
+                 "holding %zu KB",
+                 media_state->media->filename, (long long)cache->hits,
+                 (long long)(cache->hits + cache->misses),
+                 packet_cache_hit_rate(cache) * 100, cache->bytes / 1024);
+    }
+
+    if (media_state->media) {
+        media_state_log_filters(media_state->media->filename,
+                                media_state->media->video_filter);
+        media_state_log_filters(media_state->media->filename,
+                                media_state->media->audio_filter);
+    }
+
+    media_free(media_state->media);
+
+    media_state_unload_textures(media_state);
+    if (media_state->has_poster) {
+        UnloadTexture(media_state->poster);
+    }
+    fq_free(media_state->audio_pending);
+    StopAudioStream(media_state->audio);
+    UnloadAudioStream(media_state->audio);
+
+    free(media_state);
+}
+
+// Lets the media adapt its decoding quality after a frame was shown.
+void media_state_update_quality(MediaStateWrapper *media_state) {
+    Media *media = media_state->media;
+
+    int queued = 0;
+    for (Node *node = media->queue->head; node; node = node->next) {
+        queued += node->type != FRAME_TYPE_AUDIO;
+    }
+
+    enum MediaQuality previous = media_get_quality(media);
+    enum MediaQuality quality = media_update_quality(media, queued);
+    if (quality != previous) {
+        TraceLog(LOG_INFO, "%s: decoding quality %s -> %s (%.1f ms per frame)",
+                 media->filename, media_quality_name(previous),
+                 media_quality_name(quality), media->decode_time * 1000);
+    }
+}
+
+// The GOP cache runs its own decoder, so it is only started when needed.
+GopCache *media_state_gop_cache(MediaStateWrapper *media_state) {
+    if (media_state->gop_cache) {
+        return media_state->gop_cache;
+    }
+
+    GopCache *cache = gop_cache_alloc(GOP_CACHE_MAX_BYTES);
+    if (!cache) {
+        printf("media_state_gop_cache: failed to allocate gop cache\n");
+        return NULL;
+    }
+
+    if (gop_cache_init(cache, media_state->media) < 0) {
+        printf("media_state_gop_cache: failed to initialize gop cache\n");
+        gop_cache_free(cache);
+        return NULL;
+    }
+
+    media_state->gop_cache = cache;
+    return cache;
+}
+
+// The texture holding the last uploaded frame.
+Texture2D media_state_texture(MediaStateWrapper *media_state) {
+    return media_state->textures[media_state->texture_front];
+}
+
+void media_state_load_textures(MediaStateWrapper *media_state, int width,
+                               int height) {
+    Image img = GenImageColor(width, height, BLACK);
+    ImageFormat(&img, PIXELFORMAT_UNCOMPRESSED_R8G8B8A8);
+
+    for (int i = 0; i < MEDIA_STATE_TEXTURES; i++) {
+        media_state->textures[i] = LoadTextureFromImage(img);
+    }
+    media_state->texture_front = 0;
+
+    UnloadImage(img);
+}
+
+void media_state_unload_textures(MediaStateWrapper *media_state) {
+    for (int i = 0; i < MEDIA_STATE_TEXTURES; i++) {
+        UnloadTexture(media_state->textures[i]);
+        media_state->textures[i] = (Texture2D){0};
+    }
+}
+
+// Uploads a converted video frame to the next texture of the ring, which is
+// drawn from then on. The ring follows the size of the frames, so the frames
+// converted before a resize are still shown.
+int media_state_upload(MediaStateWrapper *media_state, AVFrame *frame) {
+    int back = (media_state->texture_front + 1) % MEDIA_STATE_TEXTURES;
+    Texture2D texture = media_state->textures[back];
+    if (frame->width != texture.width || frame->height != texture.height) {
+        media_state_unload_textures(media_state);
+        media_state_load_textures(media_state, frame->width, frame->height);
+        back = (media_state->texture_front + 1) % MEDIA_STATE_TEXTURES;
+        texture = media_state->textures[back];
+    }
+
+    double start = GetTime();
+    UpdateTexture(texture, frame->data[0]);
+    double elapsed = GetTime() - start;
+
+    media_state->texture_front = back;
+    media_state->frame_pts = frame->best_effort_timestamp;
+
+    media_state->upload_time = media_state->uploads > 0
+                                   ? media_state->upload_time * 0.95 + elapsed * 0.05
+                                   : elapsed;
+    if (elapsed > media_state->upload_time_max) {
+        media_state->upload_time_max = elapsed;
+    }
+    media_state->uploads++;
+
+    return 0;
+}
+
+// Moves the media position to a video frame that was put on screen.
+void media_state_update_position(MediaStateWrapper *media_state, AVFrame *frame) {
+    Media *media = media_state->media;
+
+    if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+        media->current_ts = av_rescale_q(
+            frame->best_effort_timestamp,
+            media->fmt_ctx->streams[media->video_stream_idx]->time_base,
+            AV_TIME_BASE_Q);
+        media_get_formatted_time(media, media->current_ts, AV_TIME_BASE,
+                                 media->formatted_position);
+    }
+}
+
+// Puts a converted video frame on screen and moves the media position there.
+void media_state_show_frame(MediaStateWrapper *media_state, AVFrame *frame) {
+    Media *media = media_state->media;
+
+    if (media_state_upload(media_state, frame) < 0) {
+        return;
+    }
+
+    if (media_state->first_frame_time < 0 && media_state->open_time > 0) {
+        media_state->first_frame_time = GetTime() - media_state->open_time;
+        TraceLog(LOG_INFO,
+                 "%s: first frame after %.1f ms (%s; open %.1f ms, probe %.1f ms)",
+                 media->filename, media_state->first_frame_time * 1000,
+                 media->skip_stream_info ? "indexed"
+                 : media->probed         ? "probed"
+                                         : "header only",
+                 media->open_time * 1000, media->probe_time * 1000);
+    }
+
+    media_state_update_position(media_state, frame);
+}
+
 // ##################### GUI STATE FUNCTIONS #####################
 
 GuiState *gui_state_alloc() {
@@ -119,9 +508,32 @@ GuiState *gui_state_alloc() {
     state->video_area_height = 0;
     state->video_destination_fmt = AV_PIX_FMT_RGBA;
 
+    state->open_options = (MediaOpenOptions){
+        .io_mode = MEDIA_IO_DEFAULT,
+        .deinterlace = 1,
+        .fast_open = 1,
+        .skip_duplicates = 1,
+        .follow = -1,
+    };
+
+    state->grid_mode = 0;
+    state->grid_count = 0;
+    state->grid_playing = 0;
+    state->grid_focus = -1;
+    state->grid_start = 0;
+    state->grid_elapsed = 0;
+
+    state->library = NULL;
+    state->audio_only = 0;
+    state->resize_pending = 0;
+    state->resize_time = 0;
+    state->osd[0] = '\0';
+    state->osd_until = 0;
+
     state->now = 0;
     state->elapsed = 0;
     state->target_fps = 60;
+    state->next_frame_time = INFINITY;
 
     state->layout = (GuiLayout){0};
 
@@ -129,15 +541,124 @@ GuiState *gui_state_alloc() {
 }
 
 void gui_state_init(GuiState *state) {
-    init_layout(&state->layout);
+    init_layout(&state->layout, WINDOW_WIDTH, WINDOW_HEIGHT);
 
     state->video_area_width = state->layout.videoArea.width;
     state->video_area_height = state->layout.videoArea.height;
     state->video_destination_fmt = AV_PIX_FMT_RGBA;
 
+    MediaOpenOptions *options = &state->open_options;
+    options->io_mode = media_io_mode_from_string(getenv("AVP_IO"));
+    const char *io_buffer_mb = getenv("AVP_IO_BUFFER_MB");
+    options->io_buffer_size =
+        io_buffer_mb ? (size_t)atoi(io_buffer_mb) * 1024 * 1024 : 0;
+
+    options->video_filters = getenv("AVP_VF");
+    options->audio_filters = getenv("AVP_AF");
+    const char *deinterlace = getenv("AVP_DEINTERLACE");
+    options->deinterlace = !deinterlace || atoi(deinterlace) != 0;
+
+    const char *fast_open = getenv("AVP_FAST_OPEN");
+    options->fast_open = !fast_open || atoi(fast_open) != 0;
+    const char *probe_size = getenv("AVP_PROBE_SIZE");
+    options->probe_size = probe_size ? atoll(probe_size) : 0;
+    const char *analyze_ms = getenv("AVP_ANALYZE_MS");
+    options->analyze_duration =
+        analyze_ms ? atoll(analyze_ms) * (AV_TIME_BASE / 1000) : 0;
+
+    const char *skip_duplicates = getenv("AVP_SKIP_DUPLICATES");
+    options->skip_duplicates = !skip_duplicates || atoi(skip_duplicates) != 0;
+
+    const char *follow = getenv("AVP_FOLLOW");
+    options->follow = follow ? atoi(follow) != 0 : -1;
+    const char *follow_latency_ms = getenv("AVP_FOLLOW_LATENCY_MS");
+    options->follow_latency =
+        follow_latency_ms ? atoll(follow_latency_ms) * (AV_TIME_BASE / 1000)
+                          : 0;
+
     state->now = GetTime();
     state->elapsed = 0;
     state->target_fps = 60;
+    state->next_frame_time = INFINITY;
+
+    // Decoding for every media shares one pool, sized by AVP_THREADS (one
+    // worker per core by default).
+    const char *threads = getenv("AVP_THREADS");
+    pool_global_init(threads ? atoi(threads) : 0);
+
+    state->library = library_alloc();
+}
+
+// Opens `path` and adds it to the media list, showing its first frame.
+int gui_state_open_media(GuiState *state, const char *path) {
+    if (state->media_count == MAX_MEDIA) {
+        printf("gui_state_open_media: the media list is full\n");
+        return -1;
+    }
+
+    MediaStateWrapper *media_state = media_state_wrapper_alloc();
+    if (!media_state) {
+        printf("gui_state_open_media: failed to allocate media state\n");
+        return -1;
+    }
+
+    media_state->open_time = GetTime();
+    media_state->library_entry = library_add(state->library, path);
+
+    if (media_state_init(media_state, state->video_area_width,
+                         state->video_area_height, state->video_destination_fmt,
+                         path, &state->open_options) < 0) {
+        printf("gui_state_open_media: failed to initialize media state\n");
+        media_state_free(media_state);
+        return -1;
+    }
+
+    if (media_state->media->video_ctx) {
+        media_state_show_first_frame(media_state);
+    }
+    media_state_start_waveform(media_state);
+
+    gui_state_add_media(state, media_state);
+    return 0;
+}
+
+// Picks up what the library indexed since the last tick: posters for the
+// media list, and the files of dropped directories that turned out to be
+// playable. Those are opened one per tick, so the window never stalls.
+void gui_state_update_library(GuiState *state) {
+    for (int i = 0; i < state->media_count; i++) {
+        MediaStateWrapper *media_state = state->medias[i];
+        LibraryEntry *entry = media_state->library_entry;
+        if (media_state->has_poster || !entry ||
+            library_entry_state(entry) != LIBRARY_READY || !entry->has_poster) {
+            continue;
+        }
+
+        media_state->poster = LoadTexture(entry->poster_path);
+        media_state->has_poster = 1;
+    }
+
+    if (!state->library) {
+        return;
+    }
+
+    for (int i = 0; i < state->library->count; i++) {
+        LibraryEntry *entry = state->library->entries[i];
+        if (!entry->open_when_ready) {
+            continue;
+        }
+
+        enum LibraryState entry_state = library_entry_state(entry);
+        if (entry_state == LIBRARY_PENDING) {
+            continue;
+        }
+
+        entry->open_when_ready = 0;
+        if (entry_state == LIBRARY_READY) {
+            gui_state_open_media(state, entry->path);
+            return;
+        }
+    }
 }
 
 void gui_state_add_media(GuiState *state, MediaStateWrapper *ms) {
@@ -164,14 +685,11 @@ int gui_state_remove_media(GuiState *state) {
         return -1;
     }
 
-    MediaStateWrapper *ms = state->medias[state->current_media_idx];
-    media_free(ms->media);
-
-    UnloadTexture(ms->texture);
-    StopAudioStream(ms->audio);
-    UnloadAudioStream(ms->audio);
+    if (state->grid_mode) {
+        gui_state_toggle_grid(state);
+    }
 
-    free(ms);
+    media_state_free(state->medias[state->current_media_idx]);
 
     // This just shifts the array to the left by one.
     for (int i = state->current_media_idx; i < state->media_count - 1; i++) {
@@ -192,9 +710,27 @@ void gui_state_play_media(GuiState *state) {
         return;
     }
 
+    if (state->grid_mode) {
+        gui_state_grid_play(state);
+        return;
+    }
+
+    MediaStateWrapper *media_state = state->medias[state->current_media_idx];
+    if (!media_state->is_playing) {
+        media_state->is_reversing = 0;
+
+        // Frames shown from the GOP cache left the demuxer somewhere else.
+        if (media_state->needs_resync) {
+            gui_state_present_seek(media_state,
+                                   state->current_media->current_ts, 1);
+        }
+    }
+
     state->medias[state->current_media_idx]->is_playing =
         !state->medias[state->current_media_idx]->is_playing;
-    state->now = GetTime();
+
+    // Anchor the clock so that the current position is due right now.
+    state->now = GetTime() - (double)state->current_media->current_ts / AV_TIME_BASE;
 
     if (state->medias[state->current_media_idx]->is_playing) {
         ResumeAudioStream(state->medias[state->current_media_idx]->audio);
@@ -217,132 +753,1410 @@ void gui_state_reset_media(GuiState *state) {
     }
 
     state->medias[state->current_media_idx]->is_playing = 0;
+    state->medias[state->current_media_idx]->is_reversing = 0;
     state->medias[state->current_media_idx]->end_of_file = 0;
+    media_state_drop_pending(state->medias[state->current_media_idx]);
 }
 
-int gui_state_update(GuiState *state) {
-    if (IsFileDropped()) {
-        FilePathList dropped_files = LoadDroppedFiles();
-        for (int i = 0; i < (int)dropped_files.count; i++) {
-            MediaStateWrapper *media_state = media_state_wrapper_alloc();
-            if (!media_state) {
-                printf("gui_state_update: failed to allocate media state\n");
-                return -1;
-            }
+// Seeks the media and shows the frame found there, even when paused.
+int gui_state_present_seek(MediaStateWrapper *media_state, int64_t timestamp,
+                           int accurate) {
+    AVFrame *frame = NULL;
+    if (media_seek_frame(media_state->media, timestamp, accurate, &frame) < 0) {
+        printf("gui_state_present_seek: failed to seek\n");
+        return -1;
+    }
 
-            if (media_state_init(media_state, state->video_area_width,
-                                 state->video_area_height,
-                                 state->video_destination_fmt,
-                                 dropped_files.paths[i]) < 0) {
-                printf("gui_state_update: failed to initialize media state\n");
-                return -1;
-            }
+    media_state_show_frame(media_state, frame);
+    av_frame_free(&frame);
 
-            gui_state_add_media(state, media_state);
-        }
+    media_state_drop_pending(media_state);
+    media_state->end_of_file = 0;
+    media_state->needs_resync = 0;
 
-        UnloadDroppedFiles(dropped_files);
-    }
+    return 0;
+}
 
-    if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON) && state->media_count > 0) {
-        Vector2 mouse = GetMousePosition();
-        if (CheckCollisionPointRec(mouse, state->layout.playButton)) {
-            gui_state_play_media(state);
-        } else if (CheckCollisionPointRec(mouse, state->layout.resetButton)) {
-            gui_state_reset_media(state);
-        }
+// Maps a point of the progress bar to a timestamp in AV_TIME_BASE units.
+int64_t gui_state_progress_timestamp(GuiState *state, Media *media, float x) {
+    Rectangle area = state->layout.videoProgressArea;
+
+    double ratio = (x - area.x) / area.width;
+    if (ratio < 0) {
+        ratio = 0;
+    } else if (ratio > 1) {
+        ratio = 1;
     }
 
-    if (IsKeyPressed(KEY_DOWN) && state->media_count > 0) {
-        gui_state_media_down(state);
-    } else if (IsKeyPressed(KEY_UP) && state->media_count > 0) {
-        gui_state_media_up(state);
+    return (int64_t)(ratio * media->fmt_ctx->duration);
+}
+
+void gui_state_scrub(GuiState *state) {
+    if (state->media_count == 0 || state->grid_mode) {
+        return;
     }
 
-    if (IsKeyDown(KEY_LEFT_CONTROL) && IsKeyPressed(KEY_X)) {
-        gui_state_remove_media(state);
+    MediaStateWrapper *media_state = state->medias[state->current_media_idx];
+    Vector2 mouse = GetMousePosition();
+
+    if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON) &&
+        CheckCollisionPointRec(mouse, state->layout.videoProgressArea)) {
+        media_state->is_scrubbing = 1;
+        media_state->was_playing = media_state->is_playing;
+        media_state->scrub_shown = -1;
+
+        media_state->is_playing = 0;
+        media_state->is_reversing = 0;
+        PauseAudioStream(media_state->audio);
+
+        // Only keyframes can be shown at the rate the cursor moves.
+        media_set_keyframes_only(media_state->media, 1);
     }
 
-    int ret;
-    if (state->media_count > 0 &&
-        state->medias[state->current_media_idx]->is_playing) {
-        MediaStateWrapper *media_state =
-            state->medias[state->current_media_idx];
+    if (!media_state->is_scrubbing) {
+        return;
+    }
 
-        if ((ret = media_read_frame(media_state->media)) < 0) {
-            if (ret == MEDIA_ERR_EOF) {
-                state->medias[state->current_media_idx]->end_of_file = 1;
-                state->medias[state->current_media_idx]->is_playing = 0;
-                return 0;
-            } else {
-                TraceLog(LOG_ERROR, "Failed to read frame: %d", ret);
-                return -1;
-            }
-        }
+    media_state->scrub_target =
+        gui_state_progress_timestamp(state, media_state->media, mouse.x);
 
-        if ((ret = media_decode(media_state->media)) < 0 &&
-            ret != MEDIA_ERR_MORE_DATA) {
-            TraceLog(LOG_ERROR, "Failed to decode frame: %d", ret);
-            return -1;
-        }
+    if (IsMouseButtonReleased(MOUSE_LEFT_BUTTON)) {
+        media_state->is_scrubbing = 0;
+        media_set_keyframes_only(media_state->media, 0);
 
-        if (fq_empty(media_state->media->queue) && ret == MEDIA_ERR_MORE_DATA) {
-            return 0;
+        // Land on the exact frame under the cursor. Without video there is no
+        // frame to land on, so just move the audio.
+        if (media_state->audio_only) {
+            media_seek_to(media_state->media, media_state->scrub_target);
+            media_state_drop_pending(media_state);
+        } else {
+            gui_state_present_seek(media_state, media_state->scrub_target, 1);
         }
 
-        Node *node = fq_dequeue(media_state->media->queue);
-        if (!node) {
-            TraceLog(LOG_ERROR, "Failed to dequeue frame");
-            return -1;
+        if (media_state->was_playing) {
+            gui_state_play_media(state);
         }
+        return;
+    }
 
-        if (node->type == FRAME_TYPE_VIDEO) {
-            UpdateTexture(media_state->texture, node->frame->data[0]);
-        } else {
-            if (IsAudioStreamProcessed(media_state->audio)) {
-                UpdateAudioStream(media_state->audio, node->frame->data[0],
-                                  node->frame->nb_samples);
-            }
+    int64_t keyframe =
+        media_keyframe_before(media_state->media, media_state->scrub_target);
+    if (!media_state->audio_only && keyframe != media_state->scrub_shown) {
+        if (gui_state_present_seek(media_state, media_state->scrub_target, 0) ==
+            0) {
+            media_state->scrub_shown = keyframe;
         }
-        node_free(node);
     }
 
-    return 0;
+    // Show where the cursor is, not where the keyframe is.
+    media_get_formatted_time(media_state->media, media_state->scrub_target,
+                             AV_TIME_BASE,
+                             media_state->media->formatted_position);
 }
 
-void gui_state_draw(GuiState *state) {
-    DrawRectangleLinesEx(state->layout.mediaArea, 2, GRAY);
-    if (state->media_count == 0) {
-        DrawText("Drop media files here!", state->layout.mediaArea.x + 15,
-                 state->layout.mediaArea.height / 2, 25, GRAY);
-    } else {
-        for (int i = 0; i < state->media_count; i++) {
-            DrawRectangle(state->layout.mediaArea.x, state->layout.mediaArea.y + 35 * i,
-                          state->layout.mediaArea.width, 35,
-                          i == state->current_media_idx
-                              ? SKYBLUE
-                              : (i % 2 == 0 ? GRAY : LIGHTGRAY));
-            DrawText(basename(state->medias[i]->media->filename),
-                     state->layout.mediaArea.x + 10, state->layout.mediaArea.y + 35 * i, 20,
-                     i == state->current_media_idx ? BLUE : DARKGRAY);
-        }
+// Moves the foreground media by `seconds`. Short jumps back usually land
+// inside the packet cache, and are decoded again without touching the file.
+void gui_state_jump(GuiState *state, int seconds) {
+    if (state->media_count == 0 || state->grid_mode) {
+        return;
     }
 
-    DrawRectangleLinesEx(state->layout.videoAreaBorder, 2, GRAY);
-    DrawRectangleRec(state->layout.videoArea, WHITE);
-
-    if (state->media_count > 0 &&
-        state->medias[state->current_media_idx]->end_of_file) {
-        DrawText("End of file", state->layout.videoArea.x + 10, state->layout.videoArea.y + 10, 20,
-                 RED);
-    } else if (state->media_count > 0) {
-        DrawTexture(state->medias[state->current_media_idx]->texture,
-                    state->layout.videoArea.x, state->layout.videoArea.y, WHITE);
+    MediaStateWrapper *media_state = state->medias[state->current_media_idx];
+    Media *media = media_state->media;
 
-        // Draw the current position at one tip of the video progress area,
-        // and the video duration at the other tip.
-        Media *current_media =
-            state->medias[state->current_media_idx]->media;
+    int was_playing = media_state->is_playing;
+    if (was_playing) {
+        gui_state_play_media(state);
+    }
+    media_state->is_reversing = 0;
+
+    int64_t target = media->current_ts + (int64_t)seconds * AV_TIME_BASE;
+    if (media_state->audio_only) {
+        media_seek_to(media, target);
+        media_state_drop_pending(media_state);
+    } else {
+        gui_state_present_seek(media_state, target, 1);
+    }
+
+    if (was_playing) {
+        gui_state_play_media(state);
+    }
+}
+
+void gui_state_show_osd(GuiState *state, const char *text) {
+    snprintf(state->osd, sizeof(state->osd), "%s", text);
+    state->osd_until = GetTime() + GUI_OSD_TIME;
+}
+
+// Switches the current media to its next audio track, from the position that
+// is heard now. The video is not interrupted: only the audio decoded ahead is
+// dropped, along with what the audio stream was still waiting to play.
+void gui_state_next_audio_track(GuiState *state) {
+    if (state->media_count == 0 || state->grid_mode) {
+        return;
+    }
+
+    MediaStateWrapper *media_state = state->medias[state->current_media_idx];
+    Media *media = media_state->media;
+    if (media->nb_audio_tracks < 2) {
+        return;
+    }
+
+    int64_t from = media->current_ts;
+    if (media_state->is_playing) {
+        from = (int64_t)((GetTime() - state->now) * AV_TIME_BASE);
+    } else if (media->video_stream_idx >= 0 &&
+               media_state->frame_pts != AV_NOPTS_VALUE) {
+        from = av_rescale_q(
+            media_state->frame_pts,
+            media->fmt_ctx->streams[media->video_stream_idx]->time_base,
+            AV_TIME_BASE_Q);
+    }
+
+    int track = (media->audio_track + 1) % media->nb_audio_tracks;
+    if (media_select_audio_track(media, track, from) < 0) {
+        gui_state_show_osd(state, "Failed to switch the audio track");
+        return;
+    }
+
+    fq_clear(media_state->audio_pending);
+    media_state->decode_eof = 0;
+    // The recorded loop pass has the old track's audio.
+    if (media_state->loop_cache) {
+        loop_cache_clear(media_state->loop_cache);
+    }
+
+    char name[96];
+    media_audio_track_name(media, track, name, sizeof(name));
+    gui_state_show_osd(state, TextFormat("Audio track %s", name));
+}
+
+// Decodes up to the first video frame and puts it on screen. Everything
+// decoded stays queued, so playback still starts from the beginning.
+int media_state_show_first_frame(MediaStateWrapper *media_state) {
+    Media *media = media_state->media;
+
+    while (1) {
+        for (Node *node = media->queue->head; node; node = node->next) {
+            if (node->type == FRAME_TYPE_VIDEO) {
+                media_state_show_frame(media_state, node->frame);
+                return 0;
+            }
+        }
+
+        int ret = media_read_frame(media);
+        if (ret < 0) {
+            return ret;
+        }
+
+        ret = media_decode(media);
+        if (ret < 0 && ret != MEDIA_ERR_MORE_DATA) {
+            return ret;
+        }
+    }
+}
+
+// Shows the part of the frames around (view_x, view_y) at the given zoom. A
+// paused media converts the frame on screen again, from the decoded frame
+// when it was kept.
+void media_state_set_view(MediaStateWrapper *media_state, double zoom,
+                          double view_x, double view_y, int box_w, int box_h) {
+    Media *media = media_state->media;
+    double half = 0.5 / zoom;
+    int zoomed = zoom != media_state->zoom;
+
+    media_state->zoom = zoom;
+    media_state->view_x = view_x;
+    media_state->view_y = view_y;
+
+    media_set_crop(media, view_x - half, view_y - half, 2 * half, 2 * half);
+    media_set_keep_sources(media, zoom > 1);
+    if (zoomed) {
+        media_state_resize(media_state, box_w, box_h);
+    }
+
+    // The cached frames show another part of the video.
+    gop_cache_free(media_state->gop_cache);
+    media_state->gop_cache = NULL;
+
+    if (media_state->is_playing || media_state->end_of_file) {
+        return;
+    }
+
+    AVFrame *frame = NULL;
+    if (media_reconvert(media, media_state->frame_pts, &frame) == 0) {
+        media_state_upload(media_state, frame);
+        av_frame_free(&frame);
+    } else {
+        gui_state_present_seek(media_state, media->current_ts, 1);
+    }
+}
+
+// Zooms the video with the mouse wheel, towards the cursor, and pans it while
+// the right button is held. 0 shows the whole frame again.
+void gui_state_update_zoom(GuiState *state) {
+    if (state->media_count == 0 || state->grid_mode) {
+        return;
+    }
+
+    MediaStateWrapper *media_state = state->medias[state->current_media_idx];
+    if (!media_state->media->video_ctx || media_state->audio_only) {
+        return;
+    }
+
+    Rectangle view =
+        gui_fit_rect(state->layout.videoArea, media_state_texture(media_state));
+    Vector2 mouse = GetMousePosition();
+    int inside = CheckCollisionPointRec(mouse, view);
+
+    double zoom = media_state->zoom;
+    double x = media_state->view_x;
+    double y = media_state->view_y;
+
+    float wheel = inside ? GetMouseWheelMove() : 0;
+    if (wheel != 0) {
+        // The point under the cursor stays where it is.
+        double rx = (mouse.x - view.x) / view.width;
+        double ry = (mouse.y - view.y) / view.height;
+        double px = x - 0.5 / zoom + rx / zoom;
+        double py = y - 0.5 / zoom + ry / zoom;
+
+        zoom *= pow(GUI_ZOOM_STEP, wheel);
+        zoom = zoom < 1 ? 1 : (zoom > GUI_MAX_ZOOM ? GUI_MAX_ZOOM : zoom);
+
+        x = px - rx / zoom + 0.5 / zoom;
+        y = py - ry / zoom + 0.5 / zoom;
+    }
+
+    if (IsKeyPressed(KEY_ZERO)) {
+        zoom = 1;
+        x = 0.5;
+        y = 0.5;
+    }
+
+    if (IsMouseButtonPressed(MOUSE_RIGHT_BUTTON) && inside) {
+        media_state->is_panning = 1;
+    } else if (!IsMouseButtonDown(MOUSE_RIGHT_BUTTON)) {
+        media_state->is_panning = 0;
+    }
+
+    if (media_state->is_panning) {
+        Vector2 delta = GetMouseDelta();
+        x -= delta.x / view.width / zoom;
+        y -= delta.y / view.height / zoom;
+    }
+
+    double half = 0.5 / zoom;
+    x = x < half ? half : (x > 1 - half ? 1 - half : x);
+    y = y < half ? half : (y > 1 - half ? 1 - half : y);
+
+    if (zoom == media_state->zoom && x == media_state->view_x &&
+        y == media_state->view_y) {
+        return;
+    }
+
+    media_state_set_view(media_state, zoom, x, y, state->video_area_width,
+                         state->video_area_height);
+}
+
+// Shows the next frame on the foreground media, dropping the audio on the way.
+int media_state_decode_next(MediaStateWrapper *media_state) {
+    Media *media = media_state->media;
+
+    while (1) {
+        while (!fq_empty(media->queue)) {
+            Node *node = fq_dequeue(media->queue);
+            if (node->type == FRAME_TYPE_VIDEO) {
+                media_state_show_frame(media_state, node->frame);
+                node_free(node);
+                return 0;
+            } else if (node->type == FRAME_TYPE_REPEAT) {
+                // The picture on screen stays, one frame later.
+                media_state->frame_pts = node->frame->best_effort_timestamp;
+                media_state_update_position(media_state, node->frame);
+                node_free(node);
+                return 0;
+            }
+            node_free(node);
+        }
+
+        int ret = media_read_frame(media);
+        if (ret < 0) {
+            return ret;
+        }
+
+        ret = media_decode(media);
+        if (ret < 0 && ret != MEDIA_ERR_MORE_DATA) {
+            return ret;
+        }
+    }
+}
+
+void gui_state_step_media(GuiState *state, int direction) {
+    if (state->media_count == 0) {
+        return;
+    }
+
+    MediaStateWrapper *media_state = state->medias[state->current_media_idx];
+    if (media_state->audio_only) {
+        return;
+    }
+
+    if (media_state->is_playing) {
+        gui_state_play_media(state);
+    }
+    media_state->is_reversing = 0;
+
+    if (media_state->frame_pts == AV_NOPTS_VALUE) {
+        return;
+    }
+
+    GopCache *cache = media_state_gop_cache(media_state);
+    if (!cache) {
+        return;
+    }
+
+    AVFrame *frame = NULL;
+    int ret = direction < 0 ? gop_cache_prev(cache, media_state->frame_pts, &frame)
+                            : gop_cache_next(cache, media_state->frame_pts, &frame);
+
+    if (ret == MEDIA_ERR_MORE_DATA) {
+        // The next frame is not cached. If the demuxer is still where the
+        // frame on screen came from, just keep decoding; otherwise seek to
+        // the middle of the next frame.
+        if (!media_state->needs_resync) {
+            media_state_decode_next(media_state);
+            return;
+        }
+
+        Media *media = media_state->media;
+        int64_t target = media_state->frame_pts + cache->frame_duration +
+                         cache->frame_duration / 2;
+        gui_state_present_seek(
+            media_state,
+            av_rescale_q(target,
+                         media->fmt_ctx->streams[media->video_stream_idx]->time_base,
+                         AV_TIME_BASE_Q),
+            1);
+        return;
+    } else if (ret < 0) {
+        return;
+    }
+
+    media_state_show_frame(media_state, frame);
+    av_frame_free(&frame);
+
+    media_state->end_of_file = 0;
+    media_state->needs_resync = 1;
+}
+
+void gui_state_reverse_media(GuiState *state) {
+    if (state->media_count == 0) {
+        return;
+    }
+
+    MediaStateWrapper *media_state = state->medias[state->current_media_idx];
+    if (media_state->is_reversing) {
+        media_state->is_reversing = 0;
+        return;
+    }
+
+    if (media_state->audio_only) {
+        return;
+    }
+
+    if (media_state->is_playing) {
+        gui_state_play_media(state);
+    }
+
+    if (media_state->frame_pts == AV_NOPTS_VALUE ||
+        !media_state_gop_cache(media_state)) {
+        return;
+    }
+
+    media_state->is_reversing = 1;
+    media_state->needs_resync = 1;
+    media_state->end_of_file = 0;
+    media_state->reverse_start_time = GetTime();
+    media_state->reverse_start_pts = media_state->frame_pts;
+}
+
+// Plays backwards at 1x: the clock runs down from where reverse playback
+// started, and the latest frame that is due is shown.
+void gui_state_reverse_tick(GuiState *state) {
+    if (state->media_count == 0) {
+        return;
+    }
+
+    MediaStateWrapper *media_state = state->medias[state->current_media_idx];
+    if (!media_state->is_reversing) {
+        return;
+    }
+
+    GopCache *cache = media_state->gop_cache;
+    double time_base = av_q2d(cache->time_base);
+    double clock = media_state->reverse_start_pts * time_base -
+                   (GetTime() - media_state->reverse_start_time);
+
+    AVFrame *due = NULL;
+    int64_t pts = media_state->frame_pts;
+    while (1) {
+        AVFrame *frame = NULL;
+        if (gop_cache_prev(cache, pts, &frame) < 0) {
+            // Reached the start of the media.
+            media_state->is_reversing = 0;
+            break;
+        }
+
+        if (frame->best_effort_timestamp * time_base < clock) {
+            av_frame_free(&frame);
+            break;
+        }
+
+        av_frame_free(&due);
+        due = frame;
+        pts = frame->best_effort_timestamp;
+    }
+
+    if (due) {
+        media_state_show_frame(media_state, due);
+        av_frame_free(&due);
+    }
+}
+
+// Draws the part of the overview computed so far, one column per pixel: the
+// peaks in a light shade and the RMS over them.
+void gui_state_draw_waveform(Waveform *waveform, Rectangle area) {
+    int filled = waveform_filled(waveform);
+    if (filled == 0) {
+        return;
+    }
+
+    float center = area.y + area.height / 2;
+    float scale = area.height / 2;
+
+    for (int x = 0; x < (int)area.width; x++) {
+        int first = (int64_t)x * waveform->nb_buckets / (int)area.width;
+        int last = (int64_t)(x + 1) * waveform->nb_buckets / (int)area.width;
+        if (last <= first) {
+            last = first + 1;
+        }
+        if (last > filled) {
+            break;
+        }
+
+        float min = 0, max = 0, rms = 0;
+        for (int i = first; i < last; i++) {
+            WaveformPeak *peak = &waveform->peaks[i];
+            min = fminf(min, peak->min);
+            max = fmaxf(max, peak->max);
+            rms = fmaxf(rms, peak->rms);
+        }
+
+        min = fmaxf(min, -1);
+        max = fminf(max, 1);
+        rms = fminf(rms, 1);
+
+        DrawLine(area.x + x, center - max * scale, area.x + x,
+                 center - min * scale + 1, Fade(GRAY, 0.4f));
+        DrawLine(area.x + x, center - rms * scale, area.x + x,
+                 center + rms * scale + 1, Fade(DARKGRAY, 0.5f));
+    }
+}
+
+// ##################### PLAYBACK FUNCTIONS #####################
+
+// Forgets what was decoded ahead, after the demuxer was moved. A loop pass
+// being recorded now has a gap, so it is dropped.
+void media_state_drop_pending(MediaStateWrapper *media_state) {
+    fq_clear(media_state->audio_pending);
+    media_state->decode_eof = 0;
+
+    if (media_state->loop_cache) {
+        loop_cache_stop(media_state->loop_cache);
+    }
+}
+
+// Plays everything of the media that is due before the next redraw. Packets
+// are decoded until the first video frame due after it is ready; of the video
+// frames due by then only the last one is shown, the others being late, and
+// the audio is handed to the stream as fast as it asks for it.
+void gui_state_play_tick(GuiState *state, MediaStateWrapper *media_state) {
+    Media *media = media_state->media;
+    LoopCache *loop = media_state->loop_enabled ? media_state->loop_cache : NULL;
+    double loop_end = (double)media_state->end_timestamp / AV_TIME_BASE;
+    int wrapped = 0;
+
+    double video_time_base =
+        media->video_stream_idx >= 0
+            ? av_q2d(media->fmt_ctx->streams[media->video_stream_idx]->time_base)
+            : 0;
+    double audio_time_base =
+        media->audio_stream_idx >= 0
+            ? av_q2d(media->fmt_ctx->streams[media->audio_stream_idx]->time_base)
+            : 0;
+    int has_video = media->video_ctx && !media_state->audio_only;
+
+    AVFrame *due = NULL;
+    while (1) {
+        // Wrapping a loop moves the clock.
+        double horizon = GetTime() - state->now + 1.0 / state->target_fps;
+
+        Node *node = fq_peek(media->queue);
+        if (!node) {
+            if (loop && loop->replaying) {
+                if (loop_cache_next(loop, media->queue) == 0) {
+                    continue;
+                }
+            } else if (!media_state->decode_eof) {
+                int64_t duration = media->fmt_ctx->duration;
+                int ret = media_read_frame(media);
+                if (ret == MEDIA_ERR_EOF) {
+                    media_state->decode_eof = 1;
+                    continue;
+                } else if (ret == MEDIA_ERR_MORE_DATA) {
+                    // A followed file has nothing more yet: the clock waits
+                    // at what was read instead of running past it.
+                    double read = (double)media->current_ts / AV_TIME_BASE;
+                    if (GetTime() - state->now > read) {
+                        state->now = GetTime() - read;
+                    }
+                    break;
+                } else if (ret < 0) {
+                    TraceLog(LOG_ERROR, "Failed to read frame: %d", ret);
+                    break;
+                }
+
+                // An end marker left at the end of a followed file stays there.
+                if (media_state->end_timestamp == duration) {
+                    media_state->end_timestamp = media->fmt_ctx->duration;
+                }
+
+                if (media->pkt->stream_index != media->video_stream_idx &&
+                    media->pkt->stream_index != media->audio_stream_idx) {
+                    continue;
+                }
+
+                ret = media_decode(media);
+                if (ret < 0 && ret != MEDIA_ERR_MORE_DATA) {
+                    TraceLog(LOG_ERROR, "Failed to decode frame: %d", ret);
+                    break;
+                }
+                continue;
+            }
+
+            // The end of the file or of the replay also ends the loop.
+            if (loop && !wrapped && gui_state_loop_wrap(state, media_state) == 0) {
+                wrapped = 1;
+                continue;
+            }
+            break;
+        }
+
+        int64_t pts = node->frame->best_effort_timestamp;
+        if (node->type != FRAME_TYPE_AUDIO) {
+            double time = pts != AV_NOPTS_VALUE ? pts * video_time_base : horizon;
+            if (loop && time >= loop_end) {
+                if (wrapped || gui_state_loop_wrap(state, media_state) < 0) {
+                    break;
+                }
+                wrapped = 1;
+                continue;
+            }
+
+            if (time > horizon) {
+                state->next_frame_time = state->now + time;
+                break;
+            }
+
+            node = fq_dequeue(media->queue);
+            if (loop) {
+                loop_cache_add(loop, node->frame, node->type);
+            }
+            // A repeat leaves whatever is due, or on screen, as it is.
+            if (node->type == FRAME_TYPE_VIDEO) {
+                av_frame_free(&due);
+                due = node->frame;
+                node->frame = NULL;
+            }
+        } else {
+            double time = pts * audio_time_base;
+            if (loop && pts != AV_NOPTS_VALUE && time >= loop_end) {
+                // With video, the loop wraps on the video frames; the audio
+                // decoded ahead of them is past the end and dropped.
+                if (has_video) {
+                    node_free(fq_dequeue(media->queue));
+                    continue;
+                }
+                if (wrapped || gui_state_loop_wrap(state, media_state) < 0) {
+                    break;
+                }
+                wrapped = 1;
+                continue;
+            }
+
+            if (pts != AV_NOPTS_VALUE && time > horizon + GUI_AUDIO_LEAD) {
+                break;
+            }
+
+            node = fq_dequeue(media->queue);
+            if (loop) {
+                loop_cache_add(loop, node->frame, FRAME_TYPE_AUDIO);
+            }
+            fq_enqueue(media_state->audio_pending, node->frame, FRAME_TYPE_AUDIO);
+            node->frame = NULL;
+        }
+        node_free(node);
+    }
+
+    if (due) {
+        // Replayed frames do not go through the demuxer, which is what keeps
+        // the position up to date otherwise.
+        if (loop && loop->replaying) {
+            media_state_show_frame(media_state, due);
+        } else {
+            media_state_upload(media_state, due);
+        }
+        av_frame_free(&due);
+        media_state_update_quality(media_state);
+    }
+
+    media_state_match_audio_rate(media_state);
+    while (!fq_empty(media_state->audio_pending) &&
+           IsAudioStreamProcessed(media_state->audio)) {
+        Node *node = fq_dequeue(media_state->audio_pending);
+        UpdateAudioStream(media_state->audio, node->frame->data[0],
+                          node->frame->nb_samples);
+        node_free(node);
+    }
+
+    if (!loop && media_state->decode_eof && fq_empty(media->queue) &&
+        fq_empty(media_state->audio_pending)) {
+        media_state->end_of_file = 1;
+        media_state->is_playing = 0;
+    }
+}
+
+// ##################### LOOP FUNCTIONS #####################
+
+// Goes back to the start of the loop, so the first frame of the next pass is
+// due when the end of this one would have been. A recorded pass is replayed;
+// otherwise the media seeks to the keyframe before the start and decodes up to
+// it, recording the pass unless it is known not to fit.
+int gui_state_loop_wrap(GuiState *state, MediaStateWrapper *media_state) {
+    LoopCache *loop = media_state->loop_cache;
+    double length =
+        (double)(media_state->end_timestamp - media_state->start_timestamp) /
+        AV_TIME_BASE;
+
+    if (loop->recording && loop->count > 0) {
+        loop->recording = 0;
+        loop->ready = 1;
+    }
+
+    if (loop->ready) {
+        fq_clear(media_state->media->queue);
+        loop->replaying = 1;
+        loop->replay_pos = 0;
+    } else {
+        Media *media = media_state->media;
+        AVFrame *frame = NULL;
+        int ret = media->video_ctx && !media_state->audio_only
+                      ? media_seek_frame(media, media_state->start_timestamp, 1,
+                                         &frame)
+                      : media_seek_to(media, media_state->start_timestamp);
+        if (ret < 0) {
+            printf("gui_state_loop_wrap: failed to seek\n");
+            return -1;
+        }
+
+        // The first frame is presented when it is due, like the others, and
+        // the audio still pending from this pass is kept.
+        if (frame) {
+            fq_enqueue(media->queue, frame, FRAME_TYPE_VIDEO);
+        }
+        media_state->decode_eof = 0;
+        loop->recording = !loop->overflowed;
+    }
+
+    state->now += length;
+    return 0;
+}
+
+// Turns the A/B loop of the current media on or off. It starts over from the
+// start marker.
+void gui_state_toggle_loop(GuiState *state) {
+    if (state->media_count == 0 || state->grid_mode) {
+        return;
+    }
+
+    MediaStateWrapper *media_state = state->medias[state->current_media_idx];
+    Media *media = media_state->media;
+
+    if (media_state->loop_enabled) {
+        media_state->loop_enabled = 0;
+
+        // Replayed frames left the demuxer at the end of the loop.
+        if (media_state->loop_cache->replaying) {
+            gui_state_present_seek(media_state, media->current_ts, 1);
+            state->now = GetTime() - (double)media->current_ts / AV_TIME_BASE;
+        }
+        loop_cache_free(media_state->loop_cache);
+        media_state->loop_cache = NULL;
+        return;
+    }
+
+    if (media_state->end_timestamp <= media_state->start_timestamp) {
+        printf("gui_state_toggle_loop: the loop is empty\n");
+        return;
+    }
+
+    media_state->loop_cache = loop_cache_alloc(LOOP_CACHE_MAX_BYTES);
+    if (!media_state->loop_cache) {
+        printf("gui_state_toggle_loop: loop_cache_alloc failed\n");
+        return;
+    }
+
+    media_state->is_reversing = 0;
+    AVFrame *frame = NULL;
+    if (media_seek_frame(media, media_state->start_timestamp, 1, &frame) < 0) {
+        printf("gui_state_toggle_loop: failed to seek\n");
+        loop_cache_free(media_state->loop_cache);
+        media_state->loop_cache = NULL;
+        return;
+    }
+
+    media_state_show_frame(media_state, frame);
+    media_state_drop_pending(media_state);
+    media_state->end_of_file = 0;
+    media_state->needs_resync = 0;
+
+    // The start frame is played from the queue like the others, so the first
+    // pass records it, as gui_state_loop_wrap does for the passes after it.
+    fq_enqueue(media->queue, frame, FRAME_TYPE_VIDEO);
+
+    media_state->loop_enabled = 1;
+    media_state->loop_cache->recording = 1;
+    state->now = GetTime() - (double)media->current_ts / AV_TIME_BASE;
+}
+
+// Sets the start or end of the loop at the current position. A running loop
+// starts over with the new region.
+void gui_state_add_marker(GuiState *state, GuiStateMarker marker_type) {
+    if (state->media_count == 0) {
+        return;
+    }
+
+    MediaStateWrapper *media_state = state->medias[state->current_media_idx];
+    int64_t timestamp = media_state->media->current_ts;
+
+    if (marker_type == GUI_STATE_MARKER_START) {
+        media_state->start_timestamp = timestamp;
+        if (media_state->end_timestamp <= timestamp) {
+            media_state->end_timestamp = media_state->media->fmt_ctx->duration;
+        }
+    } else {
+        media_state->end_timestamp = timestamp;
+        if (media_state->start_timestamp >= timestamp) {
+            media_state->start_timestamp = 0;
+        }
+    }
+
+    if (media_state->loop_enabled) {
+        gui_state_toggle_loop(state);
+        gui_state_toggle_loop(state);
+    }
+}
+
+// Sleeps until `deadline` (GetTime clock), spinning through the last
+// GUI_SPIN_TIME for sub-millisecond accuracy.
+void gui_wait_until(double deadline) {
+    double remaining = deadline - GetTime();
+    if (remaining > GUI_SPIN_TIME) {
+        double sleep = remaining - GUI_SPIN_TIME;
+        struct timespec ts = {.tv_sec = (time_t)sleep,
+                              .tv_nsec = (long)((sleep - (time_t)sleep) * 1e9)};
+        nanosleep(&ts, NULL);
+    }
+
+    while (GetTime() < deadline) {
+    }
+}
+
+// ##################### AUDIO ONLY FUNCTIONS #####################
+
+// Stops (or restarts) everything video related for a media. The demuxer drops
+// the video packets, so nothing is decoded, converted or uploaded, while the
+// audio keeps driving the clock.
+void media_state_set_audio_only(MediaStateWrapper *media_state, int enabled) {
+    Media *media = media_state->media;
+    if (media_state->audio_only == enabled || !media->video_ctx ||
+        media->audio_stream_idx < 0) {
+        return;
+    }
+
+    media_state->audio_only = enabled;
+    media_state->is_reversing = 0;
+
+    if (enabled) {
+        media_set_stream_enabled(media, AVMEDIA_TYPE_VIDEO, 0);
+        return;
+    }
+
+    // Bring the video back to where the audio got to.
+    media_set_stream_enabled(media, AVMEDIA_TYPE_VIDEO, 1);
+    gui_state_present_seek(media_state, media->current_ts, 1);
+}
+
+// Audio only mode is entered while the window is minimized or hidden, or when
+// asked for. Grid mode is left alone, since its tiles are the point of it.
+void gui_state_update_audio_only(GuiState *state) {
+    if (IsKeyPressed(KEY_A)) {
+        state->audio_only = !state->audio_only;
+    }
+
+    if (state->media_count == 0 || state->grid_mode) {
+        return;
+    }
+
+    int enabled = state->audio_only || IsWindowMinimized() || IsWindowHidden();
+    MediaStateWrapper *media_state = state->medias[state->current_media_idx];
+    if (media_state->audio_only == enabled) {
+        return;
+    }
+
+    media_state_set_audio_only(media_state, enabled);
+
+    // The resync moved the position, so anchor the clock there again.
+    if (!enabled && media_state->is_playing) {
+        state->now =
+            GetTime() - (double)media_state->media->current_ts / AV_TIME_BASE;
+    }
+}
+
+// ##################### GRID FUNCTIONS #####################
+
+Rectangle gui_state_grid_tile(GuiState *state, int idx) {
+    int cols = 1;
+    while (cols * cols < state->grid_count) {
+        cols++;
+    }
+    int rows = (state->grid_count + cols - 1) / cols;
+
+    Rectangle area = state->layout.videoArea;
+    int width = area.width / cols;
+    int height = area.height / rows;
+
+    return (Rectangle){.x = area.x + (idx % cols) * width,
+                       .y = area.y + (idx / cols) * height,
+                       .width = width,
+                       .height = height};
+}
+
+// Converts the media frames to the largest size that fits in `width` x
+// `height` with the right aspect ratio. The textures follow with the first
+// frame of the new size.
+int media_state_resize(MediaStateWrapper *media_state, int width, int height) {
+    Media *media = media_state->media;
+
+    int dst_w, dst_h;
+    media_fit_output_size(media, width, height, &dst_w, &dst_h);
+    if (dst_w == media->output_w && dst_h == media->output_h) {
+        return 0;
+    }
+
+    if (media_set_output_size(media, dst_w, dst_h) < 0) {
+        printf("media_state_resize: failed to resize media output\n");
+        return -1;
+    }
+
+    // The cached frames were converted at the old size.
+    gop_cache_free(media_state->gop_cache);
+    media_state->gop_cache = NULL;
+
+    return 0;
+}
+
+// Only the focused tile is heard; the others do not even demux their audio.
+// The decoders are touched, so the tiles' decoding must be over first.
+void gui_state_grid_set_audio(GuiState *state) {
+    for (int i = 0; i < state->grid_count; i++) {
+        MediaStateWrapper *media_state = state->medias[i];
+        int focused = i == state->current_media_idx;
+
+        pool_group_wait(pool_global(), &media_state->decode_group);
+        media_set_stream_enabled(media_state->media, AVMEDIA_TYPE_AUDIO, focused);
+        if (!focused) {
+            fq_clear(media_state->audio_pending);
+        }
+        if (focused && media_state->media->audio_ctx) {
+            avcodec_flush_buffers(media_state->media->audio_ctx);
+        }
+
+        if (focused && state->grid_playing) {
+            ResumeAudioStream(media_state->audio);
+        } else {
+            PauseAudioStream(media_state->audio);
+        }
+    }
+
+    state->grid_focus = state->current_media_idx;
+}
+
+void gui_state_grid_play(GuiState *state) {
+    state->grid_playing = !state->grid_playing;
+
+    if (state->grid_playing) {
+        state->grid_start = GetTime() - state->grid_elapsed;
+    } else {
+        state->grid_elapsed = GetTime() - state->grid_start;
+    }
+
+    for (int i = 0; i < state->grid_count; i++) {
+        state->medias[i]->is_playing =
+            state->grid_playing && !state->medias[i]->end_of_file;
+    }
+
+    gui_state_grid_set_audio(state);
+}
+
+void gui_state_toggle_grid(GuiState *state) {
+    if (state->grid_mode) {
+        for (int i = 0; i < state->grid_count; i++) {
+            MediaStateWrapper *media_state = state->medias[i];
+            Media *media = media_state->media;
+
+            pool_group_wait(pool_global(), &media_state->decode_group);
+            media_state->decode_eof = 0;
+            media_state->is_playing = 0;
+            PauseAudioStream(media_state->audio);
+
+            media_set_stream_enabled(media, AVMEDIA_TYPE_AUDIO, 1);
+            media_set_keyframes_only(media, 0);
+            media->skip_until = AV_NOPTS_VALUE;
+
+            media_state_resize(media_state, state->video_area_width,
+                               state->video_area_height);
+
+            // Show where the tile got to at full size.
+            if (!media_state->end_of_file && media->video_ctx) {
+                gui_state_present_seek(media_state, media->current_ts, 1);
+            }
+        }
+
+        state->grid_mode = 0;
+        state->grid_count = 0;
+        state->grid_focus = -1;
+        return;
+    }
+
+    if (state->media_count < 2) {
+        printf("gui_state_toggle_grid: grid mode needs at least two medias\n");
+        return;
+    }
+
+    state->grid_mode = 1;
+    state->grid_count = state->media_count < GRID_MAX_TILES ? state->media_count
+                                                            : GRID_MAX_TILES;
+
+    for (int i = 0; i < state->grid_count; i++) {
+        MediaStateWrapper *media_state = state->medias[i];
+        Rectangle tile = gui_state_grid_tile(state, i);
+
+        media_state->is_playing = 0;
+        media_state->is_reversing = 0;
+        media_state->is_scrubbing = 0;
+        media_state_drop_pending(media_state);
+        media_state_set_audio_only(media_state, 0);
+
+        // Each tile converts the whole frame straight to its own size.
+        if (media_state->zoom != 1) {
+            media_state_set_view(media_state, 1, 0.5, 0.5, tile.width,
+                                 tile.height);
+        }
+        media_state_resize(media_state, tile.width, tile.height);
+
+        if (media_state->needs_resync) {
+            gui_state_present_seek(media_state, media_state->media->current_ts, 1);
+        }
+
+        media_state->grid_offset =
+            (double)media_state->media->current_ts / AV_TIME_BASE;
+    }
+
+    state->grid_playing = 0;
+    state->grid_elapsed = 0;
+    gui_state_grid_play(state);
+}
+
+// Fills the media queue until it holds a video frame past `decode_target`.
+// Runs on the thread pool, so it only touches the media and never raylib.
+void media_state_decode_ahead(void *arg) {
+    MediaStateWrapper *media_state = arg;
+    Media *media = media_state->media;
+
+    double time_base =
+        av_q2d(media->fmt_ctx->streams[media->video_stream_idx]->time_base);
+
+    while (1) {
+        int64_t last_pts = AV_NOPTS_VALUE;
+        for (Node *node = media->queue->head; node; node = node->next) {
+            if (node->type != FRAME_TYPE_AUDIO) {
+                last_pts = node->frame->best_effort_timestamp;
+            }
+        }
+
+        if (last_pts != AV_NOPTS_VALUE &&
+            last_pts * time_base > media_state->decode_target) {
+            break;
+        }
+
+        int ret = media_read_frame(media);
+        if (ret == MEDIA_ERR_EOF) {
+            media_state->decode_eof = 1;
+            break;
+        } else if (ret < 0) {
+            break;
+        }
+
+        if (media->pkt->stream_index != media->video_stream_idx &&
+            media->pkt->stream_index != media->audio_stream_idx) {
+            continue;
+        }
+
+        ret = media_decode(media);
+        if (ret < 0 && ret != MEDIA_ERR_MORE_DATA) {
+            break;
+        }
+    }
+}
+
+// Shows the latest decoded frame of a tile that is due at `target` (seconds
+// of media time). Must not be called while the tile is being decoded.
+void media_state_grid_present(MediaStateWrapper *media_state, double target,
+                              int focused) {
+    Media *media = media_state->media;
+    double time_base =
+        av_q2d(media->fmt_ctx->streams[media->video_stream_idx]->time_base);
+    double audio_time_base =
+        media->audio_stream_idx >= 0
+            ? av_q2d(media->fmt_ctx->streams[media->audio_stream_idx]->time_base)
+            : 0;
+
+    AVFrame *due = NULL;
+    Node *node;
+    while ((node = fq_peek(media->queue))) {
+        int64_t pts = node->frame->best_effort_timestamp;
+        if (node->type != FRAME_TYPE_AUDIO && pts != AV_NOPTS_VALUE &&
+            pts * time_base > target) {
+            break;
+        }
+
+        node = fq_dequeue(media->queue);
+        if (node->type == FRAME_TYPE_VIDEO) {
+            av_frame_free(&due);
+            due = node->frame;
+            node->frame = NULL;
+        } else if (node->type == FRAME_TYPE_AUDIO && focused) {
+            // Waits until the stream has room, so none of it is dropped.
+            fq_enqueue(media_state->audio_pending, node->frame,
+                       FRAME_TYPE_AUDIO);
+            node->frame = NULL;
+        }
+        node_free(node);
+    }
+
+    if (due) {
+        media_state_upload(media_state, due);
+        av_frame_free(&due);
+        media_state_update_quality(media_state);
+    }
+
+    // Like gui_state_play_tick, the stream is fed a little ahead of the clock
+    // only. Audio is not held back in the decoded queue for that, as the video
+    // frames behind it would wait too.
+    if (focused) {
+        media_state_match_audio_rate(media_state);
+        while ((node = fq_peek(media_state->audio_pending)) &&
+               IsAudioStreamProcessed(media_state->audio)) {
+            int64_t pts = node->frame->best_effort_timestamp;
+            if (pts != AV_NOPTS_VALUE &&
+                pts * audio_time_base > target + GUI_AUDIO_LEAD) {
+                break;
+            }
+
+            node = fq_dequeue(media_state->audio_pending);
+            UpdateAudioStream(media_state->audio, node->frame->data[0],
+                              node->frame->nb_samples);
+            node_free(node);
+        }
+    }
+}
+
+void gui_state_grid_tick(GuiState *state) {
+    if (!state->grid_mode || !state->grid_playing) {
+        return;
+    }
+
+    if (state->grid_focus != state->current_media_idx) {
+        gui_state_grid_set_audio(state);
+    }
+
+    double now = GetTime();
+    double clock = now - state->grid_start;
+
+    for (int i = 0; i < state->grid_count; i++) {
+        MediaStateWrapper *media_state = state->medias[i];
+        Media *media = media_state->media;
+        int focused = i == state->current_media_idx;
+
+        // A tile whose decoding has not finished yet keeps its frame, and
+        // catches up on the next tick.
+        if (!media_state->is_playing || !media->video_ctx ||
+            pool_group_busy(&media_state->decode_group)) {
+            continue;
+        }
+
+        double target = clock + media_state->grid_offset;
+        media_state_grid_present(media_state, target, focused);
+
+        if (media_state->decode_eof && fq_empty(media->queue) &&
+            fq_empty(media_state->audio_pending)) {
+            media_state->end_of_file = 1;
+            media_state->is_playing = 0;
+            continue;
+        }
+
+        AVRational time_base =
+            media->fmt_ctx->streams[media->video_stream_idx]->time_base;
+        double shown = media_state->frame_pts != AV_NOPTS_VALUE
+                           ? media_state->frame_pts * av_q2d(time_base)
+                           : target;
+
+        // Unfocused tiles that fell behind catch up by not decoding the frames
+        // nothing refers to, and by not converting the ones they are late for.
+        int behind = !focused && target - shown > GRID_LATE_TIME;
+        media->video_ctx->skip_frame = behind ? AVDISCARD_NONREF : media->skip_frame;
+        media->skip_until =
+            behind ? av_rescale_q((int64_t)(target * AV_TIME_BASE), AV_TIME_BASE_Q,
+                                  time_base)
+                   : AV_NOPTS_VALUE;
+
+        // Decode what the next tick needs. The deadline is when the frame
+        // after the one on screen is due, so late tiles come first.
+        media_state->decode_target = target + 1.0 / state->target_fps;
+        double due = state->grid_start + shown + 1.0 / state->target_fps -
+                     media_state->grid_offset;
+        PoolTask task = {
+            .run = media_state_decode_ahead,
+            .arg = media_state,
+            .priority = focused ? POOL_PRIORITY_AUDIBLE : POOL_PRIORITY_VISIBLE,
+            .deadline = av_gettime_relative() + (int64_t)((due - now) * 1e6),
+            .owner = &media->pool_owner,
+            .group = &media_state->decode_group};
+        pool_submit(pool_global(), task);
+    }
+}
+
+int gui_state_update(GuiState *state) {
+    if (IsFileDropped()) {
+        FilePathList dropped_files = LoadDroppedFiles();
+        for (int i = 0; i < (int)dropped_files.count; i++) {
+            // The files of a directory join the list as they get indexed.
+            if (DirectoryExists(dropped_files.paths[i])) {
+                library_add_path(state->library, dropped_files.paths[i]);
+                continue;
+            }
+
+            if (gui_state_open_media(state, dropped_files.paths[i]) < 0) {
+                printf("gui_state_update: failed to open %s\n",
+                       dropped_files.paths[i]);
+                UnloadDroppedFiles(dropped_files);
+                return -1;
+            }
+        }
+
+        UnloadDroppedFiles(dropped_files);
+    }
+
+    gui_state_update_library(state);
+    gui_state_update_window(state);
+
+    if (IsMouseButtonPressed(MOUSE_LEFT_BUTTON) && state->media_count > 0) {
+        Vector2 mouse = GetMousePosition();
+        if (CheckCollisionPointRec(mouse, state->layout.playButton)) {
+            gui_state_play_media(state);
+        } else if (CheckCollisionPointRec(mouse, state->layout.resetButton)) {
+            gui_state_reset_media(state);
+        } else if (state->grid_mode &&
+                   CheckCollisionPointRec(mouse, state->layout.videoArea)) {
+            for (int i = 0; i < state->grid_count; i++) {
+                if (CheckCollisionPointRec(mouse, gui_state_grid_tile(state, i))) {
+                    state->current_media_idx = i;
+                    state->current_media = state->medias[i]->media;
+                }
+            }
+        }
+    }
+
+    gui_state_scrub(state);
+    gui_state_update_zoom(state);
+
+    if (IsKeyPressed(KEY_DOWN) && state->media_count > 0) {
+        gui_state_media_down(state);
+    } else if (IsKeyPressed(KEY_UP) && state->media_count > 0) {
+        gui_state_media_up(state);
+    }
+
+    if (IsKeyDown(KEY_LEFT_CONTROL) && IsKeyPressed(KEY_X)) {
+        gui_state_remove_media(state);
+    }
+
+    if (IsKeyPressed(KEY_G)) {
+        gui_state_toggle_grid(state);
+    }
+
+    gui_state_update_audio_only(state);
+
+    if (state->grid_mode) {
+        gui_state_grid_tick(state);
+        return 0;
+    }
+
+    if (IsKeyPressed(KEY_COMMA)) {
+        gui_state_step_media(state, -1);
+    } else if (IsKeyPressed(KEY_PERIOD)) {
+        gui_state_step_media(state, 1);
+    } else if (IsKeyPressed(KEY_J)) {
+        gui_state_reverse_media(state);
+    } else if (IsKeyPressed(KEY_LEFT_BRACKET)) {
+        gui_state_add_marker(state, GUI_STATE_MARKER_START);
+    } else if (IsKeyPressed(KEY_RIGHT_BRACKET)) {
+        gui_state_add_marker(state, GUI_STATE_MARKER_END);
+    } else if (IsKeyPressed(KEY_L)) {
+        gui_state_toggle_loop(state);
+    } else if (IsKeyPressed(KEY_LEFT)) {
+        gui_state_jump(state, -GUI_JUMP_SECONDS);
+    } else if (IsKeyPressed(KEY_RIGHT)) {
+        gui_state_jump(state, GUI_JUMP_SECONDS);
+    } else if (IsKeyPressed(KEY_T)) {
+        gui_state_next_audio_track(state);
+    }
+
+    gui_state_reverse_tick(state);
+
+    state->next_frame_time = INFINITY;
+    if (state->media_count > 0 &&
+        state->medias[state->current_media_idx]->is_playing) {
+        gui_state_play_tick(state, state->medias[state->current_media_idx]);
+    }
+
+    return 0;
+}
+
+void gui_state_draw(GuiState *state) {
+    DrawRectangleLinesEx(state->layout.mediaArea, 2, GRAY);
+    if (state->media_count == 0) {
+        DrawText("Drop media files here!", state->layout.mediaArea.x + 15,
+                 state->layout.mediaArea.height / 2, 25, GRAY);
+    } else {
+        for (int i = 0; i < state->media_count; i++) {
+            DrawRectangle(state->layout.mediaArea.x, state->layout.mediaArea.y + 35 * i,
+                          state->layout.mediaArea.width, 35,
+                          i == state->current_media_idx
+                              ? SKYBLUE
+                              : (i % 2 == 0 ? GRAY : LIGHTGRAY));
+            int text_x = state->layout.mediaArea.x + 10;
+            Texture2D poster = state->medias[i]->poster;
+            if (state->medias[i]->has_poster && poster.id > 0) {
+                float height = 31;
+                float width = height * poster.width / poster.height;
+                DrawTexturePro(poster,
+                               (Rectangle){0, 0, poster.width, poster.height},
+                               (Rectangle){state->layout.mediaArea.x + 4,
+                                           state->layout.mediaArea.y + 35 * i + 2,
+                                           width, height},
+                               (Vector2){0, 0}, 0, WHITE);
+                text_x += width + 4;
+            }
+
+            DrawText(basename(state->medias[i]->media->filename),
+                     text_x, state->layout.mediaArea.y + 35 * i, 20,
+                     i == state->current_media_idx ? BLUE : DARKGRAY);
+        }
+    }
+
+    DrawRectangleLinesEx(state->layout.videoAreaBorder, 2, GRAY);
+    DrawRectangleRec(state->layout.videoArea, WHITE);
+
+    if (state->grid_mode) {
+        for (int i = 0; i < state->grid_count; i++) {
+            MediaStateWrapper *media_state = state->medias[i];
+            Rectangle tile = gui_state_grid_tile(state, i);
+            int focused = i == state->current_media_idx;
+
+            if (media_state->end_of_file) {
+                DrawText("End of file", tile.x + 10, tile.y + 10, 20, RED);
+            } else {
+                gui_draw_video(media_state_texture(media_state), tile);
+            }
+
+            DrawText(basename(media_state->media->filename), tile.x + 5,
+                     tile.y + tile.height - 20, 15, LIGHTGRAY);
+            DrawRectangleLinesEx(tile, focused ? 2 : 1, focused ? SKYBLUE : GRAY);
+        }
+    } else if (state->media_count > 0 &&
+        state->medias[state->current_media_idx]->end_of_file) {
+        DrawText("End of file", state->layout.videoArea.x + 10, state->layout.videoArea.y + 10, 20,
+                 RED);
+    } else if (state->media_count > 0) {
+        if (state->medias[state->current_media_idx]->audio_only) {
+            DrawText("Audio only", state->layout.videoArea.x + 10,
+                     state->layout.videoArea.y + 10, 20, GRAY);
+        } else {
+            gui_draw_video(media_state_texture(state->medias[state->current_media_idx]),
+                           state->layout.videoArea);
+            if (state->medias[state->current_media_idx]->zoom > 1) {
+                DrawText(TextFormat("%.1fx", state->medias[state->current_media_idx]->zoom),
+                         state->layout.videoArea.x + 10,
+                         state->layout.videoArea.y + 10, 20, LIGHTGRAY);
+            }
+        }
+
+        if (GetTime() < state->osd_until) {
+            DrawText(state->osd, state->layout.videoArea.x + 10,
+                     state->layout.videoArea.y + state->layout.videoArea.height - 30,
+                     20, LIGHTGRAY);
+        }
+
+        // Draw the current position at one tip of the video progress area,
+        // and the video duration at the other tip.
+        MediaStateWrapper *media_state = state->medias[state->current_media_idx];
+        Media *current_media = media_state->media;
+
+        Rectangle progress = state->layout.videoProgressArea;
+        int64_t timestamp = media_state->is_scrubbing ? media_state->scrub_target
+                                                      : current_media->current_ts;
+        float ratio = current_media->fmt_ctx->duration > 0
+                          ? (float)timestamp / current_media->fmt_ctx->duration
+                          : 0;
+        if (ratio > 1) {
+            ratio = 1;
+        }
+
+        DrawRectangle(progress.x, progress.y, progress.width * ratio,
+                      progress.height, LIGHTGRAY);
+        if (media_state->loop_enabled && current_media->fmt_ctx->duration > 0) {
+            float a = (float)media_state->start_timestamp /
+                      current_media->fmt_ctx->duration * progress.width;
+            float b = (float)media_state->end_timestamp /
+                      current_media->fmt_ctx->duration * progress.width;
+            DrawRectangle(progress.x + a, progress.y, b - a, progress.height,
+                          Fade(SKYBLUE, 0.25f));
+        }
+        gui_state_draw_waveform(media_state->waveform, progress);
+        DrawRectangle(progress.x + progress.width * ratio - 1, progress.y, 2,
+                      progress.height, SKYBLUE);
 
         DrawText(current_media->formatted_position,
                  state->layout.videoProgressArea.x + 10, state->layout.videoProgressArea.y + 5, 20,
@@ -367,10 +2181,13 @@ void gui_state_draw(GuiState *state) {
 }
 
 void gui_state_run(GuiState *state) {
+    SetConfigFlags(FLAG_WINDOW_RESIZABLE);
     InitWindow(WINDOW_WIDTH, WINDOW_HEIGHT, "AVP - Another Video Player");
+    SetWindowMinSize(WINDOW_MIN_WIDTH, WINDOW_MIN_HEIGHT);
     InitAudioDevice();
 
     while (!WindowShouldClose()) {
+        double tick_start = GetTime();
         PollInputEvents();
 
         gui_state_update(state);
@@ -384,34 +2201,15 @@ void gui_state_run(GuiState *state) {
         SwapScreenBuffer();
 
         state->elapsed = GetTime() - state->now;
-        if (state->media_count > 0 &&
-            state->medias[state->current_media_idx]->is_playing) {
-            Media *current_media =
-                state->medias[state->current_media_idx]->media;
-
-            int stream_index;
-            if (current_media->pkt->stream_index ==
-                current_media->video_stream_idx) {
-                stream_index = current_media->video_stream_idx;
-            } else {
-                stream_index = current_media->audio_stream_idx;
-            }
-
-            double timebase = av_q2d(
-                current_media->fmt_ctx->streams[stream_index]->time_base);
-            double pts = (double)current_media->pkt->pts;
-
-            double pts_time = timebase * pts;
-            double wait_time = pts_time - state->elapsed;
 
-            if (wait_time > 0) {
-                WaitTime(wait_time);
-            }
-        } else {
-            if (state->elapsed < 1.0 / state->target_fps) {
-                WaitTime(1.0 / state->target_fps - state->elapsed);
-            }
+        // Redraw at the target frame rate, or earlier when a video frame is
+        // due before that. Grid tiles are decoded against the grid clock, so
+        // in grid mode only the frame rate matters.
+        double deadline = tick_start + 1.0 / state->target_fps;
+        if (!state->grid_mode && state->next_frame_time < deadline) {
+            deadline = state->next_frame_time;
         }
+        gui_wait_until(deadline);
     }
 }
 
@@ -420,11 +2218,9 @@ void gui_state_free(GuiState *state) {
     CloseWindow();
 
     for (int i = 0; i < state->media_count; i++) {
-        media_free(state->medias[i]->media);
-        UnloadTexture(state->medias[i]->texture);
-        StopAudioStream(state->medias[i]->audio);
-        UnloadAudioStream(state->medias[i]->audio);
-        free(state->medias[i]);
+        media_state_free(state->medias[i]);
     }
+    library_free(state->library);
+    pool_global_free();
     free(state);
 }
\ No newline at end of file
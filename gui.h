@@ -2,11 +2,81 @@
 #define GUI_H
 
 #include "media.h"
+#include "gop_cache.h"
+#include "library.h"
+#include "loop_cache.h"
+#include "waveform.h"
 #include "raylib.h"
 #include "common.h"
 
+#define MEDIA_STATE_TEXTURES 3
+
+// Audio is decoded up to this far (seconds) past the next redraw, so the
+// stream never runs dry between two ticks.
+#define GUI_AUDIO_LEAD 0.25
+
+// The end of every wait is spun instead of slept, since sleeps routinely
+// overshoot by about this much (seconds).
+#define GUI_SPIN_TIME 0.001
+
+// Distance (seconds) the left and right arrow keys jump back and forth.
+#define GUI_JUMP_SECONDS 5
+
+// How long (seconds) a message stays over the video.
+#define GUI_OSD_TIME 2.0
+
+// Zoom range of the video area, and the factor of one step of the wheel.
+#define GUI_MAX_ZOOM 8.0
+#define GUI_ZOOM_STEP 1.25
+
 #define WINDOW_WIDTH 1280
 #define WINDOW_HEIGHT 720
+#define WINDOW_MIN_WIDTH 640
+#define WINDOW_MIN_HEIGHT 360
+
+// How long (seconds) the window size must hold before the medias convert to
+// it.
+#define GUI_RESIZE_DELAY 0.15
+
+// Grid mode plays up to this many medias at once.
+#define GRID_MAX_TILES 16
+
+// How far behind the grid clock (seconds) an unfocused tile may be before it
+// starts dropping frames to catch up.
+#define GRID_LATE_TIME 0.1
+
+// A file modified this recently (seconds) when opened is taken as still being
+// recorded, and followed.
+#define GUI_FOLLOW_RECENT 3.0
+
+// How the medias are opened, set from the environment by gui_state_init.
+typedef struct {
+    // I/O layer. Set from the AVP_IO ("default", "readahead" or "mmap") and
+    // AVP_IO_BUFFER_MB variables.
+    enum MediaIOMode io_mode;
+    size_t io_buffer_size;
+
+    // Filters, from the AVP_VF and AVP_AF variables (NULL for none).
+    // Interlaced video is deinterlaced unless AVP_DEINTERLACE is 0.
+    const char *video_filters, *audio_filters;
+    int deinterlace;
+
+    // Fast open mode, unless AVP_FAST_OPEN is 0. Probing can be bounded with
+    // AVP_PROBE_SIZE (bytes) and AVP_ANALYZE_MS.
+    int fast_open;
+    int64_t probe_size, analyze_duration;
+
+    // Video frames identical to the previous one are not converted nor
+    // uploaded, unless AVP_SKIP_DUPLICATES is 0.
+    int skip_duplicates;
+
+    // Follow mode for files still being written: always with AVP_FOLLOW=1,
+    // never with 0, and otherwise (-1) for files modified in the last
+    // GUI_FOLLOW_RECENT seconds. AVP_FOLLOW_LATENCY_MS is how far behind the
+    // end of the file playback stays.
+    int follow;
+    int64_t follow_latency;
+} MediaOpenOptions;
 
 typedef enum {
     GUI_STATE_MARKER_START,
@@ -17,12 +87,78 @@ typedef struct {
     int is_playing;
     int end_of_file;
 
-    // For clipping purposes.
+    // For clipping purposes, and the A/B loop (AV_TIME_BASE units). The loop
+    // cache exists while the loop is enabled.
     int64_t start_timestamp, end_timestamp;
+    int loop_enabled;
+    LoopCache *loop_cache;
+
+    // Scrubbing state. While the progress bar is dragged, only the latest
+    // target is executed each tick, and only when it lands on a different
+    // keyframe than the one already on screen.
+    int is_scrubbing, was_playing;
+    int64_t scrub_target, scrub_shown;
+
+    // Pts (video stream time base) of the frame on screen.
+    int64_t frame_pts;
+
+    // Backward playback and frame stepping. Frames come from the GOP cache,
+    // which is only created the first time the media goes backwards.
+    GopCache *gop_cache;
+    int is_reversing;
+    double reverse_start_time;
+    int64_t reverse_start_pts;
+
+    // Amplitude overview drawn in the progress bar, NULL without audio.
+    Waveform *waveform;
+
+    // Set when the frame on screen did not come from the media demuxer, which
+    // then has to seek there before playing forward.
+    int needs_resync;
+
+    // Media position (seconds) when the grid clock started.
+    double grid_offset;
+
+    // Grid tiles are decoded on the thread pool, up to `decode_target`
+    // (seconds of media time). The media is not touched by the GUI while the
+    // group is busy.
+    PoolGroup decode_group;
+    double decode_target;
+    int decode_eof;
+
+    // Set while the video stream is dropped at the demuxer.
+    int audio_only;
+
+    // Decoded audio waiting for the audio stream to ask for more.
+    FrameQueue *audio_pending;
 
     Media *media;
 
-    Texture2D texture;
+    // Frames are uploaded round robin into a ring of textures, so the one
+    // being written was last drawn a few frames ago and the driver is done
+    // with it; `texture_front` is the last complete one, which is drawn.
+    Texture2D textures[MEDIA_STATE_TEXTURES];
+    int texture_front;
+
+    // Time spent in UpdateTexture (seconds): moving average and worst case.
+    double upload_time, upload_time_max;
+    int64_t uploads;
+
+    // Zoom factor, and center of the view as fractions of the frame. Only
+    // the visible part of the frames is converted.
+    double zoom, view_x, view_y;
+    int is_panning;
+
+    // What the library knows about the file, and its poster for the media
+    // list once it is indexed.
+    LibraryEntry *library_entry;
+    Texture2D poster;
+    int has_poster;
+
+    // When the media was dropped (GetTime clock), and how long it took until
+    // its first frame was on screen (seconds), or -1.
+    double open_time, first_frame_time;
+
     AudioStream audio;
 } MediaStateWrapper;
 
@@ -41,21 +177,55 @@ typedef struct {
     // This is used to resize the video data to display on the screen.
     int video_area_width, video_area_height, video_destination_fmt;
 
+    // Used for the medias opened from now on.
+    MediaOpenOptions open_options;
+
     double now, elapsed;
     int target_fps;
 
+    // When the next video frame of the playing media is due (GetTime clock),
+    // or INFINITY. The loop wakes up for it even between redraws.
+    double next_frame_time;
+
+    // Grid mode plays the first `grid_count` medias at once, each in its own
+    // tile, against one shared clock. Only the focused tile is heard.
+    int grid_mode, grid_count, grid_playing, grid_focus;
+    double grid_start, grid_elapsed;
+
+    // Set while the window was resized and the medias still convert for the
+    // old size, since `resize_time` (GetTime clock).
+    int resize_pending;
+    double resize_time;
+
+    // Every file dropped so far, indexed in the background.
+    Library *library;
+
+    // Message drawn over the video until `osd_until` (GetTime clock).
+    char osd[128];
+    double osd_until;
+
+    // Audio only mode asked for by hand. It is also entered automatically
+    // while the window is minimized.
+    int audio_only;
+
     GuiLayout layout;
     MediaStateWrapper *medias[MAX_MEDIA];
 } GuiState;
 
-void init_layout(GuiLayout *layout);
+void init_layout(GuiLayout *layout, int width, int height);
+Rectangle gui_fit_rect(Rectangle area, Texture2D texture);
+void gui_draw_video(Texture2D texture, Rectangle area);
+void gui_state_update_window(GuiState *state);
 
 // Media state related functions
 MediaStateWrapper *media_state_wrapper_alloc();
 
 int media_state_init(MediaStateWrapper *media_state, int dst_frame_w,
-                             int dst_frame_h, enum AVPixelFormat dst_frame_fmt, const char *filename);
+                             int dst_frame_h, enum AVPixelFormat dst_frame_fmt, const char *filename,
+                             const MediaOpenOptions *options);
+void media_state_start_waveform(MediaStateWrapper *media_state);
 void media_state_free(MediaStateWrapper *media_state);
+void media_state_log_filters(const char *filename, FilterChain *chain);
 
 // Gui state related functions
 GuiState *gui_state_alloc();
@@ -63,11 +233,49 @@ GuiState *gui_state_alloc();
 void gui_state_init(GuiState *state);
 
 void gui_state_load_media(GuiState *state, const char *filename);
+void gui_state_add_media(GuiState *state, MediaStateWrapper *ms);
+int gui_state_open_media(GuiState *state, const char *path);
+void gui_state_update_library(GuiState *state);
+int media_state_show_first_frame(MediaStateWrapper *media_state);
 int gui_state_remove_media(GuiState *state);
 void gui_state_play_media(GuiState *state);
 void gui_state_reset_media(GuiState *state);
 void gui_state_add_marker(GuiState *state, GuiStateMarker marker_type);
 
+int gui_state_present_seek(MediaStateWrapper *media_state, int64_t timestamp,
+                           int accurate);
+void gui_state_scrub(GuiState *state);
+void gui_state_jump(GuiState *state, int seconds);
+void gui_state_show_osd(GuiState *state, const char *text);
+void gui_state_next_audio_track(GuiState *state);
+void media_state_set_view(MediaStateWrapper *media_state, double zoom,
+                          double view_x, double view_y, int box_w, int box_h);
+void gui_state_update_zoom(GuiState *state);
+
+void gui_state_step_media(GuiState *state, int direction);
+void gui_state_reverse_media(GuiState *state);
+void gui_state_reverse_tick(GuiState *state);
+
+Rectangle gui_state_grid_tile(GuiState *state, int idx);
+void gui_state_toggle_grid(GuiState *state);
+void gui_state_grid_play(GuiState *state);
+void gui_state_grid_tick(GuiState *state);
+int media_state_resize(MediaStateWrapper *media_state, int width, int height);
+
+void gui_state_draw_waveform(Waveform *waveform, Rectangle area);
+void media_state_drop_pending(MediaStateWrapper *media_state);
+void gui_state_play_tick(GuiState *state, MediaStateWrapper *media_state);
+int gui_state_loop_wrap(GuiState *state, MediaStateWrapper *media_state);
+void gui_state_toggle_loop(GuiState *state);
+void gui_wait_until(double deadline);
+Texture2D media_state_texture(MediaStateWrapper *media_state);
+void media_state_load_textures(MediaStateWrapper *media_state, int width,
+                               int height);
+void media_state_unload_textures(MediaStateWrapper *media_state);
+void media_state_update_quality(MediaStateWrapper *media_state);
+void media_state_set_audio_only(MediaStateWrapper *media_state, int enabled);
+void gui_state_update_audio_only(GuiState *state);
+
 void gui_state_media_down(GuiState *state);
 void gui_state_media_up(GuiState *state);
 
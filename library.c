@@ -0,0 +1,516 @@
+#include "library.h"
+
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavutil/time.h>
+
+#include "disk_cache.h"
+#include "raylib.h"
+
+#define LIBRARY_CACHE_MAGIC "AVPLIB01"
+
+typedef struct {
+    char magic[8];
+    int64_t file_size, file_mtime;
+    int64_t duration, bit_rate;
+    int32_t header_complete, has_poster;
+    int32_t nb_keyframes, path_len;
+} LibraryCacheHeader;
+
+// What the player needs to know about a stream before opening its decoder.
+typedef struct {
+    enum AVMediaType type;
+    enum AVCodecID codec_id;
+    int format, width, height, sample_rate, channels;
+} LibraryStreamInfo;
+
+Library *library_alloc() {
+    Library *library = malloc(sizeof(Library));
+    if (!library) {
+        return NULL;
+    }
+
+    library->entries = NULL;
+    library->count = 0;
+    library->capacity = 0;
+
+    pool_owner_init(&library->owner);
+    pool_group_init(&library->group);
+    atomic_init(&library->cancel, 0);
+
+    return library;
+}
+
+void library_entry_free(LibraryEntry *entry) {
+    free(entry->path);
+    free(entry->cache_path);
+    free(entry->poster_path);
+    free(entry->keyframes);
+    free(entry);
+}
+
+int library_load(LibraryEntry *entry) {
+    if (!entry->cache_path) {
+        return -1;
+    }
+
+    FILE *file = fopen(entry->cache_path, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    LibraryCacheHeader header;
+    char path[1024];
+    int ok = fread(&header, sizeof(header), 1, file) == 1 &&
+             memcmp(header.magic, LIBRARY_CACHE_MAGIC, 8) == 0 &&
+             header.file_size == entry->file_size &&
+             header.file_mtime == entry->file_mtime &&
+             header.path_len == (int32_t)strlen(entry->path) &&
+             header.path_len < (int32_t)sizeof(path) &&
+             header.nb_keyframes >= 0 &&
+             fread(path, 1, header.path_len, file) == (size_t)header.path_len &&
+             memcmp(path, entry->path, header.path_len) == 0;
+
+    if (ok && header.nb_keyframes > 0) {
+        entry->keyframes = malloc(header.nb_keyframes * sizeof(MediaKeyframe));
+        ok = entry->keyframes &&
+             fread(entry->keyframes, sizeof(MediaKeyframe), header.nb_keyframes,
+                   file) == (size_t)header.nb_keyframes;
+    }
+    fclose(file);
+
+    if (!ok) {
+        free(entry->keyframes);
+        entry->keyframes = NULL;
+        return -1;
+    }
+
+    entry->duration = header.duration;
+    entry->bit_rate = header.bit_rate;
+    entry->header_complete = header.header_complete;
+    entry->nb_keyframes = header.nb_keyframes;
+
+    // The poster lives in its own file, which may have been cleaned up.
+    entry->has_poster = header.has_poster && entry->poster_path &&
+                        access(entry->poster_path, R_OK) == 0;
+
+    return 0;
+}
+
+void library_save(LibraryEntry *entry) {
+    if (!entry->cache_path) {
+        return;
+    }
+
+    LibraryCacheHeader header = {.file_size = entry->file_size,
+                                 .file_mtime = entry->file_mtime,
+                                 .duration = entry->duration,
+                                 .bit_rate = entry->bit_rate,
+                                 .header_complete = entry->header_complete,
+                                 .has_poster = entry->has_poster,
+                                 .nb_keyframes = entry->nb_keyframes,
+                                 .path_len = strlen(entry->path)};
+    memcpy(header.magic, LIBRARY_CACHE_MAGIC, 8);
+
+    // Written aside and renamed, so a reader never sees half an entry.
+    char tmp_path[1100];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", entry->cache_path);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        printf("library_save: cannot open %s\n", tmp_path);
+        return;
+    }
+
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(entry->path, 1, header.path_len, file) ==
+                 (size_t)header.path_len &&
+             fwrite(entry->keyframes, sizeof(MediaKeyframe), entry->nb_keyframes,
+                    file) == (size_t)entry->nb_keyframes;
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tmp_path, entry->cache_path) < 0) {
+        printf("library_save: failed to write %s\n", entry->cache_path);
+        remove(tmp_path);
+    }
+}
+
+void library_stream_info(AVFormatContext *fmt_ctx, LibraryStreamInfo *info) {
+    for (int i = 0; i < (int)fmt_ctx->nb_streams; i++) {
+        AVCodecParameters *par = fmt_ctx->streams[i]->codecpar;
+        info[i] = (LibraryStreamInfo){.type = par->codec_type,
+                                      .codec_id = par->codec_id,
+                                      .format = par->format,
+                                      .width = par->width,
+                                      .height = par->height,
+                                      .sample_rate = par->sample_rate,
+                                      .channels = par->ch_layout.nb_channels};
+    }
+}
+
+// Opens `path` without probing, then probes it and compares. Returns 1 when
+// the header already described every audio and video stream as probing did,
+// 0 when it did not, and a negative value if the file cannot be opened.
+int library_check_header(const char *path) {
+    AVFormatContext *fmt_ctx = NULL;
+    if (avformat_open_input(&fmt_ctx, path, NULL, NULL) < 0) {
+        return MEDIA_ERR_LIBAV;
+    }
+
+    int nb_streams = fmt_ctx->nb_streams;
+    LibraryStreamInfo *header = calloc(nb_streams + 1, sizeof(LibraryStreamInfo));
+    if (!header) {
+        avformat_close_input(&fmt_ctx);
+        return MEDIA_ERR_INTERNAL;
+    }
+    library_stream_info(fmt_ctx, header);
+
+    if (avformat_find_stream_info(fmt_ctx, NULL) < 0) {
+        free(header);
+        avformat_close_input(&fmt_ctx);
+        return MEDIA_ERR_LIBAV;
+    }
+
+    int complete = nb_streams > 0 && (int)fmt_ctx->nb_streams == nb_streams;
+    if (complete) {
+        LibraryStreamInfo *probed =
+            calloc(nb_streams, sizeof(LibraryStreamInfo));
+        if (!probed) {
+            complete = 0;
+        } else {
+            library_stream_info(fmt_ctx, probed);
+            for (int i = 0; i < nb_streams && complete; i++) {
+                if (header[i].type != AVMEDIA_TYPE_VIDEO &&
+                    header[i].type != AVMEDIA_TYPE_AUDIO) {
+                    continue;
+                }
+
+                complete = header[i].format >= 0 &&
+                           memcmp(&header[i], &probed[i],
+                                  sizeof(LibraryStreamInfo)) == 0;
+            }
+            free(probed);
+        }
+    }
+
+    free(header);
+    avformat_close_input(&fmt_ctx);
+
+    return complete;
+}
+
+// Reads every packet of the video stream, recording where the keyframes are.
+int library_scan_keyframes(LibraryEntry *entry, Media *media) {
+    AVFormatContext *fmt_ctx = media->fmt_ctx;
+    for (int i = 0; i < (int)fmt_ctx->nb_streams; i++) {
+        if (i != media->video_stream_idx) {
+            fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+        }
+    }
+
+    int capacity = 0;
+    int ret;
+    while ((ret = media_read_frame(media)) == 0) {
+        if (atomic_load(&entry->library->cancel)) {
+            return MEDIA_ERR_INTERNAL;
+        }
+
+        AVPacket *pkt = media->pkt;
+        if (pkt->stream_index != media->video_stream_idx ||
+            !(pkt->flags & AV_PKT_FLAG_KEY)) {
+            continue;
+        }
+
+        if (entry->nb_keyframes == capacity) {
+            capacity = capacity ? capacity * 2 : 256;
+            MediaKeyframe *keyframes =
+                realloc(entry->keyframes, capacity * sizeof(MediaKeyframe));
+            if (!keyframes) {
+                printf("library_scan_keyframes: failed to grow the index\n");
+                return MEDIA_ERR_INTERNAL;
+            }
+            entry->keyframes = keyframes;
+        }
+
+        entry->keyframes[entry->nb_keyframes++] = (MediaKeyframe){
+            .pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts,
+            .pos = pkt->pos};
+    }
+
+    return ret == MEDIA_ERR_EOF ? 0 : ret;
+}
+
+// Writes the frame at LIBRARY_POSTER_POSITION to the poster file.
+int library_make_poster(LibraryEntry *entry, Media *media) {
+    if (!entry->poster_path) {
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    AVCodecParameters *par =
+        media->fmt_ctx->streams[media->video_stream_idx]->codecpar;
+    AVRational sar = par->sample_aspect_ratio;
+    double aspect = (double)par->width / par->height;
+    if (sar.num > 0 && sar.den > 0) {
+        aspect *= av_q2d(sar);
+    }
+
+    int height = (int)(LIBRARY_POSTER_WIDTH / aspect) & ~1;
+    if (height < 2) {
+        height = 2;
+    }
+
+    int ret = media_set_output_size(media, LIBRARY_POSTER_WIDTH, height);
+    if (ret < 0) {
+        return ret;
+    }
+
+    int64_t timestamp =
+        entry->duration > 0
+            ? (int64_t)(entry->duration * LIBRARY_POSTER_POSITION)
+            : 0;
+
+    AVFrame *frame = NULL;
+    if ((ret = media_seek_frame(media, timestamp, 0, &frame)) < 0 || !frame) {
+        return ret < 0 ? ret : MEDIA_ERR_INTERNAL;
+    }
+
+    // Frames are converted tightly packed, as raylib expects its images.
+    Image image = {.data = frame->data[0],
+                   .width = frame->width,
+                   .height = frame->height,
+                   .mipmaps = 1,
+                   .format = PIXELFORMAT_UNCOMPRESSED_R8G8B8A8};
+    int saved = ExportImage(image, entry->poster_path);
+    av_frame_free(&frame);
+
+    return saved ? 0 : MEDIA_ERR_INTERNAL;
+}
+
+int library_index(LibraryEntry *entry) {
+    int ret = library_check_header(entry->path);
+    if (ret < 0) {
+        return ret;
+    }
+    entry->header_complete = ret;
+
+    Media *media = media_alloc();
+    if (!media) {
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    ret = media_init(media, LIBRARY_POSTER_WIDTH, LIBRARY_POSTER_WIDTH,
+                     AV_PIX_FMT_RGBA, entry->path);
+    if (ret == 0 && !media->video_ctx && !media->audio_ctx) {
+        ret = MEDIA_ERR_NO_STREAM;
+    }
+
+    if (ret == 0) {
+        entry->duration = media->fmt_ctx->duration;
+        entry->bit_rate = media->fmt_ctx->bit_rate;
+
+        if (media->video_ctx) {
+            ret = library_scan_keyframes(entry, media);
+
+            // A media without a poster is still playable.
+            if (ret == 0) {
+                entry->has_poster = library_make_poster(entry, media) == 0;
+            }
+        }
+    }
+    media_free(media);
+
+    return ret;
+}
+
+void library_index_job(void *arg) {
+    LibraryEntry *entry = arg;
+
+    if (atomic_load(&entry->library->cancel)) {
+        atomic_store(&entry->state, LIBRARY_FAILED);
+        return;
+    }
+
+    int64_t start = av_gettime_relative();
+    int ret = library_index(entry);
+    entry->index_time = (av_gettime_relative() - start) / 1e6;
+
+    if (ret == 0) {
+        library_save(entry);
+    }
+
+    atomic_store_explicit(&entry->state,
+                          ret == 0 ? LIBRARY_READY : LIBRARY_FAILED,
+                          memory_order_release);
+}
+
+LibraryEntry *library_find(Library *library, const char *path) {
+    if (!library) {
+        return NULL;
+    }
+
+    // A file that changed on disk gets a new entry, so the newest one wins.
+    for (int i = library->count - 1; i >= 0; i--) {
+        if (strcmp(library->entries[i]->path, path) == 0) {
+            return library->entries[i];
+        }
+    }
+
+    return NULL;
+}
+
+LibraryEntry *library_add(Library *library, const char *path) {
+    if (!library) {
+        return NULL;
+    }
+
+    int64_t file_size, file_mtime;
+    if (disk_cache_identity(path, &file_size, &file_mtime) < 0) {
+        return NULL;
+    }
+
+    LibraryEntry *entry = library_find(library, path);
+    if (entry && entry->file_size == file_size &&
+        entry->file_mtime == file_mtime) {
+        return entry;
+    }
+
+    if (library->count == library->capacity) {
+        int capacity = library->capacity ? library->capacity * 2 : 64;
+        LibraryEntry **entries =
+            realloc(library->entries, capacity * sizeof(LibraryEntry *));
+        if (!entries) {
+            printf("library_add: failed to grow the library\n");
+            return NULL;
+        }
+
+        library->entries = entries;
+        library->capacity = capacity;
+    }
+
+    entry = malloc(sizeof(LibraryEntry));
+    if (!entry) {
+        return NULL;
+    }
+
+    entry->path = strdup(path);
+    entry->file_size = file_size;
+    entry->file_mtime = file_mtime;
+    entry->cache_path =
+        disk_cache_path("library", "bin", path, file_size, file_mtime);
+    entry->poster_path =
+        disk_cache_path("poster", "png", path, file_size, file_mtime);
+
+    atomic_init(&entry->state, LIBRARY_PENDING);
+    entry->duration = AV_NOPTS_VALUE;
+    entry->bit_rate = 0;
+    entry->header_complete = 0;
+    entry->has_poster = 0;
+    entry->keyframes = NULL;
+    entry->nb_keyframes = 0;
+    entry->cached = 0;
+    entry->index_time = 0;
+    entry->open_when_ready = 0;
+    entry->library = library;
+
+    if (!entry->path) {
+        library_entry_free(entry);
+        return NULL;
+    }
+
+    library->entries[library->count++] = entry;
+
+    if (library_load(entry) == 0) {
+        entry->cached = 1;
+        atomic_store(&entry->state, LIBRARY_READY);
+        return entry;
+    }
+
+    PoolTask task = {.run = library_index_job,
+                     .arg = entry,
+                     .priority = POOL_PRIORITY_BACKGROUND,
+                     .deadline = POOL_NO_DEADLINE,
+                     .owner = &library->owner,
+                     .group = &library->group};
+    if (pool_submit(pool_global(), task) < 0) {
+        printf("library_add: pool_submit failed\n");
+        atomic_store(&entry->state, LIBRARY_FAILED);
+    }
+
+    return entry;
+}
+
+int library_add_path(Library *library, const char *path) {
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        printf("library_add_path: cannot stat %s\n", path);
+        return 0;
+    }
+
+    if (S_ISDIR(st.st_mode)) {
+        DIR *dir = opendir(path);
+        if (!dir) {
+            printf("library_add_path: cannot open %s\n", path);
+            return 0;
+        }
+
+        int count = 0;
+        struct dirent *dirent;
+        while ((dirent = readdir(dir))) {
+            if (dirent->d_name[0] == '.') {
+                continue;
+            }
+
+            char child[4096];
+            snprintf(child, sizeof(child), "%s/%s", path, dirent->d_name);
+
+            // Symlinked directories are not followed, so a link back up the
+            // tree cannot recurse forever.
+            struct stat link;
+            if (lstat(child, &link) == 0 && S_ISLNK(link.st_mode) &&
+                stat(child, &link) == 0 && S_ISDIR(link.st_mode)) {
+                continue;
+            }
+            count += library_add_path(library, child);
+        }
+        closedir(dir);
+
+        return count;
+    }
+
+    if (!S_ISREG(st.st_mode)) {
+        return 0;
+    }
+
+    LibraryEntry *entry = library_add(library, path);
+    if (!entry) {
+        return 0;
+    }
+    entry->open_when_ready = 1;
+
+    return 1;
+}
+
+enum LibraryState library_entry_state(LibraryEntry *entry) {
+    return atomic_load_explicit(&entry->state, memory_order_acquire);
+}
+
+void library_free(Library *library) {
+    if (!library) {
+        return;
+    }
+
+    atomic_store(&library->cancel, 1);
+    pool_group_wait(pool_global(), &library->group);
+    pool_group_destroy(&library->group);
+
+    for (int i = 0; i < library->count; i++) {
+        library_entry_free(library->entries[i]);
+    }
+    free(library->entries);
+    free(library);
+}
@@ -0,0 +1,84 @@
+// Index of the medias the player has seen. Every file dropped on the window,
+// or found under a dropped directory, is indexed by a background task on the
+// thread pool: duration, bit rate, video keyframes, a poster frame, and
+// whether the container header alone describes its streams. Results are saved
+// to the disk cache, keyed by path, size and modification time, so a file
+// that was indexed once opens without probing and shows its poster at once.
+#ifndef LIBRARY_H
+#define LIBRARY_H
+
+#include <stdatomic.h>
+
+#include "media.h"
+#include "pool.h"
+
+// Width of the posters; the height follows the aspect ratio.
+#define LIBRARY_POSTER_WIDTH 128
+// Where in the media the poster frame is taken, as a fraction of its length.
+#define LIBRARY_POSTER_POSITION 0.1
+
+enum LibraryState {
+    LIBRARY_PENDING,
+    LIBRARY_READY,
+    // Not a media, or it could not be read.
+    LIBRARY_FAILED,
+};
+
+typedef struct LibraryEntry {
+    char *path;
+    int64_t file_size, file_mtime;
+    char *cache_path, *poster_path;
+
+    // Written by the indexing task; the fields below may only be read once
+    // this is LIBRARY_READY.
+    atomic_int state;
+
+    // Duration (AV_TIME_BASE units) and bit rate of the container.
+    int64_t duration, bit_rate;
+    // Set when probing the streams finds nothing the header did not say.
+    int header_complete;
+    int has_poster;
+    MediaKeyframe *keyframes;
+    int nb_keyframes;
+
+    // Set when the entry was read back from the disk cache. Otherwise,
+    // `index_time` is how long indexing took (seconds).
+    int cached;
+    double index_time;
+
+    // Set for files found under a dropped directory, which join the media
+    // list once they are known to be playable.
+    int open_when_ready;
+
+    struct Library *library;
+} LibraryEntry;
+
+typedef struct Library {
+    LibraryEntry **entries;
+    int count, capacity;
+
+    PoolOwner owner;
+    PoolGroup group;
+    atomic_int cancel;
+} Library;
+
+Library *library_alloc();
+
+// Returns the entry of `path`, indexing it in the background if it is not in
+// the disk cache. Returns NULL if the file cannot be found.
+LibraryEntry *library_add(Library *library, const char *path);
+
+// Adds `path`, or every file under it if it is a directory (hidden files are
+// skipped), marking the entries to be opened once indexed. Returns how many
+// files were added.
+int library_add_path(Library *library, const char *path);
+
+// Returns the entry of `path`, or NULL if it was never added.
+LibraryEntry *library_find(Library *library, const char *path);
+
+enum LibraryState library_entry_state(LibraryEntry *entry);
+
+// Cancels the indexing still queued and waits for the running tasks.
+void library_free(Library *library);
+
+#endif  // LIBRARY_H
@@ -0,0 +1,129 @@
+#include "loop_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "media.h"
+
+LoopCache *loop_cache_alloc(size_t max_bytes) {
+    LoopCache *cache = malloc(sizeof(LoopCache));
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->entries = NULL;
+    cache->count = 0;
+    cache->capacity = 0;
+    cache->bytes = 0;
+    cache->max_bytes = max_bytes;
+
+    cache->recording = 0;
+    cache->ready = 0;
+    cache->overflowed = 0;
+    cache->replaying = 0;
+    cache->replay_pos = 0;
+
+    return cache;
+}
+
+size_t loop_cache_frame_size(AVFrame *frame) {
+    size_t size = 0;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++) {
+        size += frame->buf[i]->size;
+    }
+
+    return size;
+}
+
+void loop_cache_drop_frames(LoopCache *cache) {
+    for (int i = 0; i < cache->count; i++) {
+        av_frame_free(&cache->entries[i].frame);
+    }
+
+    cache->count = 0;
+    cache->bytes = 0;
+}
+
+int loop_cache_add(LoopCache *cache, AVFrame *frame, enum FrameType type) {
+    if (!cache->recording) {
+        return 0;
+    }
+
+    size_t size = loop_cache_frame_size(frame);
+    if (cache->bytes + size > cache->max_bytes) {
+        loop_cache_drop_frames(cache);
+        cache->recording = 0;
+        cache->overflowed = 1;
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    if (cache->count == cache->capacity) {
+        int capacity = cache->capacity ? cache->capacity * 2 : 256;
+        LoopEntry *entries = realloc(cache->entries, capacity * sizeof(LoopEntry));
+        if (!entries) {
+            printf("loop_cache_add: failed to grow the cache\n");
+            return MEDIA_ERR_INTERNAL;
+        }
+
+        cache->entries = entries;
+        cache->capacity = capacity;
+    }
+
+    AVFrame *ref = av_frame_clone(frame);
+    if (!ref) {
+        printf("loop_cache_add: av_frame_clone failed\n");
+        return MEDIA_ERR_LIBAV;
+    }
+
+    cache->entries[cache->count++] = (LoopEntry){.frame = ref, .type = type};
+    cache->bytes += size;
+
+    return 0;
+}
+
+int loop_cache_next(LoopCache *cache, FrameQueue *queue) {
+    if (!cache->replaying || cache->replay_pos >= cache->count) {
+        return MEDIA_ERR_EOF;
+    }
+
+    LoopEntry *entry = &cache->entries[cache->replay_pos++];
+    AVFrame *ref = av_frame_clone(entry->frame);
+    if (!ref) {
+        printf("loop_cache_next: av_frame_clone failed\n");
+        return MEDIA_ERR_LIBAV;
+    }
+
+    fq_enqueue(queue, ref, entry->type);
+
+    return 0;
+}
+
+void loop_cache_stop(LoopCache *cache) {
+    if (!cache->ready) {
+        loop_cache_drop_frames(cache);
+    }
+
+    cache->recording = 0;
+    cache->replaying = 0;
+    cache->replay_pos = 0;
+}
+
+void loop_cache_clear(LoopCache *cache) {
+    loop_cache_drop_frames(cache);
+
+    cache->recording = 0;
+    cache->ready = 0;
+    cache->overflowed = 0;
+    cache->replaying = 0;
+    cache->replay_pos = 0;
+}
+
+void loop_cache_free(LoopCache *cache) {
+    if (!cache) {
+        return;
+    }
+
+    loop_cache_drop_frames(cache);
+    free(cache->entries);
+    free(cache);
+}
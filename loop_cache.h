@@ -0,0 +1,52 @@
+// Decoded frames of an A/B loop. The first pass over the region records every
+// converted video frame and audio frame by reference, in the order they were
+// decoded; the following passes replay them instead of seeking and decoding
+// the region again. Regions that do not fit within the byte limit are never
+// replayed, and the player seeks back to the start of the loop instead.
+#ifndef LOOP_CACHE_H
+#define LOOP_CACHE_H
+
+#include <libavcodec/avcodec.h>
+
+#include "common.h"
+#include "queue.h"
+
+#define LOOP_CACHE_MAX_BYTES (256 * 1024 * 1024)
+
+typedef struct {
+    AVFrame *frame;
+    enum FrameType type;
+} LoopEntry;
+
+typedef struct LoopCache {
+    LoopEntry *entries;
+    int count, capacity;
+    size_t bytes, max_bytes;
+
+    // `recording` is set during the first pass, `ready` once it completed and
+    // `overflowed` if it could not fit.
+    int recording, ready, overflowed;
+
+    // Replay position, while `replaying`.
+    int replaying, replay_pos;
+} LoopCache;
+
+LoopCache *loop_cache_alloc(size_t max_bytes);
+
+// Keeps a reference to `frame`. Past the byte limit, everything recorded so
+// far is dropped and the cache is marked as overflowed.
+int loop_cache_add(LoopCache *cache, AVFrame *frame, enum FrameType type);
+
+// Queues a reference to the next recorded frame. Returns MEDIA_ERR_EOF at the
+// end of the region.
+int loop_cache_next(LoopCache *cache, FrameQueue *queue);
+
+// Stops recording and replaying. A complete recording is kept.
+void loop_cache_stop(LoopCache *cache);
+
+// Drops everything, e.g. when the region changes.
+void loop_cache_clear(LoopCache *cache);
+
+void loop_cache_free(LoopCache *cache);
+
+#endif  // LOOP_CACHE_H
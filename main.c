@@ -1,5 +1,7 @@
 #include <stdio.h>
+#include <string.h>
 
+#include "batch.h"
 #include "media.h"
 #include "raylib.h"
 #include "gui.h"
@@ -72,7 +74,11 @@
 //     return 0;
 // }
 
-int main(void) {
+int main(int argc, char **argv) {
+    if (argc > 1 && strcmp(argv[1], "batch") == 0) {
+        return batch_main(argc - 1, argv + 1);
+    }
+
     GuiState *state = gui_state_alloc();
     if (!state) {
         printf("Failed to allocate gui state\n");
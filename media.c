@@ -1,5 +1,10 @@
 #include "media.h"
 
+#include <string.h>
+
+#include <libavutil/pixdesc.h>
+#include <libavutil/time.h>
+
 Media *media_alloc() {
     Media *media = malloc(sizeof(Media));
     if (!media) {
@@ -20,40 +25,150 @@ Media *media_alloc() {
     }
 
     media->fmt_ctx = NULL;
+    media->io_mode = MEDIA_IO_DEFAULT;
+    media->io_buffer_size = 0;
+    media->io = NULL;
     media->audio_ctx = NULL;
     media->video_ctx = NULL;
-    media->sws_ctx = NULL;
+    for (int i = 0; i < MEDIA_SCALERS; i++) {
+        media->scalers[i] = (MediaScaler){.ctx = NULL, .last_used = 0};
+    }
+    media->scaler_clock = 0;
+    media->scaler_builds = 0;
+    media->slice_threads = 0;
+
+    media->crop_x = 0;
+    media->crop_y = 0;
+    media->crop_w = 1;
+    media->crop_h = 1;
+    media->keep_sources = 0;
+    for (int i = 0; i < MEDIA_SOURCE_FRAMES; i++) {
+        media->sources[i] = NULL;
+    }
+    media->source_next = 0;
     media->swr_ctx = NULL;
+    media->swr_in_rate = 0;
+    media->swr_in_fmt = AV_SAMPLE_FMT_NONE;
+    media->swr_in_layout = (AVChannelLayout){0};
+
+    media->video_filters = NULL;
+    media->audio_filters = NULL;
+    media->deinterlace = 0;
+    media->video_filter = NULL;
+    media->audio_filter = NULL;
 
     media->video_stream_idx = -1;
     media->audio_stream_idx = -1;
+    media->nb_audio_tracks = 0;
+    media->audio_track = -1;
+    media->out_sample_rate = 0;
+    media->out_sample_rate_guessed = 0;
 
     media->dst_frame_w = 0;
     media->dst_frame_h = 0;
+    media->output_w = 0;
+    media->output_h = 0;
     media->dst_frame_fmt = AV_PIX_FMT_NONE;
 
     media->pkt = NULL;
     media->queue = NULL;
 
+    media->packet_cache_seconds = 0;
+    media->packet_cache = NULL;
+
+    media->skip_stream_info = 0;
+    media->fast_open = 0;
+    media->probe_size = 0;
+    media->analyze_duration = 0;
+    media->open_time = 0;
+    media->probe_time = 0;
+    media->probed = 0;
+
+    media->follow = 0;
+    media->follow_latency = MEDIA_FOLLOW_LATENCY;
+    media->follow_watch = NULL;
+    media->follow_size = 0;
+    media->follow_grown = 0;
+    media->follow_closed = 0;
+
     media->position = 0;
+    media->current_ts = 0;
+    media->skip_until = AV_NOPTS_VALUE;
+    media->audio_skip_until = AV_NOPTS_VALUE;
+    media->video_resume_dts = AV_NOPTS_VALUE;
+    media->last_video_dts = AV_NOPTS_VALUE;
+    media->video_skip_until = AV_NOPTS_VALUE;
+    media->last_video_end = AV_NOPTS_VALUE;
+    media->audio_resume_dts = AV_NOPTS_VALUE;
+    media->last_audio_dts = AV_NOPTS_VALUE;
+
+    pool_owner_init(&media->pool_owner);
+
+    media->quality = MEDIA_QUALITY_FULL;
+    media->decode_time = 0;
+    media->quality_over = 0;
+    media->quality_under = 0;
+    media->quality_up_frames = MEDIA_QUALITY_UP_FRAMES;
+    media->quality_frames = 0;
+    media->quality_raised = 0;
+    media->skip_frame = AVDISCARD_DEFAULT;
+
+    media->skip_duplicates = 0;
+    media->last_hash = 0;
+    media->duplicates = 0;
+    media->sws_flags = SWS_BILINEAR;
+    media->wait_keyframe = 0;
 
     return media;
 }
 
+// Opens a decoder for the given stream of the container.
+int media_open_stream(Media *media, int stream_index, AVCodecContext **ctx) {
+    AVCodecParameters *codec_params =
+        media->fmt_ctx->streams[stream_index]->codecpar;
+
+    const AVCodec *codec = avcodec_find_decoder(codec_params->codec_id);
+    if (!codec) {
+        printf("media_open_stream: avcodec_find_decoder failed\n");
+        return MEDIA_ERR_LIBAV;
+    }
+
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    if (!codec_ctx) {
+        return MEDIA_ERR_LIBAV;
+    }
+
+    if (avcodec_parameters_to_context(codec_ctx, codec_params) < 0 ||
+        avcodec_open2(codec_ctx, codec, NULL) < 0) {
+        avcodec_free_context(&codec_ctx);
+        return MEDIA_ERR_LIBAV;
+    }
+
+    *ctx = codec_ctx;
+    return 0;
+}
+
 int media_open_context(Media *media, enum AVMediaType type) {
     if (!media || !media->filename) {
         printf("media_open_context: media or filename is NULL\n");
         return MEDIA_ERR_INTERNAL;
     }
 
-    const AVCodec *codec = NULL;
-    AVCodecParameters *codec_params = NULL;
     int stream_index = -1;
-
     for (int i = 0; i < (int)media->fmt_ctx->nb_streams; i++) {
-        if (media->fmt_ctx->streams[i]->codecpar->codec_type == type) {
-            codec_params = media->fmt_ctx->streams[i]->codecpar;
+        if (media->fmt_ctx->streams[i]->codecpar->codec_type != type) {
+            continue;
+        }
+
+        if (stream_index == -1) {
             stream_index = i;
+        }
+
+        // Every audio stream is a track that can be selected later.
+        if (type == AVMEDIA_TYPE_AUDIO &&
+            media->nb_audio_tracks < MEDIA_MAX_AUDIO_TRACKS) {
+            media->audio_tracks[media->nb_audio_tracks++] = i;
+        } else if (type != AVMEDIA_TYPE_AUDIO) {
             break;
         }
     }
@@ -63,35 +178,164 @@ int media_open_context(Media *media, enum AVMediaType type) {
         return MEDIA_ERR_NO_STREAM;
     }
 
-    codec = avcodec_find_decoder(codec_params->codec_id);
-    if (!codec) {
-        printf("media_open_context: avcodec_find_decoder failed\n");
-        return MEDIA_ERR_LIBAV;
+    if (type == AVMEDIA_TYPE_AUDIO) {
+        media->audio_stream_idx = stream_index;
+        media->audio_track = 0;
+
+        // Only the selected track is demuxed.
+        for (int i = 1; i < media->nb_audio_tracks; i++) {
+            media->fmt_ctx->streams[media->audio_tracks[i]]->discard =
+                AVDISCARD_ALL;
+        }
+
+        // Whoever plays the audio needs its rate before the first packet.
+        media->out_sample_rate =
+            media->fmt_ctx->streams[stream_index]->codecpar->sample_rate;
+        if (!media->fast_open || media->out_sample_rate <= 0) {
+            media->out_sample_rate = 0;
+            return media_open_audio(media);
+        }
+        media->out_sample_rate_guessed = 1;
+        return 0;
     }
 
-    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
-    if (!codec_ctx) {
-        return MEDIA_ERR_LIBAV;
+    AVCodecContext *codec_ctx = NULL;
+    int ret = media_open_stream(media, stream_index, &codec_ctx);
+    if (ret < 0) {
+        return ret;
+    }
+
+    if (type == AVMEDIA_TYPE_VIDEO) {
+        media->video_ctx = codec_ctx;
+        media->video_stream_idx = stream_index;
+    }
+
+    return 0;
+}
+
+int media_open_audio(Media *media) {
+    if (media->audio_ctx) {
+        return 0;
     }
 
-    int ret = avcodec_parameters_to_context(codec_ctx, codec_params);
+    int ret = media_open_stream(media, media->audio_stream_idx,
+                                &media->audio_ctx);
     if (ret < 0) {
-        return MEDIA_ERR_LIBAV;
+        return ret;
     }
 
-    ret = avcodec_open2(codec_ctx, codec, NULL);
+    ret = media_open_resampler(media, NULL);
     if (ret < 0) {
+        return ret;
+    }
+
+    if (media->audio_filters && !media->audio_filter) {
+        media->audio_filter =
+            filter_chain_alloc(AVMEDIA_TYPE_AUDIO, media->audio_filters);
+    }
+
+    return 0;
+}
+
+// Tells whether the header of the container gave everything needed to decode
+// its audio and video streams, so probing them can be skipped.
+int media_header_complete(AVFormatContext *fmt_ctx) {
+    int nb_streams = 0;
+    for (int i = 0; i < (int)fmt_ctx->nb_streams; i++) {
+        AVCodecParameters *params = fmt_ctx->streams[i]->codecpar;
+        if (params->codec_type == AVMEDIA_TYPE_VIDEO) {
+            if (params->codec_id == AV_CODEC_ID_NONE || params->width <= 0 ||
+                params->height <= 0) {
+                return 0;
+            }
+        } else if (params->codec_type == AVMEDIA_TYPE_AUDIO) {
+            if (params->codec_id == AV_CODEC_ID_NONE ||
+                params->sample_rate <= 0 || params->ch_layout.nb_channels <= 0) {
+                return 0;
+            }
+        } else {
+            continue;
+        }
+        nb_streams++;
+    }
+
+    return nb_streams > 0;
+}
+
+// Without probing, the duration of the container is only known from the
+// durations of its streams.
+void media_guess_duration(Media *media) {
+    if (media->fmt_ctx->duration > 0) {
+        return;
+    }
+
+    for (int i = 0; i < (int)media->fmt_ctx->nb_streams; i++) {
+        AVStream *stream = media->fmt_ctx->streams[i];
+        if (stream->duration == AV_NOPTS_VALUE || stream->duration <= 0) {
+            continue;
+        }
+
+        int64_t duration =
+            av_rescale_q(stream->duration, stream->time_base, AV_TIME_BASE_Q);
+        if (duration > media->fmt_ctx->duration) {
+            media->fmt_ctx->duration = duration;
+        }
+    }
+}
+
+// (Re)creates the resampler for the frames of the current audio decoder, or
+// for `frame` when it is not NULL. The output rate is the one of the first
+// track, so switching tracks never changes it.
+int media_open_resampler(Media *media, const AVFrame *frame) {
+    if (media->out_sample_rate == 0) {
+        media->out_sample_rate = media->audio_ctx->sample_rate;
+    }
+
+    int in_sample_rate = frame ? frame->sample_rate
+                               : media->audio_ctx->sample_rate;
+    int in_sample_fmt = frame ? frame->format : media->audio_ctx->sample_fmt;
+    const AVChannelLayout *in_layout =
+        frame ? &frame->ch_layout : &media->audio_ctx->ch_layout;
+
+    SwrContext *swr = swr_alloc();
+    if (!swr) {
+        printf("media_open_resampler: swr_alloc failed\n");
         return MEDIA_ERR_LIBAV;
     }
 
-    if (type == AVMEDIA_TYPE_AUDIO) {
-        media->audio_ctx = codec_ctx;
-        media->audio_stream_idx = stream_index;
-    } else if (type == AVMEDIA_TYPE_VIDEO) {
-        media->video_ctx = codec_ctx;
-        media->video_stream_idx = stream_index;
+    AVChannelLayout in_ch_layout;
+    if (av_channel_layout_copy(&in_ch_layout, in_layout) < 0) {
+        printf("media_open_resampler: av_channel_layout_copy failed\n");
+        swr_free(&swr);
+        return MEDIA_ERR_LIBAV;
+    }
+
+    int ret = swr_alloc_set_opts2(
+        &swr,
+        &(AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO,  // out_ch_layout
+        AV_SAMPLE_FMT_FLT,                           // out_sample_fmt
+        media->out_sample_rate,                      // out_sample_rate
+        &in_ch_layout,                               // in_ch_layout
+        in_sample_fmt,                               // in_sample_fmt
+        in_sample_rate,                              // in_sample_rate
+        0,                                           // log_offset
+        NULL);                                       // log_ctx
+
+    if (ret < 0 || swr_init(swr) < 0) {
+        printf("media_open_resampler: failed to set up the resampler\n");
+        av_channel_layout_uninit(&in_ch_layout);
+        swr_free(&swr);
+        return MEDIA_ERR_LIBAV;
     }
 
+    swr_free(&media->swr_ctx);
+    media->swr_ctx = swr;
+
+    media->swr_in_rate = in_sample_rate;
+    media->swr_in_fmt = in_sample_fmt;
+    av_channel_layout_uninit(&media->swr_in_layout);
+    media->swr_in_layout = in_ch_layout;
+
     return 0;
 }
 
@@ -104,17 +348,74 @@ int media_init(Media *media, int dst_frame_w, int dst_frame_h,
 
     strcpy(media->filename, filename);
 
+    // The other I/O layers take the size of the file once, when opening it.
+    if (media->follow) {
+        media->io_mode = MEDIA_IO_DEFAULT;
+    }
+
+    if (media->io_mode != MEDIA_IO_DEFAULT) {
+        media->io = media_io_open(media->filename, media->io_mode,
+                                  media->io_buffer_size);
+        if (!media->io) {
+            printf("media_init: media_io_open failed\n");
+            return MEDIA_ERR_INTERNAL;
+        }
+
+        media->fmt_ctx = avformat_alloc_context();
+        if (!media->fmt_ctx) {
+            printf("media_init: avformat_alloc_context failed\n");
+            return MEDIA_ERR_LIBAV;
+        }
+
+        media->fmt_ctx->pb = media->io->avio;
+        media->fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+
+    int64_t start = av_gettime_relative();
     int ret = avformat_open_input(&media->fmt_ctx, media->filename, NULL, NULL);
     if (ret < 0) {
         printf("media_init: avformat_open_input failed: %s\n", av_err2str(ret));
         return MEDIA_ERR_LIBAV;
     }
+    media->open_time = (av_gettime_relative() - start) / 1e6;
 
-    ret = avformat_find_stream_info(media->fmt_ctx, NULL);
-    if (ret < 0) {
-        fprintf(stderr, "media_init: avformat_find_stream_info failed: %s\n",
-                av_err2str(ret));
-        return MEDIA_ERR_LIBAV;
+    if (media->follow) {
+        media->follow_watch = file_watch_open(media->filename);
+        media->follow_size = avio_size(media->fmt_ctx->pb);
+        media->follow_grown = av_gettime_relative() / 1e6;
+    }
+
+    // Probing reads and decodes the start of every stream. It can be skipped
+    // for files whose header is known to describe them completely.
+    int probe = !media->skip_stream_info &&
+                !(media->fast_open && media_header_complete(media->fmt_ctx));
+    if (probe) {
+        int64_t probe_size = media->probe_size;
+        int64_t analyze_duration = media->analyze_duration;
+        if (media->fast_open) {
+            probe_size = probe_size ? probe_size : MEDIA_FAST_PROBE_SIZE;
+            analyze_duration = analyze_duration ? analyze_duration
+                                                : MEDIA_FAST_ANALYZE_DURATION;
+        }
+        if (probe_size > 0) {
+            media->fmt_ctx->probesize = probe_size;
+        }
+        if (analyze_duration > 0) {
+            media->fmt_ctx->max_analyze_duration = analyze_duration;
+        }
+
+        start = av_gettime_relative();
+        ret = avformat_find_stream_info(media->fmt_ctx, NULL);
+        if (ret < 0) {
+            fprintf(stderr,
+                    "media_init: avformat_find_stream_info failed: %s\n",
+                    av_err2str(ret));
+            return MEDIA_ERR_LIBAV;
+        }
+        media->probe_time = (av_gettime_relative() - start) / 1e6;
+        media->probed = 1;
+    } else {
+        media_guess_duration(media);
     }
 
     media->queue = fq_alloc();
@@ -143,58 +444,10 @@ int media_init(Media *media, int dst_frame_w, int dst_frame_h,
         return ret;
     }
 
-    if (media->video_ctx) {
-        media->sws_ctx =
-            sws_getContext(media->video_ctx->width, media->video_ctx->height,
-                           media->video_ctx->pix_fmt, dst_frame_w, dst_frame_h,
-                           dst_frame_fmt, SWS_BILINEAR, NULL, NULL, NULL);
-
-        if (!media->sws_ctx) {
-            printf("media_init: sws_getContext failed\n");
-            return MEDIA_ERR_LIBAV;
-        }
-    }
-
-    if (media->audio_ctx) {
-        SwrContext *swr = swr_alloc();
-        if (!swr) {
-            printf("media_init: swr_alloc failed\n");
-            return MEDIA_ERR_LIBAV;
-        }
-
-        AVChannelLayout in_ch_layout;
-        if (av_channel_layout_copy(&in_ch_layout,
-                                   &media->audio_ctx->ch_layout) < 0) {
-            printf("media_init: av_channel_layout_copy failed\n");
-            return MEDIA_ERR_LIBAV;
-        }
-
-        ret = swr_alloc_set_opts2(
-            &swr,
-            &(AVChannelLayout)AV_CHANNEL_LAYOUT_STEREO,  // out_ch_layout
-            AV_SAMPLE_FMT_FLT,                           // out_sample_fmt
-            media->audio_ctx->sample_rate,               // out_sample_rate
-            &in_ch_layout,                               // in_ch_layout
-            media->audio_ctx->sample_fmt,                // in_sample_fmt
-            media->audio_ctx->sample_rate,               // in_sample_rate
-            0,                                           // log_offset
-            NULL);                                       // log_ctx
-
-        if (ret < 0) {
-            printf("media_init: swr_alloc_set_opts2 failed\n");
-            return MEDIA_ERR_LIBAV;
-        }
-
-        if (swr_init(swr) < 0) {
-            printf("media_init: swr_init failed\n");
-            return MEDIA_ERR_LIBAV;
-        }
-
-        media->swr_ctx = swr;
-    }
-
     media->dst_frame_w = dst_frame_w;
     media->dst_frame_h = dst_frame_h;
+    media->output_w = dst_frame_w;
+    media->output_h = dst_frame_h;
     media->dst_frame_fmt = dst_frame_fmt;
 
     media->pkt = av_packet_alloc();
@@ -203,6 +456,20 @@ int media_init(Media *media, int dst_frame_w, int dst_frame_h,
         return MEDIA_ERR_LIBAV;
     }
 
+    if (media->video_ctx && media->video_filters) {
+        media->video_filter =
+            filter_chain_alloc(AVMEDIA_TYPE_VIDEO, media->video_filters);
+    }
+
+    if (media->packet_cache_seconds > 0) {
+        media->packet_cache = packet_cache_alloc(media->packet_cache_seconds,
+                                                 PACKET_CACHE_MAX_BYTES);
+        if (!media->packet_cache) {
+            printf("media_init: packet_cache_alloc failed\n");
+            return MEDIA_ERR_INTERNAL;
+        }
+    }
+
     // Set the duration of the stream here.
     media_get_formatted_time(media, media->fmt_ctx->duration, AV_TIME_BASE,
                              media->formatted_duration);
@@ -210,189 +477,1451 @@ int media_init(Media *media, int dst_frame_w, int dst_frame_h,
     return 0;
 }
 
-int media_read_frame(Media *media) {
-    if (!media) {
-        printf("media_read_frame: media is NULL\n");
-        return MEDIA_ERR_INTERNAL;
-    }
+// Whether the writer of a followed file seems done with it: it closed the file,
+// or did not make it grow for MEDIA_FOLLOW_IDLE_TIME.
+int media_follow_done(Media *media) {
+    double now = av_gettime_relative() / 1e6;
+    return media->follow_closed ||
+           now - media->follow_grown > MEDIA_FOLLOW_IDLE_TIME;
+}
 
-    int ret = av_read_frame(media->fmt_ctx, media->pkt);
-    if (ret < 0) {
-        if (ret == AVERROR_EOF) {
-            printf("media_read_frame: end of file\n");
-            return MEDIA_ERR_EOF;
-        }
-        printf("media_read_frame: av_read_frame failed: %s\n", av_err2str(ret));
-        return MEDIA_ERR_LIBAV;
+// In follow mode, tells whether the demuxer may read on. It stays
+// `follow_latency` of media behind the end of the file, estimated from the
+// bytes read per second of media so far, unless the writer seems done with it.
+int media_follow_ready(Media *media) {
+    AVIOContext *pb = media->fmt_ctx->pb;
+    int64_t pos = avio_tell(pb);
+
+    int64_t start_time = media->fmt_ctx->start_time != AV_NOPTS_VALUE
+                             ? media->fmt_ctx->start_time
+                             : 0;
+    int64_t read_time = media->current_ts - start_time;
+    int64_t margin = MEDIA_FOLLOW_MIN_MARGIN;
+    if (read_time > 0) {
+        margin = FFMAX(margin,
+                       av_rescale(pos, media->follow_latency, read_time));
     }
-
-    // Update the position at container scale
-    media->position = media->pkt->pts;
-
-    int64_t timebase;
-    if (media->pkt->stream_index == media->video_stream_idx) {
-        timebase =
-            media->fmt_ctx->streams[media->video_stream_idx]->time_base.den;
-    } else {
-        timebase =
-            media->fmt_ctx->streams[media->audio_stream_idx]->time_base.den;
+    if (media->follow_size - pos > margin) {
+        return 1;
     }
 
-    if (media_get_formatted_time(media, media->position, timebase,
-                                 media->formatted_position) < 0) {
-        printf("media_read_frame: media_get_formatted_time failed\n");
-        return MEDIA_ERR_INTERNAL;
+    double now = av_gettime_relative() / 1e6;
+    int events = file_watch_poll(media->follow_watch);
+    if (events) {
+        int64_t size = avio_size(pb);
+        if (size > media->follow_size) {
+            media->follow_size = size;
+            media->follow_grown = now;
+            media->follow_closed = 0;
+        }
+        if (events & FILE_WATCH_CLOSED) {
+            media->follow_closed = 1;
+        }
     }
 
-    return 0;
+    if (media_follow_done(media)) {
+        return 1;
+    }
+    return media->follow_size - pos > margin;
 }
 
-int media_decode(Media *media) {
+int media_read_frame(Media *media) {
     if (!media) {
-        printf("media_decode: media is NULL\n");
-        return MEDIA_ERR_INTERNAL;
-    }
-
-    int is_video = 0;
-    AVCodecContext *codec_ctx = NULL;
-    if (media->pkt->stream_index == media->video_stream_idx) {
-        codec_ctx = media->video_ctx;
-        is_video = 1;
-    } else if (media->pkt->stream_index == media->audio_stream_idx) {
-        codec_ctx = media->audio_ctx;
-    } else {
+        printf("media_read_frame: media is NULL\n");
         return MEDIA_ERR_INTERNAL;
     }
 
-    int ret = avcodec_send_packet(codec_ctx, media->pkt);
-    if (ret < 0) {
-        printf("media_decode: avcodec_send_packet failed: %s\n",
-               av_err2str(ret));
-        return MEDIA_ERR_LIBAV;
-    }
-
-    while (ret >= 0) {
-        AVFrame *frame = av_frame_alloc();
-        if (!frame) {
-            printf("media_decode: av_frame_alloc failed\n");
-            return MEDIA_ERR_LIBAV;
-        }
-
-        // Receive the decoded frames (or frame).
-        ret = avcodec_receive_frame(codec_ctx, frame);
-        if (ret == AVERROR(EAGAIN)) {
-            av_frame_free(&frame);
-            return MEDIA_ERR_MORE_DATA;
-        } else if (ret == AVERROR_EOF) {
-            av_frame_free(&frame);
-            return MEDIA_ERR_EOF;
-        } else if (ret < 0) {
-            return MEDIA_ERR_LIBAV;
-        }
-
-        if (is_video) {
-            AVFrame *scaled_frame = av_frame_alloc();
-            if (!scaled_frame) {
-                printf("media_decode: av_frame_alloc failed\n");
-                return MEDIA_ERR_LIBAV;
-            }
+    for (;;) {
+        av_packet_unref(media->pkt);
 
-            if (av_image_alloc(scaled_frame->data, scaled_frame->linesize,
-                               media->dst_frame_w, media->dst_frame_h,
-                               media->dst_frame_fmt, 1) < 0) {
-                printf("media_decode: av_image_alloc failed\n");
-                return MEDIA_ERR_LIBAV;
+        // After a seek served by the packet cache, the cached packets are
+        // handed out again until the demuxer's position is reached.
+        int cached = media->packet_cache &&
+                     packet_cache_read(media->packet_cache, media->pkt) == 0;
+        if (!cached) {
+            if (media->follow && !media_follow_ready(media)) {
+                return MEDIA_ERR_MORE_DATA;
             }
 
-            ret = sws_scale(media->sws_ctx, (const uint8_t *const *)frame->data,
-                            frame->linesize, 0, frame->height,
-                            scaled_frame->data, scaled_frame->linesize);
+            int ret = av_read_frame(media->fmt_ctx, media->pkt);
             if (ret < 0) {
-                printf("media_decode: sws_scale failed\n");
+                if (ret == AVERROR_EOF && media->follow &&
+                    !media_follow_done(media)) {
+                    // Only the end of what was written so far.
+                    media->fmt_ctx->pb->eof_reached = 0;
+                    return MEDIA_ERR_MORE_DATA;
+                } else if (ret == AVERROR_EOF) {
+                    printf("media_read_frame: end of file\n");
+                    return MEDIA_ERR_EOF;
+                }
+                printf("media_read_frame: av_read_frame failed: %s\n",
+                       av_err2str(ret));
                 return MEDIA_ERR_LIBAV;
             }
+        }
 
-            av_frame_free(&frame);
-            frame = scaled_frame;
+        // Update the position at container scale
+        media->position = media->pkt->pts;
 
-            fq_enqueue(media->queue, frame, FRAME_TYPE_VIDEO);
-        } else {
-            AVFrame *converted_frame = av_frame_alloc();
-            if (!converted_frame) {
-                printf("media_decode: av_frame_alloc failed\n");
-                return MEDIA_ERR_LIBAV;
+        int64_t ts = AV_NOPTS_VALUE;
+        if (media->pkt->pts != AV_NOPTS_VALUE) {
+            AVRational time_base =
+                media->fmt_ctx->streams[media->pkt->stream_index]->time_base;
+            ts = av_rescale_q(media->pkt->pts, time_base, AV_TIME_BASE_Q);
+            media->current_ts = ts;
+
+            if (media->follow && ts > media->fmt_ctx->duration) {
+                media->fmt_ctx->duration = ts;
+                media_get_formatted_time(media, ts, AV_TIME_BASE,
+                                         media->formatted_duration);
             }
+        }
 
-            converted_frame->format = AV_SAMPLE_FMT_FLT;
-            converted_frame->sample_rate = media->audio_ctx->sample_rate;
-            converted_frame->nb_samples = frame->nb_samples;
+        if (!cached && media->packet_cache) {
+            packet_cache_add(media->packet_cache, media->pkt, ts);
+        }
 
-            av_channel_layout_default(&converted_frame->ch_layout, 2);
+        if (media->pkt->dts == AV_NOPTS_VALUE) {
+            break;
+        }
 
-            if ((ret = av_frame_get_buffer(converted_frame, 0)) < 0) {
-                printf("media_decode: av_frame_get_buffer failed: %s\n",
-                       av_err2str(ret));
-                return MEDIA_ERR_LIBAV;
+        // After the video decoder was reopened, the audio packets the audio
+        // decoder already had are skipped.
+        if (media->pkt->stream_index == media->audio_stream_idx) {
+            if (media->audio_resume_dts != AV_NOPTS_VALUE &&
+                media->pkt->dts <= media->audio_resume_dts) {
+                continue;
             }
 
-            ret = swr_convert(media->swr_ctx, converted_frame->data,
-                              converted_frame->nb_samples,
-                              (const uint8_t **)frame->data, frame->nb_samples);
-
-            if (ret < 0) {
-                printf("media_decode: swr_convert failed\n");
-                return MEDIA_ERR_LIBAV;
-            }
+            media->audio_resume_dts = AV_NOPTS_VALUE;
+            media->last_audio_dts = media->pkt->dts;
+            break;
+        }
 
-            av_frame_copy_props(converted_frame, frame);
-            av_frame_free(&frame);
-            frame = converted_frame;
+        if (media->pkt->stream_index != media->video_stream_idx) {
+            break;
+        }
 
-            fq_enqueue(media->queue, frame, FRAME_TYPE_AUDIO);
+        // After an audio track switch, the video packets the decoder already
+        // had are skipped: the video goes on from where it was.
+        if (media->video_resume_dts != AV_NOPTS_VALUE &&
+            media->pkt->dts <= media->video_resume_dts) {
+            continue;
         }
+
+        media->video_resume_dts = AV_NOPTS_VALUE;
+        media->last_video_dts = media->pkt->dts;
+        break;
+    }
+
+    if (media_get_formatted_time(media, media->current_ts, AV_TIME_BASE,
+                                 media->formatted_position) < 0) {
+        printf("media_read_frame: media_get_formatted_time failed\n");
+        return MEDIA_ERR_INTERNAL;
     }
 
     return 0;
 }
 
-int media_seek(Media *media, int64_t incr, enum SeekDirection direction) {
-    if (!media) {
-        printf("media_seek: media is NULL\n");
-        return MEDIA_ERR_INTERNAL;
+// Returns the part of a `width` x `height` frame inside the crop rectangle, in
+// pixels, on even coordinates so subsampled chroma planes stay aligned.
+void media_crop_rect(Media *media, int width, int height, int *left, int *top,
+                     int *crop_w, int *crop_h) {
+    *crop_w = (int)(media->crop_w * width) & ~1;
+    *crop_h = (int)(media->crop_h * height) & ~1;
+    if (*crop_w < 2) {
+        *crop_w = 2;
+    }
+    if (*crop_h < 2) {
+        *crop_h = 2;
     }
 
-    int flags = 0;
-    if (direction == SEEK_BACKWARD) {
-        flags |= AVSEEK_FLAG_BACKWARD;
+    *left = (int)(media->crop_x * width) & ~1;
+    *top = (int)(media->crop_y * height) & ~1;
+    if (*left + *crop_w > width) {
+        *left = (width - *crop_w) & ~1;
+    }
+    if (*top + *crop_h > height) {
+        *top = (height - *crop_h) & ~1;
     }
+}
 
-    int stream_index;
-    if (media->pkt->stream_index == media->video_stream_idx) {
-        stream_index = media->video_stream_idx;
-    } else {
-        stream_index = media->audio_stream_idx;
+// How many slices a frame is converted in, 1 for small ones.
+int media_slice_count(Media *media, const AVFrame *src) {
+    if ((int64_t)src->width * src->height < MEDIA_SLICE_MIN_PIXELS ||
+        media->slice_threads == 1) {
+        return 1;
     }
 
-    int64_t timestamp = media->position + incr > 0 ? media->position + incr : 0;
-    media->position = timestamp;
+    int count = media->slice_threads > 0 ? media->slice_threads
+                                         : pool_global()->nb_workers;
+    count = FFMIN(count, MEDIA_MAX_SLICES);
+    count = FFMIN(count, media->dst_frame_h / MEDIA_SLICE_MIN_ROWS);
 
-    int64_t target =
-        av_rescale_q(timestamp, AV_TIME_BASE_Q,
-                     media->fmt_ctx->streams[stream_index]->time_base);
+    return FFMAX(count, 1);
+}
 
-    int ret =
-        av_seek_frame(media->fmt_ctx, media->video_stream_idx, target, flags);
+typedef struct {
+    struct SwsContext *ctx;
+    AVFrame *src, *dst;
+    // Output rows of the slice.
+    int y, h;
+    int ret;
+} MediaSlice;
+
+// Every slice is given the whole source and only produces its own rows of the
+// output, so the vertical filter, chroma included, sees the same neighbouring
+// lines at the edges of a slice as anywhere else.
+void media_scale_slice(void *arg) {
+    MediaSlice *slice = arg;
+
+    int ret = sws_frame_start(slice->ctx, slice->dst, slice->src);
+    if (ret >= 0) {
+        ret = sws_send_slice(slice->ctx, 0, slice->src->height);
+    }
+    if (ret >= 0) {
+        ret = sws_receive_slice(slice->ctx, slice->y, slice->h);
+    }
+    sws_frame_end(slice->ctx);
+
+    slice->ret = ret;
+}
+
+// Converts `src` into the allocated `dst` in `count` slices: the first one on
+// the calling thread, the others on the pool.
+int media_scale_slices(Media *media, MediaScaler *scaler, AVFrame *src,
+                       AVFrame *dst, int count) {
+    for (int i = 1; i < count; i++) {
+        if (scaler->slice_ctx[i - 1]) {
+            continue;
+        }
+
+        scaler->slice_ctx[i - 1] = sws_getContext(
+            scaler->src_w, scaler->src_h, scaler->src_fmt, scaler->dst_w,
+            scaler->dst_h, media->dst_frame_fmt, scaler->flags, NULL, NULL,
+            NULL);
+        if (!scaler->slice_ctx[i - 1]) {
+            printf("media_scale_slices: sws_getContext failed\n");
+            return MEDIA_ERR_LIBAV;
+        }
+    }
+
+    // Slices start on rows the scaler can start an output slice at, e.g. even
+    // ones for subsampled output.
+    int align = sws_receive_slice_alignment(scaler->ctx);
+    int rows = (dst->height + count - 1) / count;
+    rows = (rows + align - 1) / align * align;
+
+    MediaSlice slices[MEDIA_MAX_SLICES];
+    PoolGroup group;
+    pool_group_init(&group);
+
+    int nb_slices = 0;
+    for (int y = 0; y < dst->height; y += rows) {
+        MediaSlice *slice = &slices[nb_slices];
+        *slice = (MediaSlice){
+            .ctx = nb_slices ? scaler->slice_ctx[nb_slices - 1] : scaler->ctx,
+            .src = src,
+            .dst = dst,
+            .y = y,
+            .h = FFMIN(rows, dst->height - y),
+            .ret = 0};
+
+        PoolTask task = {.run = media_scale_slice,
+                         .arg = slice,
+                         .priority = POOL_PRIORITY_VISIBLE,
+                         .deadline = av_gettime_relative(),
+                         .owner = &media->pool_owner,
+                         .group = &group};
+        if (nb_slices > 0 && pool_submit(pool_global(), task) < 0) {
+            media_scale_slice(slice);
+        }
+        nb_slices++;
+    }
+
+    media_scale_slice(&slices[0]);
+    pool_group_wait(pool_global(), &group);
+    pool_group_destroy(&group);
+
+    for (int i = 0; i < nb_slices; i++) {
+        if (slices[i].ret < 0) {
+            printf("media_scale_slices: slice %d failed: %s\n", i,
+                   av_err2str(slices[i].ret));
+            return MEDIA_ERR_LIBAV;
+        }
+    }
+
+    return 0;
+}
+
+int media_convert_frame(Media *media, AVFrame *frame, AVFrame **out) {
+    *out = NULL;
+
+    // Only the visible part is converted. Cropping moves the plane pointers of
+    // a new reference to the frame, which itself stays whole.
+    AVFrame *src = frame;
+    AVFrame *cropped = NULL;
+    if (media->crop_w < 1 || media->crop_h < 1) {
+        cropped = av_frame_alloc();
+        if (!cropped || av_frame_ref(cropped, frame) < 0) {
+            printf("media_convert_frame: failed to reference the frame\n");
+            av_frame_free(&cropped);
+            return MEDIA_ERR_LIBAV;
+        }
+
+        int left, top, width, height;
+        media_crop_rect(media, frame->width, frame->height, &left, &top, &width,
+                        &height);
+        cropped->crop_left = left;
+        cropped->crop_top = top;
+        cropped->crop_right = frame->width - left - width;
+        cropped->crop_bottom = frame->height - top - height;
+        if (av_frame_apply_cropping(cropped, AV_FRAME_CROP_UNALIGNED) < 0) {
+            printf("media_convert_frame: av_frame_apply_cropping failed\n");
+            av_frame_free(&cropped);
+            return MEDIA_ERR_LIBAV;
+        }
+        src = cropped;
+    }
+
+    // Decoders may change the size of their frames, e.g. in lowres.
+    MediaScaler *scaler =
+        media_get_scaler(media, src->width, src->height, src->format);
+    if (!scaler) {
+        printf("media_convert_frame: media_get_scaler failed\n");
+        av_frame_free(&cropped);
+        return MEDIA_ERR_LIBAV;
+    }
+
+    AVFrame *scaled_frame = av_frame_alloc();
+    if (!scaled_frame) {
+        printf("media_convert_frame: av_frame_alloc failed\n");
+        av_frame_free(&cropped);
+        return MEDIA_ERR_LIBAV;
+    }
+
+    // Rows must be tightly packed, since the whole buffer is uploaded to the
+    // texture at once.
+    scaled_frame->width = media->dst_frame_w;
+    scaled_frame->height = media->dst_frame_h;
+    scaled_frame->format = media->dst_frame_fmt;
+    if (av_frame_get_buffer(scaled_frame, 1) < 0) {
+        printf("media_convert_frame: av_frame_get_buffer failed\n");
+        av_frame_free(&scaled_frame);
+        av_frame_free(&cropped);
+        return MEDIA_ERR_LIBAV;
+    }
+
+    int slices = media_slice_count(media, src);
+    int ret = slices > 1
+                  ? media_scale_slices(media, scaler, src, scaled_frame, slices)
+                  : sws_scale(scaler->ctx, (const uint8_t *const *)src->data,
+                              src->linesize, 0, src->height, scaled_frame->data,
+                              scaled_frame->linesize);
+    av_frame_free(&cropped);
+    if (ret < 0) {
+        printf("media_convert_frame: sws_scale failed\n");
+        av_frame_free(&scaled_frame);
+        return MEDIA_ERR_LIBAV;
+    }
+
+    av_frame_copy_props(scaled_frame, frame);
+    *out = scaled_frame;
+
+    return 0;
+}
+
+// Takes ownership of a decoded frame that was just converted.
+void media_keep_source(Media *media, AVFrame *frame) {
+    if (!media->keep_sources) {
+        av_frame_free(&frame);
+        return;
+    }
+
+    av_frame_free(&media->sources[media->source_next]);
+    media->sources[media->source_next] = frame;
+    media->source_next = (media->source_next + 1) % MEDIA_SOURCE_FRAMES;
+}
+
+// Screen recordings and slides repeat the same frame for seconds. Every row
+// is hashed a word at a time, padding excluded, which costs a fraction of a
+// conversion and catches a cursor moving by one pixel.
+uint64_t media_frame_hash(const AVFrame *frame) {
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+    int widths[4];
+    if (!desc || (desc->flags & AV_PIX_FMT_FLAG_HWACCEL) ||
+        av_image_fill_linesizes(widths, frame->format, frame->width) < 0) {
+        return 0;
+    }
+
+    uint64_t hash = 0xcbf29ce484222325ULL ^ (uint64_t)frame->format;
+    hash = (hash ^ ((uint64_t)frame->width << 32 | (uint32_t)frame->height)) *
+           0x9e3779b97f4a7c15ULL;
+
+    for (int plane = 0; plane < 4 && frame->data[plane]; plane++) {
+        int height = plane == 1 || plane == 2
+                         ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h)
+                         : frame->height;
+
+        for (int y = 0; y < height; y++) {
+            const uint8_t *row =
+                frame->data[plane] + (ptrdiff_t)y * frame->linesize[plane];
+
+            int x = 0;
+            for (; x + 8 <= widths[plane]; x += 8) {
+                uint64_t word;
+                memcpy(&word, row + x, 8);
+                hash = (hash ^ word) * 0x9e3779b97f4a7c15ULL;
+                hash ^= hash >> 32;
+            }
+            for (; x < widths[plane]; x++) {
+                hash = (hash ^ row[x]) * 0x9e3779b97f4a7c15ULL;
+            }
+        }
+    }
+
+    return hash ? hash : 1;
+}
+
+// Converts a decoded (and filtered) frame for display or playback, and
+// queues it. The frame is freed.
+int media_queue_frame(Media *media, AVFrame *frame, int is_video) {
+    int ret;
+    if (is_video && media->skip_duplicates) {
+        uint64_t hash = media_frame_hash(frame);
+        if (hash && hash == media->last_hash) {
+            // Only the timestamps are queued, for the clock.
+            AVFrame *repeat = av_frame_alloc();
+            if (!repeat) {
+                av_frame_free(&frame);
+                return MEDIA_ERR_LIBAV;
+            }
+            repeat->pts = frame->pts;
+            repeat->best_effort_timestamp = frame->best_effort_timestamp;
+            repeat->duration = frame->duration;
+            av_frame_free(&frame);
+
+            media->duplicates++;
+            fq_enqueue(media->queue, repeat, FRAME_TYPE_REPEAT);
+            return 0;
+        }
+        media->last_hash = hash;
+    }
+
+    if (is_video) {
+        AVFrame *scaled_frame = NULL;
+        ret = media_convert_frame(media, frame, &scaled_frame);
+        if (ret < 0) {
+            av_frame_free(&frame);
+            return ret;
+        }
+
+        media_keep_source(media, frame);
+        fq_enqueue(media->queue, scaled_frame, FRAME_TYPE_VIDEO);
+        return 0;
+    }
+
+    // Without probing, the rate of the container may be that of the core of
+    // the stream only; audio is played at the rate it decodes to.
+    if (media->out_sample_rate_guessed) {
+        media->out_sample_rate_guessed = 0;
+        if (frame->sample_rate != media->out_sample_rate) {
+            media->out_sample_rate = frame->sample_rate;
+            media->swr_in_rate = 0;
+        }
+    }
+
+    // Filters may hand out another sample format, rate or layout than the
+    // decoder's.
+    if (frame->format != media->swr_in_fmt ||
+        frame->sample_rate != media->swr_in_rate ||
+        av_channel_layout_compare(&frame->ch_layout, &media->swr_in_layout) !=
+            0) {
+        ret = media_open_resampler(media, frame);
+        if (ret < 0) {
+            av_frame_free(&frame);
+            return ret;
+        }
+    }
+
+    AVFrame *converted_frame = av_frame_alloc();
+    if (!converted_frame) {
+        printf("media_queue_frame: av_frame_alloc failed\n");
+        av_frame_free(&frame);
+        return MEDIA_ERR_LIBAV;
+    }
+
+    converted_frame->format = AV_SAMPLE_FMT_FLT;
+    converted_frame->sample_rate = media->out_sample_rate;
+    // Room for what the resampler still buffers, at the output rate.
+    converted_frame->nb_samples = (int)av_rescale_rnd(
+        swr_get_delay(media->swr_ctx, frame->sample_rate) + frame->nb_samples,
+        media->out_sample_rate, frame->sample_rate, AV_ROUND_UP);
+
+    av_channel_layout_default(&converted_frame->ch_layout, 2);
+
+    if ((ret = av_frame_get_buffer(converted_frame, 0)) < 0) {
+        printf("media_queue_frame: av_frame_get_buffer failed: %s\n",
+               av_err2str(ret));
+        av_frame_free(&converted_frame);
+        av_frame_free(&frame);
+        return MEDIA_ERR_LIBAV;
+    }
+
+    ret = swr_convert(media->swr_ctx, converted_frame->data,
+                      converted_frame->nb_samples,
+                      (const uint8_t **)frame->data, frame->nb_samples);
+
+    if (ret < 0) {
+        printf("media_queue_frame: swr_convert failed\n");
+        av_frame_free(&converted_frame);
+        av_frame_free(&frame);
+        return MEDIA_ERR_LIBAV;
+    }
+    converted_frame->nb_samples = ret;
+
+    av_frame_copy_props(converted_frame, frame);
+    av_frame_free(&frame);
+
+    fq_enqueue(media->queue, converted_frame, FRAME_TYPE_AUDIO);
+    return 0;
+}
+
+// Runs a decoded frame through the filters of its stream, if it has any, and
+// queues what comes out. A NULL frame flushes them. The frame is freed.
+// Frames go on unfiltered after a chain could not be built, instead of failing
+// to decode from then on.
+void media_drop_filter(Media *media, int is_video) {
+    printf("media_drop_filter: the %s filters could not be built, frames go "
+           "on unfiltered\n",
+           is_video ? "video" : "audio");
+
+    if (is_video) {
+        filter_chain_free(media->video_filter);
+        media->video_filter = NULL;
+        media->video_filters = NULL;
+        media->deinterlace = 0;
+    } else {
+        filter_chain_free(media->audio_filter);
+        media->audio_filter = NULL;
+        media->audio_filters = NULL;
+    }
+}
+
+int media_filter_frame(Media *media, AVFrame *frame, int is_video) {
+    // Interlaced video is deinterlaced from its first interlaced frame on,
+    // so progressive video never waits for the filter.
+    if (is_video && frame && !media->video_filter && media->deinterlace &&
+        (frame->flags & AV_FRAME_FLAG_INTERLACED)) {
+        media->video_filter =
+            filter_chain_alloc(AVMEDIA_TYPE_VIDEO, FILTER_CHAIN_DEINTERLACE);
+    }
+
+    FilterChain *chain = is_video ? media->video_filter : media->audio_filter;
+    if (!chain) {
+        return frame ? media_queue_frame(media, frame, is_video) : 0;
+    }
+
+    int stream_index =
+        is_video ? media->video_stream_idx : media->audio_stream_idx;
+    int ret = filter_chain_send(chain, frame,
+                                media->fmt_ctx->streams[stream_index]->time_base);
+    if (ret < 0 && chain->broken) {
+        media_drop_filter(media, is_video);
+        return frame ? media_queue_frame(media, frame, is_video) : 0;
+    }
+    av_frame_free(&frame);
+    if (ret < 0) {
+        return ret;
+    }
+
+    while (1) {
+        AVFrame *filtered = av_frame_alloc();
+        if (!filtered) {
+            printf("media_filter_frame: av_frame_alloc failed\n");
+            return MEDIA_ERR_LIBAV;
+        }
+
+        ret = filter_chain_receive(chain, filtered);
+        if (ret < 0 && chain->broken) {
+            av_frame_free(&filtered);
+            media_drop_filter(media, is_video);
+            return 0;
+        } else if (ret < 0) {
+            av_frame_free(&filtered);
+            return ret == MEDIA_ERR_MORE_DATA || ret == MEDIA_ERR_EOF ? 0 : ret;
+        }
+
+        ret = media_queue_frame(media, filtered, is_video);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+}
+
+int media_receive_frames(Media *media, AVCodecContext *codec_ctx, int is_video) {
+    int ret = 0;
+    while (ret >= 0) {
+        AVFrame *frame = av_frame_alloc();
+        if (!frame) {
+            printf("media_receive_frames: av_frame_alloc failed\n");
+            return MEDIA_ERR_LIBAV;
+        }
+
+        // Receive the decoded frames (or frame).
+        ret = avcodec_receive_frame(codec_ctx, frame);
+        if (ret == AVERROR(EAGAIN)) {
+            av_frame_free(&frame);
+            return MEDIA_ERR_MORE_DATA;
+        } else if (ret == AVERROR_EOF) {
+            // A drained decoder drains the filters behind it as well.
+            av_frame_free(&frame);
+            ret = media_filter_frame(media, NULL, is_video);
+            return ret < 0 ? ret : MEDIA_ERR_EOF;
+        } else if (ret < 0) {
+            av_frame_free(&frame);
+            return MEDIA_ERR_LIBAV;
+        }
+
+        if (is_video) {
+            int64_t pts = frame->best_effort_timestamp;
+            if (pts != AV_NOPTS_VALUE) {
+                // A reopened decoder gets back to where the old one was.
+                if (media->video_skip_until != AV_NOPTS_VALUE &&
+                    pts + frame->duration <= media->video_skip_until) {
+                    av_frame_free(&frame);
+                    continue;
+                }
+                media->video_skip_until = AV_NOPTS_VALUE;
+                media->last_video_end = pts + frame->duration;
+            }
+
+            // Frames before a frame-accurate seek target are only decoded
+            // to rebuild the references, so there is no need to convert them.
+            if (media->skip_until != AV_NOPTS_VALUE &&
+                frame->best_effort_timestamp != AV_NOPTS_VALUE &&
+                frame->best_effort_timestamp + frame->duration <=
+                    media->skip_until) {
+                av_frame_free(&frame);
+                continue;
+            }
+        } else {
+            // Audio before the position of an audio track switch.
+            if (media->audio_skip_until != AV_NOPTS_VALUE &&
+                frame->best_effort_timestamp != AV_NOPTS_VALUE &&
+                frame->best_effort_timestamp + frame->duration <=
+                    media->audio_skip_until) {
+                av_frame_free(&frame);
+                continue;
+            }
+        }
+
+        ret = media_filter_frame(media, frame, is_video);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+
+    return 0;
+}
+
+int media_decode(Media *media) {
+    if (!media) {
+        printf("media_decode: media is NULL\n");
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    int is_video = 0;
+    AVCodecContext *codec_ctx = NULL;
+    if (media->pkt->stream_index == media->video_stream_idx) {
+        codec_ctx = media->video_ctx;
+        is_video = 1;
+    } else if (media->pkt->stream_index == media->audio_stream_idx) {
+        // In fast open mode, nothing about audio is set up before this.
+        if (!media->audio_ctx) {
+            int ret = media_open_audio(media);
+            if (ret < 0) {
+                return ret;
+            }
+        }
+        codec_ctx = media->audio_ctx;
+    } else {
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    // A reopened decoder has no references until the next keyframe.
+    if (is_video && media->wait_keyframe) {
+        if (!(media->pkt->flags & AV_PKT_FLAG_KEY)) {
+            return MEDIA_ERR_MORE_DATA;
+        }
+        media->wait_keyframe = 0;
+    }
+
+    int64_t start = is_video ? av_gettime_relative() : 0;
+
+    int ret = avcodec_send_packet(codec_ctx, media->pkt);
+    if (ret < 0) {
+        printf("media_decode: avcodec_send_packet failed: %s\n",
+               av_err2str(ret));
+        return MEDIA_ERR_LIBAV;
+    }
+
+    ret = media_receive_frames(media, codec_ctx, is_video);
+
+    if (is_video) {
+        double elapsed = (av_gettime_relative() - start) / 1e6;
+        media->decode_time = media->decode_time > 0
+                                 ? media->decode_time * 0.9 + elapsed * 0.1
+                                 : elapsed;
+    }
+
+    return ret;
+}
+
+int media_seek(Media *media, int64_t incr, enum SeekDirection direction) {
+    if (!media) {
+        printf("media_seek: media is NULL\n");
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    int flags = 0;
+    if (direction == SEEK_BACKWARD) {
+        flags |= AVSEEK_FLAG_BACKWARD;
+    }
+
+    int stream_index;
+    if (media->pkt->stream_index == media->video_stream_idx) {
+        stream_index = media->video_stream_idx;
+    } else {
+        stream_index = media->audio_stream_idx;
+    }
+
+    int64_t timestamp = media->position + incr > 0 ? media->position + incr : 0;
+    media->position = timestamp;
+
+    int64_t target =
+        av_rescale_q(timestamp, AV_TIME_BASE_Q,
+                     media->fmt_ctx->streams[stream_index]->time_base);
+
+    int ret =
+        av_seek_frame(media->fmt_ctx, media->video_stream_idx, target, flags);
     if (ret < 0) {
         printf("media_seek: av_seek_frame failed: %s\n", av_err2str(ret));
         return MEDIA_ERR_LIBAV;
     }
 
-    avcodec_flush_buffers(media->video_ctx);
-    avcodec_flush_buffers(media->audio_ctx);
+    if (media->packet_cache) {
+        packet_cache_clear(media->packet_cache);
+    }
+
+    if (media->video_ctx) {
+        avcodec_flush_buffers(media->video_ctx);
+    }
+    if (media->audio_ctx) {
+        avcodec_flush_buffers(media->audio_ctx);
+    }
+
+    media->audio_skip_until = AV_NOPTS_VALUE;
+    media->video_resume_dts = AV_NOPTS_VALUE;
+    media->video_skip_until = AV_NOPTS_VALUE;
+    media->audio_resume_dts = AV_NOPTS_VALUE;
+
+    // Filters must not mix frames from before and after the seek.
+    filter_chain_reset(media->video_filter);
+    filter_chain_reset(media->audio_filter);
+    media->last_hash = 0;
+
+    return 0;
+}
+
+int media_seek_to(Media *media, int64_t timestamp) {
+    if (!media) {
+        printf("media_seek_to: media is NULL\n");
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    if (media->fmt_ctx->duration > 0 && timestamp > media->fmt_ctx->duration) {
+        timestamp = media->fmt_ctx->duration;
+    }
+    if (timestamp < 0) {
+        timestamp = 0;
+    }
+
+    int stream_index = media->video_stream_idx >= 0 ? media->video_stream_idx
+                                                     : media->audio_stream_idx;
+    int64_t target = av_rescale_q(
+        timestamp, AV_TIME_BASE_Q,
+        media->fmt_ctx->streams[stream_index]->time_base);
+
+    // Inside the packet cache window, decoding restarts from a cached keyframe
+    // and the container is left where it is.
+    if (!media->packet_cache ||
+        packet_cache_seek(media->packet_cache, stream_index, timestamp) < 0) {
+        int ret = av_seek_frame(media->fmt_ctx, stream_index, target,
+                                AVSEEK_FLAG_BACKWARD);
+        if (ret < 0) {
+            printf("media_seek_to: av_seek_frame failed: %s\n",
+                   av_err2str(ret));
+            return MEDIA_ERR_LIBAV;
+        }
+
+        if (media->packet_cache) {
+            packet_cache_clear(media->packet_cache);
+        }
+    }
+
+    if (media->video_ctx) {
+        avcodec_flush_buffers(media->video_ctx);
+    }
+    if (media->audio_ctx) {
+        avcodec_flush_buffers(media->audio_ctx);
+    }
+
+    // Whatever was queued belongs to the old position.
+    fq_clear(media->queue);
+    av_packet_unref(media->pkt);
+
+    media->audio_skip_until = AV_NOPTS_VALUE;
+    media->video_resume_dts = AV_NOPTS_VALUE;
+    media->video_skip_until = AV_NOPTS_VALUE;
+    media->audio_resume_dts = AV_NOPTS_VALUE;
+
+    // Filters must not mix frames from before and after the seek.
+    filter_chain_reset(media->video_filter);
+    filter_chain_reset(media->audio_filter);
+    media->last_hash = 0;
+
+    media->position = target;
+    media->current_ts = timestamp;
+    media_get_formatted_time(media, media->current_ts, AV_TIME_BASE,
+                             media->formatted_position);
+
+    return 0;
+}
+
+int media_seek_frame(Media *media, int64_t timestamp, int accurate,
+                     AVFrame **frame) {
+    if (!media || !frame) {
+        printf("media_seek_frame: media or frame is NULL\n");
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    *frame = NULL;
+    if (!media->video_ctx) {
+        return MEDIA_ERR_NO_STREAM;
+    }
+
+    int ret = media_seek_to(media, timestamp);
+    if (ret < 0) {
+        return ret;
+    }
+
+    AVRational time_base =
+        media->fmt_ctx->streams[media->video_stream_idx]->time_base;
+    media->skip_until = accurate
+                            ? av_rescale_q(timestamp, AV_TIME_BASE_Q, time_base)
+                            : AV_NOPTS_VALUE;
+
+    // An accurate seek decodes the audio on the way, and keeps what starts at
+    // the target, so playing on from there has no gap.
+    FrameQueue *audio = NULL;
+    double audio_target = 0;
+    if (accurate && media->audio_stream_idx >= 0) {
+        audio = fq_alloc();
+        audio_target =
+            (double)timestamp / AV_TIME_BASE /
+            av_q2d(media->fmt_ctx->streams[media->audio_stream_idx]->time_base);
+    }
+
+    int drained = 0;
+    while (!*frame) {
+        ret = media_read_frame(media);
+        if (ret == MEDIA_ERR_EOF && !drained) {
+            // Whatever the decoder is still holding is all we can get.
+            avcodec_send_packet(media->video_ctx, NULL);
+            drained = 1;
+            ret = media_receive_frames(media, media->video_ctx, 1);
+        } else if (ret < 0) {
+            break;
+        } else if (audio &&
+                   media->pkt->stream_index == media->audio_stream_idx) {
+            ret = media_decode(media);
+        } else if (media->pkt->stream_index != media->video_stream_idx) {
+            // Otherwise the audio is resynchronized by the next packets after
+            // the target.
+            continue;
+        } else {
+            int is_key = media->pkt->flags & AV_PKT_FLAG_KEY;
+            ret = media_decode(media);
+
+            // Decoders with reordering delay may hold the keyframe until more
+            // packets arrive. When only the keyframe is wanted, drain it right
+            // away instead of reading (and discarding) the rest of the GOP.
+            if (!accurate && is_key && fq_empty(media->queue)) {
+                avcodec_send_packet(media->video_ctx, NULL);
+                drained = 1;
+                ret = media_receive_frames(media, media->video_ctx, 1);
+            }
+        }
+
+        if (ret < 0 && ret != MEDIA_ERR_MORE_DATA && ret != MEDIA_ERR_EOF) {
+            break;
+        }
+
+        while (!fq_empty(media->queue)) {
+            Node *node = fq_dequeue(media->queue);
+            if (node->type == FRAME_TYPE_VIDEO && !*frame) {
+                *frame = node->frame;
+                node->frame = NULL;
+            } else if (node->type == FRAME_TYPE_AUDIO && audio &&
+                       (node->frame->best_effort_timestamp == AV_NOPTS_VALUE ||
+                        node->frame->best_effort_timestamp >= audio_target)) {
+                fq_enqueue(audio, node->frame, FRAME_TYPE_AUDIO);
+                node->frame = NULL;
+            }
+            node_free(node);
+        }
+
+        if (drained) {
+            break;
+        }
+    }
+
+    media->skip_until = AV_NOPTS_VALUE;
+
+    // The kept audio is played first, before the frame the caller queues.
+    if (audio) {
+        while (*frame && !fq_empty(audio)) {
+            Node *node = fq_dequeue(audio);
+            fq_enqueue(media->queue, node->frame, FRAME_TYPE_AUDIO);
+            node->frame = NULL;
+            node_free(node);
+        }
+        fq_free(audio);
+    }
+
+    // A drained decoder does not accept packets until it is flushed. The
+    // stream must be positioned on a keyframe again before decoding goes on,
+    // which the next seek takes care of.
+    if (drained) {
+        avcodec_flush_buffers(media->video_ctx);
+    }
+
+    if (!*frame) {
+        printf("media_seek_frame: no frame decoded at target\n");
+        return ret < 0 ? ret : MEDIA_ERR_INTERNAL;
+    }
+
+    if ((*frame)->best_effort_timestamp != AV_NOPTS_VALUE) {
+        media->current_ts = av_rescale_q((*frame)->best_effort_timestamp,
+                                         time_base, AV_TIME_BASE_Q);
+        media_get_formatted_time(media, media->current_ts, AV_TIME_BASE,
+                                 media->formatted_position);
+    }
+
+    return 0;
+}
+
+int64_t media_keyframe_before(Media *media, int64_t timestamp) {
+    if (!media || media->video_stream_idx < 0) {
+        return timestamp;
+    }
+
+    AVStream *stream = media->fmt_ctx->streams[media->video_stream_idx];
+    int64_t target = av_rescale_q(timestamp, AV_TIME_BASE_Q, stream->time_base);
+
+    int idx = av_index_search_timestamp(stream, target, AVSEEK_FLAG_BACKWARD);
+    if (idx < 0) {
+        return timestamp;
+    }
+
+    const AVIndexEntry *entry = avformat_index_get_entry(stream, idx);
+    if (!entry) {
+        return timestamp;
+    }
+
+    return av_rescale_q(entry->timestamp, stream->time_base, AV_TIME_BASE_Q);
+}
+
+int media_add_keyframes(Media *media, const MediaKeyframe *keyframes,
+                        int count) {
+    if (!media || media->video_stream_idx < 0) {
+        return MEDIA_ERR_NO_STREAM;
+    }
+
+    AVStream *stream = media->fmt_ctx->streams[media->video_stream_idx];
+    if (avformat_index_get_entries_count(stream) > 0) {
+        return 0;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (av_add_index_entry(stream, keyframes[i].pos, keyframes[i].pts, 0, 0,
+                               AVINDEX_KEYFRAME) < 0) {
+            printf("media_add_keyframes: av_add_index_entry failed\n");
+            return MEDIA_ERR_LIBAV;
+        }
+    }
+
+    return 0;
+}
+
+void media_set_keyframes_only(Media *media, int enabled) {
+    if (!media || !media->video_ctx) {
+        return;
+    }
+
+    media->video_ctx->skip_frame = enabled ? AVDISCARD_NONKEY : media->skip_frame;
+}
+
+enum MediaQuality media_get_quality(Media *media) {
+    return media ? media->quality : MEDIA_QUALITY_FULL;
+}
+
+const char *media_quality_name(enum MediaQuality quality) {
+    switch (quality) {
+    case MEDIA_QUALITY_FULL:
+        return "full";
+    case MEDIA_QUALITY_SKIP_LOOP_FILTER:
+        return "skip-loop-filter";
+    case MEDIA_QUALITY_SKIP_NONREF:
+        return "skip-nonref";
+    case MEDIA_QUALITY_LOWRES:
+        return "lowres";
+    }
+
+    return "unknown";
+}
+
+// Replaces the video decoder with one decoding at `lowres`, keeping the
+// discard settings. Frames are dropped until the next keyframe.
+int media_reopen_video(Media *media, int lowres) {
+    AVCodecParameters *codec_params =
+        media->fmt_ctx->streams[media->video_stream_idx]->codecpar;
+    const AVCodec *codec = media->video_ctx->codec;
+
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    if (!codec_ctx) {
+        printf("media_reopen_video: avcodec_alloc_context3 failed\n");
+        return MEDIA_ERR_LIBAV;
+    }
+
+    if (avcodec_parameters_to_context(codec_ctx, codec_params) < 0) {
+        printf("media_reopen_video: avcodec_parameters_to_context failed\n");
+        avcodec_free_context(&codec_ctx);
+        return MEDIA_ERR_LIBAV;
+    }
+
+    codec_ctx->lowres = lowres;
+    codec_ctx->skip_frame = media->video_ctx->skip_frame;
+    codec_ctx->skip_idct = media->video_ctx->skip_idct;
+    codec_ctx->skip_loop_filter = media->video_ctx->skip_loop_filter;
+
+    if (avcodec_open2(codec_ctx, codec, NULL) < 0) {
+        printf("media_reopen_video: avcodec_open2 failed\n");
+        avcodec_free_context(&codec_ctx);
+        return MEDIA_ERR_LIBAV;
+    }
+
+    avcodec_free_context(&media->video_ctx);
+    media->video_ctx = codec_ctx;
+    media->wait_keyframe = 1;
+
+    // The new decoder has no references. The demuxer goes back to the
+    // keyframe before the last decoded frame, instead of the picture freezing
+    // until the next one; the frames and audio packets the player already
+    // has are dropped on the way.
+    if (media->last_video_end == AV_NOPTS_VALUE) {
+        return 0;
+    }
+
+    if (av_seek_frame(media->fmt_ctx, media->video_stream_idx,
+                      media->last_video_end - 1, AVSEEK_FLAG_BACKWARD) < 0) {
+        printf("media_reopen_video: av_seek_frame failed, waiting for the "
+               "next keyframe\n");
+        return 0;
+    }
+
+    if (media->packet_cache) {
+        packet_cache_clear(media->packet_cache);
+    }
+    filter_chain_reset(media->video_filter);
+    av_packet_unref(media->pkt);
+
+    media->video_resume_dts = AV_NOPTS_VALUE;
+    media->video_skip_until = media->last_video_end;
+    media->audio_resume_dts = media->last_audio_dts;
+
+    return 0;
+}
+
+void media_set_quality(Media *media, enum MediaQuality quality) {
+    if (!media || !media->video_ctx) {
+        return;
+    }
+
+    AVCodecContext *ctx = media->video_ctx;
+
+    ctx->skip_loop_filter = quality >= MEDIA_QUALITY_SKIP_LOOP_FILTER
+                                ? AVDISCARD_ALL
+                                : AVDISCARD_DEFAULT;
+
+    // Decoders honour one or the other.
+    media->skip_frame =
+        quality >= MEDIA_QUALITY_SKIP_NONREF ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+    ctx->skip_idct = media->skip_frame;
+    if (ctx->skip_frame != AVDISCARD_NONKEY) {
+        ctx->skip_frame = media->skip_frame;
+    }
+
+    media->sws_flags =
+        quality >= MEDIA_QUALITY_LOWRES ? SWS_FAST_BILINEAR : SWS_BILINEAR;
+
+    // Most modern decoders cannot decode at a lower resolution, the scaler is
+    // all that changes for them.
+    int lowres = quality >= MEDIA_QUALITY_LOWRES && ctx->codec->max_lowres > 0;
+    if (lowres != ctx->lowres) {
+        media_reopen_video(media, lowres);
+    }
+
+    int shrink = (quality >= MEDIA_QUALITY_LOWRES) !=
+                 (media->quality >= MEDIA_QUALITY_LOWRES);
+    media->quality = quality;
+    if (shrink && media->output_w > 0 && media->output_h > 0) {
+        media_set_output_size(media, media->output_w, media->output_h);
+    }
+
+    media->quality_over = 0;
+    media->quality_under = 0;
+    media->quality_frames = 0;
+}
+
+enum MediaQuality media_update_quality(Media *media, int queued) {
+    if (!media || !media->video_ctx) {
+        return MEDIA_QUALITY_FULL;
+    }
+
+    AVStream *stream = media->fmt_ctx->streams[media->video_stream_idx];
+    AVRational frame_rate = av_guess_frame_rate(media->fmt_ctx, stream, NULL);
+    if (frame_rate.num <= 0 || frame_rate.den <= 0) {
+        return media->quality;
+    }
+
+    double load = media->decode_time * av_q2d(frame_rate);
+    media->quality_frames++;
+    int overloaded = load > MEDIA_QUALITY_HIGH_LOAD ||
+                     (queued == 0 && load > MEDIA_QUALITY_STARVED_LOAD);
+
+    if (overloaded) {
+        media->quality_under = 0;
+        if (++media->quality_over >= MEDIA_QUALITY_DOWN_FRAMES &&
+            media->quality < MEDIA_QUALITY_LOWRES) {
+            // The last step up did not last, so wait longer before the next.
+            if (media->quality_raised &&
+                media->quality_frames < media->quality_up_frames &&
+                media->quality_up_frames < MEDIA_QUALITY_MAX_UP_FRAMES) {
+                media->quality_up_frames *= 2;
+            }
+            media_set_quality(media, media->quality + 1);
+            media->quality_raised = 0;
+        }
+    } else if (load < MEDIA_QUALITY_LOW_LOAD) {
+        media->quality_over = 0;
+        if (++media->quality_under >= media->quality_up_frames &&
+            media->quality > MEDIA_QUALITY_FULL) {
+            media_set_quality(media, media->quality - 1);
+            media->quality_raised = 1;
+        }
+    } else {
+        media->quality_over = 0;
+        media->quality_under = 0;
+    }
+
+    return media->quality;
+}
+
+int media_set_output_size(Media *media, int dst_frame_w, int dst_frame_h) {
+    if (!media) {
+        printf("media_set_output_size: media is NULL\n");
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    if (dst_frame_w <= 0 || dst_frame_h <= 0) {
+        printf("media_set_output_size: invalid size %dx%d\n", dst_frame_w,
+               dst_frame_h);
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    media->output_w = dst_frame_w;
+    media->output_h = dst_frame_h;
+
+    // Converting to a quarter of the pixels is what saves the most on codecs
+    // without lowres decoding.
+    if (media->quality >= MEDIA_QUALITY_LOWRES) {
+        dst_frame_w = FFMAX(dst_frame_w / 2 & ~1, 2);
+        dst_frame_h = FFMAX(dst_frame_h / 2 & ~1, 2);
+    }
+
+    // The scaler for the new size is found or built with the first frame.
+    if (dst_frame_w != media->dst_frame_w || dst_frame_h != media->dst_frame_h) {
+        media->last_hash = 0;
+    }
+    media->dst_frame_w = dst_frame_w;
+    media->dst_frame_h = dst_frame_h;
+
+    return 0;
+}
+
+void media_fit_output_size(Media *media, int box_w, int box_h, int *dst_frame_w,
+                           int *dst_frame_h) {
+    *dst_frame_w = box_w;
+    *dst_frame_h = box_h;
+    if (!media || !media->video_ctx || media->video_ctx->width <= 0 ||
+        media->video_ctx->height <= 0) {
+        return;
+    }
+
+    // Only the cropped part of the frames is shown.
+    double width = media->video_ctx->width * media->crop_w;
+    double height = media->video_ctx->height * media->crop_h;
+    AVRational sar = media->video_ctx->sample_aspect_ratio;
+    if (sar.num > 0 && sar.den > 0) {
+        width *= av_q2d(sar);
+    }
+
+    double scale = box_w / width;
+    if (box_h / height < scale) {
+        scale = box_h / height;
+    }
+    if (scale > 1) {
+        scale = 1;
+    }
+
+    // Even sizes keep the chroma planes of subsampled formats aligned.
+    *dst_frame_w = (int)(width * scale) & ~1;
+    *dst_frame_h = (int)(height * scale) & ~1;
+    if (*dst_frame_w < 2) {
+        *dst_frame_w = 2;
+    }
+    if (*dst_frame_h < 2) {
+        *dst_frame_h = 2;
+    }
+}
+
+void media_set_crop(Media *media, double x, double y, double w, double h) {
+    if (!media) {
+        return;
+    }
+
+    w = w > 1 ? 1 : (w < 0.01 ? 0.01 : w);
+    h = h > 1 ? 1 : (h < 0.01 ? 0.01 : h);
+    x = x < 0 ? 0 : (x > 1 - w ? 1 - w : x);
+    y = y < 0 ? 0 : (y > 1 - h ? 1 - h : y);
+
+    if (x != media->crop_x || y != media->crop_y || w != media->crop_w ||
+        h != media->crop_h) {
+        media->last_hash = 0;
+    }
+    media->crop_x = x;
+    media->crop_y = y;
+    media->crop_w = w;
+    media->crop_h = h;
+}
+
+void media_set_keep_sources(Media *media, int enabled) {
+    if (!media) {
+        return;
+    }
+
+    media->keep_sources = enabled;
+    if (!enabled) {
+        for (int i = 0; i < MEDIA_SOURCE_FRAMES; i++) {
+            av_frame_free(&media->sources[i]);
+        }
+    }
+}
+
+int media_reconvert(Media *media, int64_t pts, AVFrame **frame) {
+    *frame = NULL;
+    if (pts == AV_NOPTS_VALUE) {
+        return MEDIA_ERR_MORE_DATA;
+    }
+
+    for (int i = 0; i < MEDIA_SOURCE_FRAMES; i++) {
+        AVFrame *source = media->sources[i];
+        if (source && source->best_effort_timestamp == pts) {
+            return media_convert_frame(media, source, frame);
+        }
+    }
+
+    return MEDIA_ERR_MORE_DATA;
+}
+
+void media_scaler_release(MediaScaler *scaler) {
+    sws_freeContext(scaler->ctx);
+    for (int i = 0; i < MEDIA_MAX_SLICES - 1; i++) {
+        sws_freeContext(scaler->slice_ctx[i]);
+    }
+    *scaler = (MediaScaler){.ctx = NULL, .last_used = 0};
+}
+
+MediaScaler *media_get_scaler(Media *media, int src_w, int src_h,
+                              enum AVPixelFormat src_fmt) {
+    MediaScaler *lru = &media->scalers[0];
+    for (int i = 0; i < MEDIA_SCALERS; i++) {
+        MediaScaler *scaler = &media->scalers[i];
+        if (scaler->ctx && scaler->src_w == src_w && scaler->src_h == src_h &&
+            scaler->src_fmt == src_fmt && scaler->dst_w == media->dst_frame_w &&
+            scaler->dst_h == media->dst_frame_h &&
+            scaler->flags == media->sws_flags) {
+            scaler->last_used = ++media->scaler_clock;
+            return scaler;
+        }
+
+        if (scaler->last_used < lru->last_used) {
+            lru = scaler;
+        }
+    }
+
+    struct SwsContext *ctx = sws_getContext(
+        src_w, src_h, src_fmt, media->dst_frame_w, media->dst_frame_h,
+        media->dst_frame_fmt, media->sws_flags, NULL, NULL, NULL);
+    if (!ctx) {
+        printf("media_get_scaler: sws_getContext failed\n");
+        return NULL;
+    }
+
+    media_scaler_release(lru);
+    *lru = (MediaScaler){.ctx = ctx,
+                         .src_w = src_w,
+                         .src_h = src_h,
+                         .dst_w = media->dst_frame_w,
+                         .dst_h = media->dst_frame_h,
+                         .flags = media->sws_flags,
+                         .src_fmt = src_fmt,
+                         .last_used = ++media->scaler_clock};
+    media->scaler_builds++;
+
+    return lru;
+}
+
+int media_select_audio_track(Media *media, int track, int64_t from) {
+    if (!media) {
+        printf("media_select_audio_track: media is NULL\n");
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    if (track < 0 || track >= media->nb_audio_tracks) {
+        return MEDIA_ERR_NO_STREAM;
+    }
+    if (track == media->audio_track) {
+        return 0;
+    }
+
+    // The old track keeps playing if the new one cannot be opened.
+    int stream_index = media->audio_tracks[track];
+    AVCodecContext *codec_ctx = NULL;
+    int ret = media_open_stream(media, stream_index, &codec_ctx);
+    if (ret < 0) {
+        printf("media_select_audio_track: failed to open track %d\n", track);
+        return ret;
+    }
+
+    AVStream *old_stream = media->fmt_ctx->streams[media->audio_stream_idx];
+    AVStream *new_stream = media->fmt_ctx->streams[stream_index];
+    new_stream->discard = old_stream->discard;
+    old_stream->discard = AVDISCARD_ALL;
+
+    avcodec_free_context(&media->audio_ctx);
+    media->audio_ctx = codec_ctx;
+    media->audio_stream_idx = stream_index;
+    media->audio_track = track;
+
+    ret = media_open_resampler(media, NULL);
+    if (ret < 0) {
+        return ret;
+    }
+
+    // Audio decoded from the old track is not played anymore; the video
+    // frames stay queued.
+    fq_remove_type(media->queue, FRAME_TYPE_AUDIO);
+    filter_chain_reset(media->audio_filter);
+    if (media->pkt->stream_index != media->video_stream_idx) {
+        av_packet_unref(media->pkt);
+    }
+
+    // The demuxer goes back to the keyframe before the playing position, so
+    // the new track has packets from there on. The video decoder is left as
+    // it is and only gets the packets it did not have yet.
+    int seek_index = media->video_stream_idx >= 0 ? media->video_stream_idx
+                                                   : stream_index;
+    if (from < 0) {
+        from = 0;
+    }
+    int64_t target = av_rescale_q(
+        from, AV_TIME_BASE_Q, media->fmt_ctx->streams[seek_index]->time_base);
+
+    ret = av_seek_frame(media->fmt_ctx, seek_index, target,
+                        AVSEEK_FLAG_BACKWARD);
+    if (ret < 0) {
+        printf("media_select_audio_track: av_seek_frame failed: %s\n",
+               av_err2str(ret));
+        return MEDIA_ERR_LIBAV;
+    }
+
+    if (media->packet_cache) {
+        packet_cache_clear(media->packet_cache);
+    }
+
+    media->video_resume_dts = media->last_video_dts;
+    media->audio_resume_dts = AV_NOPTS_VALUE;
+    media->audio_skip_until =
+        av_rescale_q(from, AV_TIME_BASE_Q, new_stream->time_base);
 
     return 0;
 }
 
+void media_audio_track_name(Media *media, int track, char *name, size_t size) {
+    if (!media || track < 0 || track >= media->nb_audio_tracks) {
+        snprintf(name, size, "none");
+        return;
+    }
+
+    AVStream *stream = media->fmt_ctx->streams[media->audio_tracks[track]];
+    AVDictionaryEntry *title = av_dict_get(stream->metadata, "title", NULL, 0);
+    AVDictionaryEntry *language =
+        av_dict_get(stream->metadata, "language", NULL, 0);
+
+    if (title && language) {
+        snprintf(name, size, "%d: %s (%s)", track + 1, title->value,
+                 language->value);
+    } else if (title || language) {
+        snprintf(name, size, "%d: %s", track + 1,
+                 title ? title->value : language->value);
+    } else {
+        snprintf(name, size, "%d", track + 1);
+    }
+}
+
+void media_set_stream_enabled(Media *media, enum AVMediaType type, int enabled) {
+    if (!media) {
+        return;
+    }
+
+    int stream_index = type == AVMEDIA_TYPE_VIDEO ? media->video_stream_idx
+                                                  : media->audio_stream_idx;
+    if (stream_index < 0) {
+        return;
+    }
+
+    media->fmt_ctx->streams[stream_index]->discard =
+        enabled ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+
+    // The cached window no longer matches what the demuxer returns.
+    if (media->packet_cache) {
+        packet_cache_clear(media->packet_cache);
+    }
+}
+
 int media_get_formatted_time(Media *media, int64_t timestamp, int64_t timebase,
                              char *formatted_time) {
     if (!media) {
@@ -418,18 +1947,28 @@ void media_free(Media *media) {
     free(media->formatted_position);
 
     avformat_close_input(&media->fmt_ctx);
+    media_io_close(media->io);
+    file_watch_close(media->follow_watch);
 
     if (media->audio_ctx) {
         avcodec_free_context(&media->audio_ctx);
         swr_free(&media->swr_ctx);
+        av_channel_layout_uninit(&media->swr_in_layout);
     }
 
     if (media->video_ctx) {
         avcodec_free_context(&media->video_ctx);
-        sws_freeContext(media->sws_ctx);
     }
 
+    for (int i = 0; i < MEDIA_SCALERS; i++) {
+        media_scaler_release(&media->scalers[i]);
+    }
+    media_set_keep_sources(media, 0);
+
     av_packet_free(&media->pkt);
+    packet_cache_free(media->packet_cache);
+    filter_chain_free(media->video_filter);
+    filter_chain_free(media->audio_filter);
     fq_free(media->queue);
 
     free(media->filename);
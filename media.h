@@ -11,6 +11,11 @@
 #include <libswscale/swscale.h>
 
 #include "common.h"
+#include "file_watch.h"
+#include "filter_chain.h"
+#include "media_io.h"
+#include "packet_cache.h"
+#include "pool.h"
 #include "queue.h"
 
 #define OUT_SAMPLE_FMT AV_SAMPLE_FMT_FLT
@@ -23,6 +28,82 @@ enum MediaError {
     MEDIA_ERR_MORE_DATA = -5,
 };
 
+// Shortcuts the video decoder takes when the machine cannot keep up, from the
+// cheapest to the most visible. Each level also applies the ones before it.
+enum MediaQuality {
+    MEDIA_QUALITY_FULL,
+    // Skips the deblocking filter.
+    MEDIA_QUALITY_SKIP_LOOP_FILTER,
+    // Skips the IDCT of, and then the whole, non-reference frames.
+    MEDIA_QUALITY_SKIP_NONREF,
+    // Decodes at a lower resolution when the codec supports it, and converts
+    // with the cheapest scaler to half the output size.
+    MEDIA_QUALITY_LOWRES,
+};
+
+// Fraction of the frame interval spent decoding above which a media is
+// overloaded, or above which it is when nothing is decoded ahead.
+#define MEDIA_QUALITY_HIGH_LOAD 0.9
+#define MEDIA_QUALITY_STARVED_LOAD 0.7
+// Below this, there is room to step back up.
+#define MEDIA_QUALITY_LOW_LOAD 0.4
+
+// Consecutive frames a condition must hold before the level changes. Stepping
+// up waits longer, and the wait doubles every time a step up had to be undone.
+#define MEDIA_QUALITY_DOWN_FRAMES 15
+#define MEDIA_QUALITY_UP_FRAMES 120
+#define MEDIA_QUALITY_MAX_UP_FRAMES 3840
+
+// A video keyframe: its pts (video stream time base) and byte offset.
+typedef struct {
+    int64_t pts, pos;
+} MediaKeyframe;
+
+// Scaler contexts kept per media, one per conversion (source size and format,
+// destination size) in use. Resizing the window or a grid tile switches to
+// another entry instead of rebuilding the context every time.
+#define MEDIA_SCALERS 4
+
+// Sources of at least this many pixels are converted in horizontal slices of
+// the output on the thread pool, each slice by its own context of the scaler.
+// There are up to one slice per worker and MEDIA_MAX_SLICES, of at least
+// MEDIA_SLICE_MIN_ROWS output rows each.
+#define MEDIA_SLICE_MIN_PIXELS (2560 * 1440)
+#define MEDIA_MAX_SLICES 16
+#define MEDIA_SLICE_MIN_ROWS 32
+
+typedef struct {
+    struct SwsContext *ctx;
+    // Contexts of the slices after the first one, which uses `ctx`. Built the
+    // first time the conversion is done in slices.
+    struct SwsContext *slice_ctx[MEDIA_MAX_SLICES - 1];
+    int src_w, src_h, dst_w, dst_h, flags;
+    enum AVPixelFormat src_fmt;
+    // Value of the media's `scaler_clock` when last used, 0 if free.
+    int64_t last_used;
+} MediaScaler;
+
+// Probing limits of the fast open mode, unless others were given: bytes read,
+// and stream time analyzed (AV_TIME_BASE units).
+#define MEDIA_FAST_PROBE_SIZE (512 * 1024)
+#define MEDIA_FAST_ANALYZE_DURATION (AV_TIME_BASE / 2)
+
+// Follow mode. The demuxer stays `follow_latency` of media, by default
+// MEDIA_FOLLOW_LATENCY (AV_TIME_BASE units), behind the end of the file, so it
+// never reads a packet that is only partly written. MEDIA_FOLLOW_MIN_MARGIN
+// bytes is the least it stays behind, for when the rate is not known yet.
+// Once the file did not grow for MEDIA_FOLLOW_IDLE_TIME (seconds), it is read
+// to its end, which is then the end of the media.
+#define MEDIA_FOLLOW_MIN_MARGIN (32 * 1024)
+#define MEDIA_FOLLOW_LATENCY (AV_TIME_BASE / 2)
+#define MEDIA_FOLLOW_IDLE_TIME 5.0
+
+// Audio streams of a container that can be switched between.
+#define MEDIA_MAX_AUDIO_TRACKS 16
+
+// Decoded frames kept for media_reconvert.
+#define MEDIA_SOURCE_FRAMES 4
+
 enum SeekDirection {
     SEEK_FORWARD,
     SEEK_BACKWARD,
@@ -33,20 +114,96 @@ typedef struct Media {
 
     AVFormatContext *fmt_ctx;
 
+    // I/O layer under the format context. `io_mode` and `io_buffer_size` must
+    // be set before media_init; `io` stays NULL in MEDIA_IO_DEFAULT mode.
+    enum MediaIOMode io_mode;
+    size_t io_buffer_size;
+    MediaIO *io;
+
     int video_stream_idx, audio_stream_idx;
     AVCodecContext *audio_ctx, *video_ctx;
 
-    // Audio and video conversion contexts.
-    struct SwsContext *sws_ctx;
+    // Stream indexes of the audio tracks. `audio_track` is the selected one,
+    // the one `audio_stream_idx` and `audio_ctx` belong to.
+    int audio_tracks[MEDIA_MAX_AUDIO_TRACKS];
+    int nb_audio_tracks, audio_track;
+
+    // Sample rate audio is resampled to. It is the one of the first track and
+    // does not change with the selected track, so the audio device can stay
+    // open.
+    int out_sample_rate;
+
+    // Set while `out_sample_rate` is only the rate the container gives, in
+    // fast open mode. The first decoded frame has the real one, e.g. twice
+    // the container's for HE-AAC with implicit SBR.
+    int out_sample_rate_guessed;
+
+    // Audio and video conversion contexts. Scalers are built on demand, for
+    // the size the decoded frames have; `scaler_builds` counts how many were.
+    MediaScaler scalers[MEDIA_SCALERS];
+    int64_t scaler_clock, scaler_builds;
+
+    // Most threads a conversion in slices uses: 0 for one per pool worker, 1
+    // to never convert in slices.
+    int slice_threads;
     struct SwrContext *swr_ctx;
 
+    // Input the resampler was built for.
+    int swr_in_rate, swr_in_fmt;
+    AVChannelLayout swr_in_layout;
+
+    // Filters run on the decoded frames before they are converted, described
+    // like ffmpeg's -vf and -af options. Set before media_init. Without video
+    // filters and with `deinterlace` set, interlaced video goes through
+    // FILTER_CHAIN_DEINTERLACE from its first interlaced frame on. Filters
+    // that cannot be built are dropped, and the frames go on unfiltered.
+    const char *video_filters, *audio_filters;
+    int deinterlace;
+    FilterChain *video_filter, *audio_filter;
+
+    // Part of the video frames that is converted, as fractions of their size.
+    // While `keep_sources` is set, the last decoded frames are kept, so the
+    // one on screen can be converted again with another crop.
+    double crop_x, crop_y, crop_w, crop_h;
+    int keep_sources;
+    AVFrame *sources[MEDIA_SOURCE_FRAMES];
+    int source_next;
+
     // These variables will be used to scale the video frames.
     int dst_frame_w, dst_frame_h;
     enum AVPixelFormat dst_frame_fmt;
 
+    // Size given to media_set_output_size. From MEDIA_QUALITY_LOWRES on, the
+    // frames are converted to half of it.
+    int output_w, output_h;
+
     // This allows us to correctly seek frames on the media.
     int64_t position;
 
+    // Position of the last read packet, in AV_TIME_BASE units. Unlike
+    // `position`, this does not depend on the time base of each stream.
+    int64_t current_ts;
+
+    // When set (in video stream time base), decoded video frames that end
+    // before this timestamp are dropped without being converted. Used for
+    // frame-accurate seeking.
+    int64_t skip_until;
+
+    // Set after an audio track switch. Audio frames that end before
+    // `audio_skip_until` (audio stream time base) are dropped, and so are the
+    // video packets up to `video_resume_dts`, which were already decoded
+    // before the switch. `last_video_dts` is the last video packet read.
+    int64_t audio_skip_until, video_resume_dts, last_video_dts;
+
+    // Set after the video decoder was reopened, which goes back to the
+    // keyframe before the last decoded frame. Decoded video frames that end
+    // by `video_skip_until` (video stream time base) were queued already and
+    // are dropped, and so are the audio packets up to `audio_resume_dts`.
+    // `last_video_end` is where the last decoded video frame ends,
+    // `last_audio_dts` the last audio packet read.
+    int64_t video_skip_until, last_video_end;
+    int64_t audio_resume_dts, last_audio_dts;
+
     // Duration times in string format
     char *formatted_duration;
     char *formatted_position;
@@ -56,19 +213,171 @@ typedef struct Media {
 
     // Auxiliary context used to decode packets.
     AVPacket *pkt;
+
+    // Recently read packets, kept to serve short backward seeks. Created by
+    // media_init when `packet_cache_seconds` was set before it.
+    int packet_cache_seconds;
+    PacketCache *packet_cache;
+
+    // When set before media_init, the streams are taken as the container
+    // header describes them, without avformat_find_stream_info.
+    int skip_stream_info;
+
+    // Fast open mode, set before media_init: probing is skipped when the
+    // header gives the codec parameters of every stream, and bounded
+    // otherwise, and the audio decoder is only opened for the first audio
+    // packet. `probe_size` and `analyze_duration` bound probing in any mode
+    // when not 0.
+    int fast_open;
+    int64_t probe_size, analyze_duration;
+
+    // How long media_init spent opening the container and probing it
+    // (seconds), and whether it probed.
+    double open_time, probe_time;
+    int probed;
+
+    // Follow mode, set before media_init, for files still being written: the
+    // end of the file only means waiting for more, media_read_frame returns
+    // MEDIA_ERR_MORE_DATA until there is, and the duration grows with what was
+    // read. It always uses MEDIA_IO_DEFAULT. `follow_latency` is how much
+    // media the demuxer stays behind the end of the file (AV_TIME_BASE units).
+    int follow;
+    int64_t follow_latency;
+    FileWatch *follow_watch;
+
+    // Size of the file when last checked, when it last grew (seconds, on the
+    // av_gettime_relative clock), and whether its writer closed it since.
+    int64_t follow_size;
+    double follow_grown;
+    int follow_closed;
+
+    // Fairness counters for the work done for this media on the thread pool.
+    PoolOwner pool_owner;
+
+    // Adaptive quality. `decode_time` is a moving average of the time spent
+    // decoding and converting a video packet (seconds), `skip_frame` is what
+    // the decoder discards at the current level, and `sws_flags` the scaler it
+    // converts with. The counters are in frames; `quality_raised` tells
+    // whether the last change was a step up.
+    enum MediaQuality quality;
+    double decode_time;
+    int quality_over, quality_under, quality_up_frames;
+    int quality_frames, quality_raised;
+    enum AVDiscard skip_frame;
+    int sws_flags;
+
+    // Set after the video decoder was reopened, until the next keyframe. Only
+    // matters when the demuxer could not go back to one.
+    int wait_keyframe;
+
+    // When set, a decoded video frame hashing like the previous one is not
+    // converted, and a FRAME_TYPE_REPEAT is queued instead. `last_hash` is
+    // that of the previous frame, 0 after anything that makes the next one
+    // worth converting anyway (a seek, another output size or crop).
+    int skip_duplicates;
+    uint64_t last_hash;
+    int64_t duplicates;
 } Media;
 
 Media *media_alloc();
 
+int media_open_stream(Media *media, int stream_index, AVCodecContext **ctx);
 int media_open_context(Media *media, enum AVMediaType type);
+int media_open_resampler(Media *media, const AVFrame *frame);
+
+// Opens the decoder of the selected audio track, and what converts its frames.
+// Done by media_init, or for the first audio packet in fast open mode.
+int media_open_audio(Media *media);
 int media_init(Media *media, int dst_frame_w, int dst_frame_h,
                enum AVPixelFormat dst_frame_fmt, const char *filename);
 
-// Sends the packet to the decoder appropriate.
+// Sends the packet to the decoder appropriate. In follow mode, returns
+// MEDIA_ERR_MORE_DATA when the next packets are not written yet, and
+// MEDIA_ERR_EOF only once the writer closed the file or stopped writing.
 int media_read_frame(Media *media);
 int media_decode(Media *media);
+// Converts and queues every frame the decoder has ready.
+int media_receive_frames(Media *media, AVCodecContext *codec_ctx, int is_video);
 int media_seek(Media *media, int64_t incr, enum SeekDirection direction);
 
+// Seeks to the keyframe at or before `timestamp` (AV_TIME_BASE units), and
+// drops every frame that was already decoded.
+int media_seek_to(Media *media, int64_t timestamp);
+
+// Seeks to `timestamp` and decodes the first video frame to be displayed
+// there. When `accurate` is zero, the keyframe before the target is returned
+// as soon as it is decoded; otherwise the frame covering `timestamp` is, and
+// the audio decoded from `timestamp` on is left in the queue.
+// The returned frame must be freed by the caller.
+int media_seek_frame(Media *media, int64_t timestamp, int accurate,
+                     AVFrame **frame);
+
+// Returns the timestamp (AV_TIME_BASE units) of the video keyframe at or
+// before `timestamp`, or `timestamp` itself if the container has no index.
+int64_t media_keyframe_before(Media *media, int64_t timestamp);
+
+// Fills the index of the video stream, when the container has none, so
+// seeks and media_keyframe_before can use it.
+int media_add_keyframes(Media *media, const MediaKeyframe *keyframes,
+                        int count);
+
+// Makes the video decoder discard everything but keyframes.
+void media_set_keyframes_only(Media *media, int enabled);
+
+// Changes the size video frames are converted to. Frames already queued keep
+// their old size.
+int media_set_output_size(Media *media, int dst_frame_w, int dst_frame_h);
+
+// Largest size with the display aspect ratio of the video that fits in
+// `box_w` x `box_h`, but never larger than the video itself: scaling up is
+// left to whoever draws the frames.
+void media_fit_output_size(Media *media, int box_w, int box_h, int *dst_frame_w,
+                           int *dst_frame_h);
+
+// Hash of the visible pixels of a decoded video frame, or 0 for frames that
+// cannot be hashed.
+uint64_t media_frame_hash(const AVFrame *frame);
+
+// Crops and scales a decoded video frame to the output size and format.
+int media_convert_frame(Media *media, AVFrame *frame, AVFrame **out);
+
+// Converts only the given part of the video frames from now on (fractions of
+// their size). The crop can change with every frame; only a change of its size
+// needs another scaler.
+void media_set_crop(Media *media, double x, double y, double w, double h);
+
+void media_set_keep_sources(Media *media, int enabled);
+
+// Converts again the kept frame with the given pts (video stream time base).
+// Returns MEDIA_ERR_MORE_DATA if it is not kept, and it has to be decoded.
+int media_reconvert(Media *media, int64_t pts, AVFrame **frame);
+
+// Returns the scaler converting `src_w` x `src_h` frames in `src_fmt` to the
+// current output size, building it if none of the cached ones does.
+MediaScaler *media_get_scaler(Media *media, int src_w, int src_h,
+                              enum AVPixelFormat src_fmt);
+
+// Switches to another audio track. The new track is decoded from the keyframe
+// before `from` (AV_TIME_BASE units), which should be the position playing
+// now: audio before it and the video frames that were already decoded are
+// dropped, so the switch is heard without a jump of the video.
+int media_select_audio_track(Media *media, int track, int64_t from);
+
+// Writes a name for the track from its title and language tags.
+void media_audio_track_name(Media *media, int track, char *name, size_t size);
+
+// Makes the demuxer drop (or keep again) every packet of the given stream.
+void media_set_stream_enabled(Media *media, enum AVMediaType type, int enabled);
+
+enum MediaQuality media_get_quality(Media *media);
+const char *media_quality_name(enum MediaQuality quality);
+void media_set_quality(Media *media, enum MediaQuality quality);
+
+// Feeds the quality controller after a video frame was shown. `queued` is how
+// many video frames are already decoded ahead of it. Returns the level to use
+// from now on.
+enum MediaQuality media_update_quality(Media *media, int queued);
+
 int media_get_formatted_time(Media *media, int64_t timestamp, int64_t timebase,
                              char *formatted_time);
 
@@ -0,0 +1,382 @@
+#include "media_io.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libavutil/mem.h>
+#include <libavutil/time.h>
+
+// A read served from the map that takes longer than this (microseconds) had
+// to fault pages in from the disk.
+#define MEDIA_IO_MMAP_STALL_TIME 1000
+
+enum MediaIOMode media_io_mode_from_string(const char *name) {
+    if (!name) {
+        return MEDIA_IO_DEFAULT;
+    }
+
+    if (strcmp(name, "readahead") == 0) {
+        return MEDIA_IO_READAHEAD;
+    } else if (strcmp(name, "mmap") == 0) {
+        return MEDIA_IO_MMAP;
+    }
+
+    return MEDIA_IO_DEFAULT;
+}
+
+// Hints the kernel that `len` bytes from `offset` are about to be read.
+void media_io_advise(MediaIO *io, int64_t offset, int64_t len) {
+#ifdef POSIX_FADV_WILLNEED
+    posix_fadvise(io->fd, offset, len, POSIX_FADV_WILLNEED);
+#else
+    (void)io;
+    (void)offset;
+    (void)len;
+#endif
+}
+
+// Moves the read-ahead window to `pos`. Must be called with the lock held.
+void media_io_reset_window(MediaIO *io, int64_t pos) {
+    io->window_start = pos;
+    io->head = 0;
+    io->fill = 0;
+    io->eof = 0;
+    io->error = 0;
+    io->generation++;
+
+    media_io_advise(io, pos, io->ring_size);
+    pthread_cond_broadcast(&io->cond);
+}
+
+void *media_io_readahead(void *arg) {
+    MediaIO *io = arg;
+
+    pthread_mutex_lock(&io->lock);
+    while (io->running) {
+        // Keep a quarter of the ring behind the demuxer for short backward
+        // seeks, and reclaim the rest once the ring is full.
+        if (io->fill == io->ring_size && io->pos > io->window_start) {
+            size_t consumed = io->pos - io->window_start;
+            size_t keep = io->ring_size / 4;
+            if (consumed > io->fill) {
+                consumed = io->fill;
+            }
+
+            if (consumed > keep) {
+                size_t drop = consumed - keep;
+                io->head = (io->head + drop) % io->ring_size;
+                io->fill -= drop;
+                io->window_start += drop;
+            }
+        }
+
+        if (io->fill == io->ring_size || io->eof || io->error) {
+            pthread_cond_wait(&io->cond, &io->lock);
+            continue;
+        }
+
+        size_t tail = (io->head + io->fill) % io->ring_size;
+        size_t chunk = io->ring_size - io->fill;
+        if (chunk > io->ring_size - tail) {
+            chunk = io->ring_size - tail;
+        }
+        if (chunk > MEDIA_IO_CHUNK_SIZE) {
+            chunk = MEDIA_IO_CHUNK_SIZE;
+        }
+
+        int64_t offset = io->window_start + io->fill;
+        int generation = io->generation;
+
+        // The demuxer never reads past `fill`, so the free part of the ring
+        // can be written without holding the lock.
+        pthread_mutex_unlock(&io->lock);
+        ssize_t n = pread(io->fd, io->ring + tail, chunk, offset);
+        int err = errno;
+        pthread_mutex_lock(&io->lock);
+
+        if (generation != io->generation) {
+            continue;
+        }
+
+        if (n < 0) {
+            if (err != EINTR) {
+                io->error = 1;
+            }
+        } else if (n == 0) {
+            io->eof = 1;
+        } else {
+            io->fill += n;
+        }
+
+        pthread_cond_broadcast(&io->cond);
+    }
+    pthread_mutex_unlock(&io->lock);
+
+    return NULL;
+}
+
+int media_io_read_mmap(MediaIO *io, uint8_t *buf, int buf_size) {
+    if (io->pos >= io->size) {
+        return AVERROR_EOF;
+    }
+
+    int64_t n = io->size - io->pos;
+    if (n > buf_size) {
+        n = buf_size;
+    }
+
+    int64_t start = av_gettime_relative();
+    memcpy(buf, io->map + io->pos, n);
+    int64_t elapsed = av_gettime_relative() - start;
+
+    io->pos += n;
+    io->stats.bytes_read += n;
+    if (elapsed > MEDIA_IO_MMAP_STALL_TIME) {
+        io->stats.stalls++;
+        io->stats.stall_time += elapsed;
+    }
+
+    return n;
+}
+
+int media_io_read_ring(MediaIO *io, uint8_t *buf, int buf_size) {
+    pthread_mutex_lock(&io->lock);
+
+    if (io->pos < io->window_start ||
+        io->pos > io->window_start + (int64_t)io->fill) {
+        media_io_reset_window(io, io->pos);
+    }
+
+    int64_t start = 0;
+    while (io->pos == io->window_start + (int64_t)io->fill && !io->eof &&
+           !io->error) {
+        if (!start) {
+            start = av_gettime_relative();
+            io->stats.stalls++;
+        }
+        pthread_cond_wait(&io->cond, &io->lock);
+    }
+    if (start) {
+        io->stats.stall_time += av_gettime_relative() - start;
+    }
+
+    size_t available = io->window_start + io->fill - io->pos;
+    if (available == 0) {
+        int error = io->error;
+        pthread_mutex_unlock(&io->lock);
+        return error ? AVERROR(EIO) : AVERROR_EOF;
+    }
+
+    size_t n = available < (size_t)buf_size ? available : (size_t)buf_size;
+    size_t offset = (io->head + (io->pos - io->window_start)) % io->ring_size;
+    size_t first = n < io->ring_size - offset ? n : io->ring_size - offset;
+
+    memcpy(buf, io->ring + offset, first);
+    memcpy(buf + first, io->ring, n - first);
+
+    io->pos += n;
+    io->stats.bytes_read += n;
+
+    // The thread may be waiting for room in the ring.
+    pthread_cond_broadcast(&io->cond);
+    pthread_mutex_unlock(&io->lock);
+
+    return n;
+}
+
+int media_io_read(void *opaque, uint8_t *buf, int buf_size) {
+    MediaIO *io = opaque;
+
+    if (io->mode == MEDIA_IO_MMAP) {
+        return media_io_read_mmap(io, buf, buf_size);
+    }
+
+    return media_io_read_ring(io, buf, buf_size);
+}
+
+int64_t media_io_seek(void *opaque, int64_t offset, int whence) {
+    MediaIO *io = opaque;
+
+    if (whence & AVSEEK_SIZE) {
+        return io->size;
+    }
+
+    int64_t pos;
+    switch (whence & ~AVSEEK_FORCE) {
+    case SEEK_SET:
+        pos = offset;
+        break;
+    case SEEK_CUR:
+        pos = io->pos + offset;
+        break;
+    case SEEK_END:
+        pos = io->size + offset;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+
+    if (pos < 0) {
+        return AVERROR(EINVAL);
+    }
+
+    // The window itself is only moved by the next read, if needed.
+    pthread_mutex_lock(&io->lock);
+    io->pos = pos;
+    pthread_mutex_unlock(&io->lock);
+
+    return pos;
+}
+
+MediaIO *media_io_open(const char *filename, enum MediaIOMode mode,
+                       size_t buffer_size) {
+    if (mode == MEDIA_IO_DEFAULT) {
+        printf("media_io_open: default mode does not need a custom context\n");
+        return NULL;
+    }
+
+    MediaIO *io = malloc(sizeof(MediaIO));
+    if (!io) {
+        return NULL;
+    }
+
+    io->mode = mode;
+    io->fd = -1;
+    io->size = 0;
+    io->pos = 0;
+    io->map = NULL;
+    io->ring = NULL;
+    io->ring_size = buffer_size ? buffer_size : MEDIA_IO_READAHEAD_SIZE;
+    io->head = 0;
+    io->fill = 0;
+    io->window_start = 0;
+    io->generation = 0;
+    io->eof = 0;
+    io->error = 0;
+    io->running = 0;
+    io->stats = (MediaIOStats){0};
+    io->avio = NULL;
+
+    pthread_mutex_init(&io->lock, NULL);
+    pthread_cond_init(&io->cond, NULL);
+
+    io->fd = open(filename, O_RDONLY);
+    if (io->fd < 0) {
+        printf("media_io_open: failed to open %s: %s\n", filename,
+               strerror(errno));
+        media_io_close(io);
+        return NULL;
+    }
+
+    struct stat st;
+    if (fstat(io->fd, &st) < 0) {
+        printf("media_io_open: fstat failed: %s\n", strerror(errno));
+        media_io_close(io);
+        return NULL;
+    }
+    io->size = st.st_size;
+
+    if (io->mode == MEDIA_IO_MMAP) {
+        void *map = io->size > 0 ? mmap(NULL, io->size, PROT_READ, MAP_PRIVATE,
+                                        io->fd, 0)
+                                 : MAP_FAILED;
+        if (map == MAP_FAILED) {
+            // Not every file can be mapped (pipes, some network filesystems).
+            printf("media_io_open: mmap failed, reading ahead instead\n");
+            io->mode = MEDIA_IO_READAHEAD;
+        } else {
+            io->map = map;
+            posix_madvise(io->map, io->size, POSIX_MADV_SEQUENTIAL);
+        }
+    }
+
+    if (io->mode == MEDIA_IO_READAHEAD) {
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(io->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+#ifdef F_RDAHEAD
+        fcntl(io->fd, F_RDAHEAD, 1);
+#endif
+
+        io->ring = malloc(io->ring_size);
+        if (!io->ring) {
+            printf("media_io_open: failed to allocate read-ahead buffer\n");
+            media_io_close(io);
+            return NULL;
+        }
+
+        media_io_advise(io, 0, io->ring_size);
+
+        io->running = 1;
+        if (pthread_create(&io->thread, NULL, media_io_readahead, io) != 0) {
+            printf("media_io_open: pthread_create failed\n");
+            io->running = 0;
+            media_io_close(io);
+            return NULL;
+        }
+    }
+
+    uint8_t *avio_buffer = av_malloc(MEDIA_IO_AVIO_BUFFER_SIZE);
+    if (!avio_buffer) {
+        media_io_close(io);
+        return NULL;
+    }
+
+    io->avio = avio_alloc_context(avio_buffer, MEDIA_IO_AVIO_BUFFER_SIZE, 0, io,
+                                  media_io_read, NULL, media_io_seek);
+    if (!io->avio) {
+        printf("media_io_open: avio_alloc_context failed\n");
+        av_free(avio_buffer);
+        media_io_close(io);
+        return NULL;
+    }
+
+    return io;
+}
+
+void media_io_get_stats(MediaIO *io, MediaIOStats *stats) {
+    pthread_mutex_lock(&io->lock);
+    *stats = io->stats;
+    pthread_mutex_unlock(&io->lock);
+}
+
+void media_io_close(MediaIO *io) {
+    if (!io) {
+        return;
+    }
+
+    if (io->running) {
+        pthread_mutex_lock(&io->lock);
+        io->running = 0;
+        pthread_cond_broadcast(&io->cond);
+        pthread_mutex_unlock(&io->lock);
+
+        pthread_join(io->thread, NULL);
+    }
+
+    if (io->avio) {
+        // libavformat may have replaced the buffer we gave it.
+        av_freep(&io->avio->buffer);
+        avio_context_free(&io->avio);
+    }
+
+    if (io->map) {
+        munmap(io->map, io->size);
+    }
+    free(io->ring);
+
+    if (io->fd >= 0) {
+        close(io->fd);
+    }
+
+    pthread_mutex_destroy(&io->lock);
+    pthread_cond_destroy(&io->cond);
+
+    free(io);
+}
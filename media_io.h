@@ -0,0 +1,79 @@
+// Custom I/O layer used under the AVFormatContext of a media. Instead of the
+// small synchronous reads done by the default file protocol, data is either
+// read ahead into a large ring buffer by a background thread, or mapped into
+// memory for local files. Both modes count how many bytes were read and how
+// long the demuxer had to wait for them.
+#ifndef MEDIA_IO_H
+#define MEDIA_IO_H
+
+#include <pthread.h>
+
+#include <libavformat/avformat.h>
+#include <libavformat/avio.h>
+
+#define MEDIA_IO_READAHEAD_SIZE (8 * 1024 * 1024)
+#define MEDIA_IO_CHUNK_SIZE (512 * 1024)
+#define MEDIA_IO_AVIO_BUFFER_SIZE (64 * 1024)
+
+enum MediaIOMode {
+    // Let libavformat open the file with its own protocol.
+    MEDIA_IO_DEFAULT,
+    // Reads ahead of the demuxer from a background thread.
+    MEDIA_IO_READAHEAD,
+    // Maps the whole file into memory.
+    MEDIA_IO_MMAP,
+};
+
+typedef struct {
+    int64_t bytes_read;
+
+    // How many reads had to wait for data, and for how long (microseconds).
+    int64_t stalls;
+    int64_t stall_time;
+} MediaIOStats;
+
+typedef struct MediaIO {
+    enum MediaIOMode mode;
+
+    int fd;
+    int64_t size;
+
+    // Position of the demuxer in the file.
+    int64_t pos;
+
+    // Mapped file, for MEDIA_IO_MMAP.
+    uint8_t *map;
+
+    // Ring buffer holding the file window [window_start, window_start + fill),
+    // starting at `head`. It is filled by the read-ahead thread.
+    uint8_t *ring;
+    size_t ring_size, head, fill;
+    int64_t window_start;
+
+    // Bumped on every seek out of the window, so the data the thread read for
+    // the old window is dropped.
+    int generation;
+    int eof, error, running;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    MediaIOStats stats;
+
+    AVIOContext *avio;
+} MediaIO;
+
+// Parses a mode name ("default", "readahead" or "mmap").
+enum MediaIOMode media_io_mode_from_string(const char *name);
+
+// Opens `filename` with the given mode. `buffer_size` is the read-ahead size
+// in bytes, or 0 for MEDIA_IO_READAHEAD_SIZE.
+MediaIO *media_io_open(const char *filename, enum MediaIOMode mode,
+                       size_t buffer_size);
+
+void media_io_get_stats(MediaIO *io, MediaIOStats *stats);
+
+void media_io_close(MediaIO *io);
+
+#endif  // MEDIA_IO_H
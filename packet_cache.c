@@ -0,0 +1,157 @@
+#include "packet_cache.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "media.h"
+
+PacketCache *packet_cache_alloc(int seconds, size_t max_bytes) {
+    PacketCache *cache = malloc(sizeof(PacketCache));
+    if (!cache) {
+        return NULL;
+    }
+
+    cache->entries = NULL;
+    cache->head = 0;
+    cache->count = 0;
+    cache->capacity = 0;
+    cache->bytes = 0;
+    cache->max_bytes = max_bytes;
+    cache->window = (int64_t)seconds * AV_TIME_BASE;
+
+    cache->read_pos = 0;
+
+    cache->hits = 0;
+    cache->misses = 0;
+
+    return cache;
+}
+
+void packet_cache_drop_oldest(PacketCache *cache) {
+    PacketEntry *entry = &cache->entries[cache->head++];
+    cache->bytes -= entry->pkt->size;
+    av_packet_free(&entry->pkt);
+
+    if (cache->read_pos < cache->head) {
+        cache->read_pos = cache->head;
+    }
+}
+
+int packet_cache_add(PacketCache *cache, AVPacket *pkt, int64_t ts) {
+    // Packets are only added while reading from the demuxer, never while the
+    // cached ones are being handed out again.
+    if (cache->read_pos != cache->count) {
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    if (ts == AV_NOPTS_VALUE) {
+        ts = cache->count > cache->head ? cache->entries[cache->count - 1].ts
+                                        : 0;
+    }
+
+    while (cache->count > cache->head &&
+           (ts - cache->entries[cache->head].ts > cache->window ||
+            cache->bytes + pkt->size > cache->max_bytes)) {
+        packet_cache_drop_oldest(cache);
+    }
+
+    if (cache->count == cache->capacity) {
+        if (cache->head > 0) {
+            // Reuse the slots of the packets dropped so far.
+            cache->count -= cache->head;
+            memmove(cache->entries, cache->entries + cache->head,
+                    cache->count * sizeof(PacketEntry));
+            cache->head = 0;
+        }
+
+        if (cache->count == cache->capacity) {
+            int capacity = cache->capacity ? cache->capacity * 2 : 1024;
+            PacketEntry *entries =
+                realloc(cache->entries, capacity * sizeof(PacketEntry));
+            if (!entries) {
+                printf("packet_cache_add: failed to grow the cache\n");
+                return MEDIA_ERR_INTERNAL;
+            }
+
+            cache->entries = entries;
+            cache->capacity = capacity;
+        }
+    }
+
+    AVPacket *ref = av_packet_clone(pkt);
+    if (!ref) {
+        printf("packet_cache_add: av_packet_clone failed\n");
+        return MEDIA_ERR_LIBAV;
+    }
+
+    cache->entries[cache->count++] = (PacketEntry){.pkt = ref, .ts = ts};
+    cache->bytes += ref->size;
+    cache->read_pos = cache->count;
+
+    return 0;
+}
+
+int packet_cache_seek(PacketCache *cache, int stream_index, int64_t timestamp) {
+    // Past the newest packet, the target is only reachable by reading on.
+    if (cache->count == cache->head ||
+        timestamp > cache->entries[cache->count - 1].ts) {
+        cache->misses++;
+        return MEDIA_ERR_EOF;
+    }
+
+    for (int i = cache->count - 1; i >= cache->head; i--) {
+        AVPacket *pkt = cache->entries[i].pkt;
+        if (pkt->stream_index == stream_index &&
+            (pkt->flags & AV_PKT_FLAG_KEY) && cache->entries[i].ts <= timestamp) {
+            cache->read_pos = i;
+            cache->hits++;
+            return 0;
+        }
+    }
+
+    cache->misses++;
+    return MEDIA_ERR_EOF;
+}
+
+int packet_cache_read(PacketCache *cache, AVPacket *pkt) {
+    if (cache->read_pos >= cache->count) {
+        return MEDIA_ERR_EOF;
+    }
+
+    int ret = av_packet_ref(pkt, cache->entries[cache->read_pos].pkt);
+    if (ret < 0) {
+        printf("packet_cache_read: av_packet_ref failed: %s\n", av_err2str(ret));
+        return MEDIA_ERR_LIBAV;
+    }
+
+    cache->read_pos++;
+
+    return 0;
+}
+
+void packet_cache_clear(PacketCache *cache) {
+    for (int i = cache->head; i < cache->count; i++) {
+        av_packet_free(&cache->entries[i].pkt);
+    }
+
+    cache->head = 0;
+    cache->count = 0;
+    cache->bytes = 0;
+    cache->read_pos = 0;
+}
+
+double packet_cache_hit_rate(PacketCache *cache) {
+    int64_t seeks = cache->hits + cache->misses;
+    return seeks ? (double)cache->hits / seeks : 0;
+}
+
+void packet_cache_free(PacketCache *cache) {
+    if (!cache) {
+        return;
+    }
+
+    packet_cache_clear(cache);
+    free(cache->entries);
+    free(cache);
+}
@@ -0,0 +1,60 @@
+// Rolling window of the packets most recently read from a container. Every
+// packet the demuxer returns is kept by reference, and the oldest ones are
+// dropped once the window spans more than `seconds` or holds more than
+// `max_bytes`. The window always ends at the current position of the demuxer,
+// so a seek to a keyframe inside it can be served by handing the cached
+// packets out again, and reading from the container resumes after the last of
+// them without any I/O or container seek.
+#ifndef PACKET_CACHE_H
+#define PACKET_CACHE_H
+
+#include <libavcodec/avcodec.h>
+
+#define PACKET_CACHE_SECONDS 10
+#define PACKET_CACHE_MAX_BYTES (64 * 1024 * 1024)
+
+typedef struct {
+    AVPacket *pkt;
+    // Presentation time in AV_TIME_BASE units, or of the previous packet when
+    // this one has none.
+    int64_t ts;
+} PacketEntry;
+
+typedef struct PacketCache {
+    // Packets live in entries[head, count), oldest first.
+    PacketEntry *entries;
+    int head, count, capacity;
+    size_t bytes, max_bytes;
+    int64_t window;
+
+    // Index of the next packet to hand out again after a seek; equal to
+    // `count` while packets come from the demuxer.
+    int read_pos;
+
+    // Seeks served from the cache, and those that were not.
+    int64_t hits, misses;
+} PacketCache;
+
+PacketCache *packet_cache_alloc(int seconds, size_t max_bytes);
+
+// Keeps a reference to a packet that was just read from the demuxer. `ts` is
+// its presentation time in AV_TIME_BASE units, or AV_NOPTS_VALUE.
+int packet_cache_add(PacketCache *cache, AVPacket *pkt, int64_t ts);
+
+// Moves the read position to the last keyframe of `stream_index` at or before
+// `timestamp` (AV_TIME_BASE units). Returns a negative value, and counts a
+// miss, when the window does not cover `timestamp`.
+int packet_cache_seek(PacketCache *cache, int stream_index, int64_t timestamp);
+
+// Makes `pkt` a new reference to the packet at the read position. Returns a
+// negative value once the read position caught up with the demuxer.
+int packet_cache_read(PacketCache *cache, AVPacket *pkt);
+
+// Drops every packet, e.g. after the demuxer moved elsewhere.
+void packet_cache_clear(PacketCache *cache);
+
+double packet_cache_hit_rate(PacketCache *cache);
+
+void packet_cache_free(PacketCache *cache);
+
+#endif  // PACKET_CACHE_H
@@ -0,0 +1,403 @@
+#include "pool.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include <libavutil/cpu.h>
+#include <libavutil/time.h>
+
+static Pool *pool_global_instance = NULL;
+
+// Worker running on the calling thread, if it is one.
+static __thread PoolWorker *pool_current_worker = NULL;
+
+// Priority of the task running on the calling thread, or -1.
+static __thread int pool_current_priority = -1;
+
+void pool_owner_init(PoolOwner *owner) {
+    atomic_init(&owner->run_time, 0);
+    atomic_init(&owner->tasks, 0);
+    atomic_init(&owner->affinity, -1);
+}
+
+void pool_group_init(PoolGroup *group) {
+    group->pending = 0;
+    pthread_mutex_init(&group->lock, NULL);
+    pthread_cond_init(&group->cond, NULL);
+}
+
+int pool_group_busy(PoolGroup *group) {
+    pthread_mutex_lock(&group->lock);
+    int busy = group->pending > 0;
+    pthread_mutex_unlock(&group->lock);
+
+    return busy;
+}
+
+void pool_group_destroy(PoolGroup *group) {
+    pthread_mutex_destroy(&group->lock);
+    pthread_cond_destroy(&group->cond);
+}
+
+// Whether `a` should run before `b`.
+int pool_task_before(PoolTask *a, PoolTask *b) {
+    if (a->priority != b->priority) {
+        return a->priority < b->priority;
+    }
+
+    if (a->deadline != b->deadline &&
+        (a->deadline == POOL_NO_DEADLINE || b->deadline == POOL_NO_DEADLINE ||
+         llabs(a->deadline - b->deadline) > POOL_DEADLINE_SLACK)) {
+        return a->deadline < b->deadline;
+    }
+
+    int64_t a_time = a->owner ? atomic_load(&a->owner->run_time) : 0;
+    int64_t b_time = b->owner ? atomic_load(&b->owner->run_time) : 0;
+    return a_time < b_time;
+}
+
+// Whether a thread waiting on `group` may run the task: tasks of the group,
+// and the others only if they are at least as urgent as `priority`. Without
+// a group, every task is.
+int pool_task_eligible(PoolTask *task, PoolGroup *group, int priority) {
+    return !group || task->group == group || (int)task->priority <= priority;
+}
+
+// Index of the most urgent eligible task of the worker, or -1. Must be called
+// with the worker lock held.
+int pool_worker_best(PoolWorker *worker, PoolGroup *group, int priority) {
+    int best = -1;
+    for (int i = 0; i < worker->count; i++) {
+        if (!pool_task_eligible(&worker->tasks[i], group, priority)) {
+            continue;
+        }
+        if (best < 0 || pool_task_before(&worker->tasks[i], &worker->tasks[best])) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+// Removes the most urgent eligible task of the worker. Returns 0 if it had
+// none.
+int pool_worker_pop(PoolWorker *worker, PoolGroup *group, int priority,
+                    PoolTask *task) {
+    pthread_mutex_lock(&worker->lock);
+
+    int best = pool_worker_best(worker, group, priority);
+    if (best < 0) {
+        pthread_mutex_unlock(&worker->lock);
+        return 0;
+    }
+
+    *task = worker->tasks[best];
+    worker->tasks[best] = worker->tasks[--worker->count];
+    pthread_mutex_unlock(&worker->lock);
+
+    return 1;
+}
+
+// Takes a task for the worker at `self` (-1 for threads outside the pool):
+// first from its own queue, then the most urgent one of all the others. Only
+// tasks pool_task_eligible for `group` and `priority` are taken.
+int pool_take(Pool *pool, int self, PoolGroup *group, int priority,
+              PoolTask *task) {
+    int found = self >= 0 &&
+                pool_worker_pop(&pool->workers[self], group, priority, task);
+
+    if (!found) {
+        int victim = -1;
+        PoolTask candidate;
+
+        for (int i = 0; i < pool->nb_workers; i++) {
+            if (i == self) {
+                continue;
+            }
+
+            PoolWorker *worker = &pool->workers[i];
+            pthread_mutex_lock(&worker->lock);
+            int best = pool_worker_best(worker, group, priority);
+            if (best >= 0 &&
+                (victim < 0 || pool_task_before(&worker->tasks[best], &candidate))) {
+                candidate = worker->tasks[best];
+                victim = i;
+            }
+            pthread_mutex_unlock(&worker->lock);
+        }
+
+        // The victim queue may have changed since, so take whatever is the
+        // most urgent there now.
+        found = victim >= 0 && pool_worker_pop(&pool->workers[victim], group,
+                                                priority, task);
+        if (found && self >= 0) {
+            pool->workers[self].steals++;
+        }
+    }
+
+    if (found) {
+        pthread_mutex_lock(&pool->lock);
+        pool->pending--;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return found;
+}
+
+void pool_run(PoolTask *task) {
+    // Tasks can wait on groups themselves, which runs other tasks from here.
+    int priority = pool_current_priority;
+    pool_current_priority = task->priority;
+
+    int64_t start = av_gettime_relative();
+    task->run(task->arg);
+    int64_t elapsed = av_gettime_relative() - start;
+
+    pool_current_priority = priority;
+
+    if (task->owner) {
+        atomic_fetch_add(&task->owner->run_time, elapsed);
+        atomic_fetch_add(&task->owner->tasks, 1);
+    }
+
+    if (task->group) {
+        pthread_mutex_lock(&task->group->lock);
+        task->group->pending--;
+        pthread_cond_broadcast(&task->group->cond);
+        pthread_mutex_unlock(&task->group->lock);
+    }
+}
+
+void *pool_worker_main(void *arg) {
+    PoolWorker *worker = arg;
+    Pool *pool = worker->pool;
+
+    pool_current_worker = worker;
+
+    while (1) {
+        PoolTask task;
+        if (pool_take(pool, worker->index, NULL, -1, &task)) {
+            pool_run(&task);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        while (pool->pending == 0 && pool->running) {
+            pthread_cond_wait(&pool->cond, &pool->lock);
+        }
+        int stop = !pool->running && pool->pending == 0;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (stop) {
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+Pool *pool_alloc(int threads) {
+    if (threads <= 0) {
+        threads = av_cpu_count();
+    }
+    if (threads <= 0) {
+        threads = 1;
+    }
+
+    Pool *pool = malloc(sizeof(Pool));
+    if (!pool) {
+        return NULL;
+    }
+
+    pool->workers = malloc(threads * sizeof(PoolWorker));
+    if (!pool->workers) {
+        free(pool);
+        return NULL;
+    }
+
+    pool->nb_workers = 0;
+    pool->pending = 0;
+    pool->running = 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+    atomic_init(&pool->next_affinity, 0);
+
+    for (int i = 0; i < threads; i++) {
+        PoolWorker *worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        worker->tasks = NULL;
+        worker->count = 0;
+        worker->capacity = 0;
+        worker->steals = 0;
+        pthread_mutex_init(&worker->lock, NULL);
+    }
+
+    // Workers steal from each other, so all queues exist before any starts.
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&pool->workers[i].thread, NULL, pool_worker_main,
+                           &pool->workers[i]) != 0) {
+            printf("pool_alloc: pthread_create failed\n");
+            break;
+        }
+        pool->nb_workers++;
+    }
+
+    if (pool->nb_workers == 0) {
+        pool_free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+int pool_submit(Pool *pool, PoolTask task) {
+    if (!pool || !task.run) {
+        printf("pool_submit: pool or task is NULL\n");
+        return -1;
+    }
+
+    // Tasks submitted from a worker stay on it, the others go to the worker
+    // their owner is bound to.
+    int idx;
+    if (pool_current_worker && pool_current_worker->pool == pool) {
+        idx = pool_current_worker->index;
+    } else if (task.owner) {
+        // Owners may submit from several threads at once; the first one to
+        // bind it wins.
+        int affinity = atomic_load(&task.owner->affinity);
+        if (affinity < 0) {
+            int next = atomic_fetch_add(&pool->next_affinity, 1);
+            if (atomic_compare_exchange_strong(&task.owner->affinity,
+                                               &affinity, next)) {
+                affinity = next;
+            }
+        }
+        idx = affinity % pool->nb_workers;
+    } else {
+        idx = atomic_fetch_add(&pool->next_affinity, 1) % pool->nb_workers;
+    }
+
+    PoolWorker *worker = &pool->workers[idx];
+
+    pthread_mutex_lock(&worker->lock);
+    if (worker->count == worker->capacity) {
+        int capacity = worker->capacity ? worker->capacity * 2 : 16;
+        PoolTask *tasks = realloc(worker->tasks, capacity * sizeof(PoolTask));
+        if (!tasks) {
+            pthread_mutex_unlock(&worker->lock);
+            printf("pool_submit: failed to grow the queue\n");
+            return -1;
+        }
+
+        worker->tasks = tasks;
+        worker->capacity = capacity;
+    }
+
+    if (task.group) {
+        pthread_mutex_lock(&task.group->lock);
+        task.group->pending++;
+        pthread_mutex_unlock(&task.group->lock);
+    }
+
+    worker->tasks[worker->count++] = task;
+    pthread_mutex_unlock(&worker->lock);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->pending++;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    return 0;
+}
+
+void pool_group_wait(Pool *pool, PoolGroup *group) {
+    int self = pool_current_worker && pool_current_worker->pool == pool
+                   ? pool_current_worker->index
+                   : -1;
+
+    while (pool_group_busy(group)) {
+        // Help instead of blocking, so waiting from a worker cannot starve the
+        // pool of threads. Only with the group's own tasks or ones at least as
+        // urgent as the waiter's, so an urgent wait never ends up behind a
+        // long background job.
+        PoolTask task;
+        if (pool_take(pool, self, group, pool_current_priority, &task)) {
+            pool_run(&task);
+            continue;
+        }
+
+        // Nothing to help with: the remaining tasks are running elsewhere or
+        // queued behind ones this thread must not run.
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        struct timespec timeout = {.tv_sec = now.tv_sec,
+                                   .tv_nsec = now.tv_usec * 1000 + 2000000};
+        if (timeout.tv_nsec >= 1000000000) {
+            timeout.tv_sec++;
+            timeout.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&group->lock);
+        if (group->pending > 0) {
+            pthread_cond_timedwait(&group->cond, &group->lock, &timeout);
+        }
+        pthread_mutex_unlock(&group->lock);
+    }
+}
+
+void pool_free(Pool *pool) {
+    if (!pool) {
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->running = 0;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    // Workers only stop once every queued task ran.
+    for (int i = 0; i < pool->nb_workers; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    for (int i = 0; i < pool->nb_workers; i++) {
+        free(pool->workers[i].tasks);
+        pthread_mutex_destroy(&pool->workers[i].lock);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+
+    free(pool->workers);
+    free(pool);
+}
+
+int pool_global_init(int threads) {
+    if (pool_global_instance) {
+        return 0;
+    }
+
+    pool_global_instance = pool_alloc(threads);
+    if (!pool_global_instance) {
+        printf("pool_global_init: pool_alloc failed\n");
+        return -1;
+    }
+
+    return 0;
+}
+
+Pool *pool_global(void) {
+    if (!pool_global_instance) {
+        pool_global_init(0);
+    }
+
+    return pool_global_instance;
+}
+
+void pool_global_free(void) {
+    pool_free(pool_global_instance);
+    pool_global_instance = NULL;
+}
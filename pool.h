@@ -0,0 +1,110 @@
+// Process-wide thread pool shared by every media. Each worker owns a queue of
+// tasks, takes the most urgent one from it and steals from the other workers
+// when its own queue runs dry, so a grid of medias or a playlist preroll never
+// runs more decoding threads than there are cores.
+//
+// Tasks are ordered by priority class first (what is heard, then what is
+// seen, then background work), then by deadline, and finally by how much time
+// was already spent on their owner, so no media starves the others.
+#ifndef POOL_H
+#define POOL_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+
+#define POOL_NO_DEADLINE INT64_MAX
+
+// Deadlines (microseconds) closer than this are considered equal, and the
+// fairness counters decide.
+#define POOL_DEADLINE_SLACK 2000
+
+enum PoolPriority {
+    // Work for the media being heard.
+    POOL_PRIORITY_AUDIBLE,
+    // Work for medias on screen.
+    POOL_PRIORITY_VISIBLE,
+    // Prefetching, thumbnails, indexing, export.
+    POOL_PRIORITY_BACKGROUND,
+};
+
+// Fairness counters of whoever submits tasks, usually a media.
+typedef struct PoolOwner {
+    // Time spent running its tasks (microseconds) and how many ran.
+    atomic_llong run_time;
+    atomic_llong tasks;
+
+    // Worker whose queue receives its tasks, so they stay on the same core
+    // unless somebody steals them.
+    atomic_int affinity;
+} PoolOwner;
+
+// Lets a submitter wait for a set of tasks.
+typedef struct PoolGroup {
+    int pending;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+} PoolGroup;
+
+typedef struct PoolTask {
+    void (*run)(void *arg);
+    void *arg;
+
+    enum PoolPriority priority;
+
+    // When the result is needed, on the av_gettime_relative clock.
+    int64_t deadline;
+
+    // Both optional.
+    PoolOwner *owner;
+    PoolGroup *group;
+} PoolTask;
+
+typedef struct PoolWorker {
+    struct Pool *pool;
+    int index;
+    pthread_t thread;
+
+    PoolTask *tasks;
+    int count, capacity;
+    pthread_mutex_t lock;
+
+    // Tasks this worker took from other queues.
+    int64_t steals;
+} PoolWorker;
+
+typedef struct Pool {
+    PoolWorker *workers;
+    int nb_workers;
+
+    // Tasks queued on all workers; idle workers sleep while it is zero.
+    int pending;
+    int running;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+
+    atomic_int next_affinity;
+} Pool;
+
+// Creates a pool with `threads` workers, or one per core if `threads` <= 0.
+Pool *pool_alloc(int threads);
+int pool_submit(Pool *pool, PoolTask task);
+void pool_free(Pool *pool);
+
+void pool_owner_init(PoolOwner *owner);
+
+void pool_group_init(PoolGroup *group);
+int pool_group_busy(PoolGroup *group);
+// Waits for every task of the group, running its queued tasks in the meantime,
+// and from a worker also the other tasks at least as urgent as its own.
+void pool_group_wait(Pool *pool, PoolGroup *group);
+void pool_group_destroy(PoolGroup *group);
+
+// The pool shared by the whole process. pool_global_init must be called from
+// the main thread before anything else uses it; otherwise pool_global creates
+// it with one worker per core.
+int pool_global_init(int threads);
+Pool *pool_global(void);
+void pool_global_free(void);
+
+#endif  // POOL_H
@@ -59,13 +59,38 @@ Node *fq_dequeue(FrameQueue *fq) {
     return node;
 }
 
-void fq_free(FrameQueue *fq) {
+Node *fq_peek(FrameQueue *fq) { return fq->head; }
+
+void fq_clear(FrameQueue *fq) {
     while (!fq_empty(fq)) {
         Node *node = fq_dequeue(fq);
         node->next = NULL;
         av_frame_free(&node->frame);
         free(node);
     }
+}
+
+void fq_remove_type(FrameQueue *fq, enum FrameType type) {
+    Node **link = &fq->head;
+    while (*link) {
+        Node *node = *link;
+        if (node->type != type) {
+            link = &node->next;
+            continue;
+        }
+
+        *link = node->next;
+        node_free(node);
+        fq->length--;
+    }
+}
+
+void fq_free(FrameQueue *fq) {
+    if (!fq) {
+        return;
+    }
+
+    fq_clear(fq);
     free(fq);
 }
 
@@ -21,6 +21,10 @@ FrameQueue *fq_alloc();
 int fq_empty(FrameQueue *fq);
 void fq_enqueue(FrameQueue *fq, AVFrame *frame, enum FrameType type);
 Node *fq_dequeue(FrameQueue *fq);
+Node *fq_peek(FrameQueue *fq);
+void fq_clear(FrameQueue *fq);
+// Frees every queued frame of the given type, keeping the others in order.
+void fq_remove_type(FrameQueue *fq, enum FrameType type);
 void fq_free(FrameQueue *);
 
 #endif // FRAME_QUEUE
@@ -0,0 +1,384 @@
+#include "waveform.h"
+
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libavutil/time.h>
+
+#include "disk_cache.h"
+
+#define WAVEFORM_CACHE_MAGIC "AVPWAVE1"
+
+typedef float WaveformVec __attribute__((vector_size(32)));
+typedef int WaveformMask __attribute__((vector_size(32)));
+
+#define WAVEFORM_LANES (int)(sizeof(WaveformVec) / sizeof(float))
+
+typedef struct {
+    char magic[8];
+    int64_t file_size, file_mtime;
+    int32_t nb_buckets, path_len;
+} WaveformCacheHeader;
+
+Waveform *waveform_alloc(int nb_buckets) {
+    Waveform *waveform = malloc(sizeof(Waveform));
+    if (!waveform) {
+        return NULL;
+    }
+
+    waveform->peaks = calloc(nb_buckets, sizeof(WaveformPeak));
+    if (!waveform->peaks) {
+        free(waveform);
+        return NULL;
+    }
+
+    waveform->media = NULL;
+    waveform->path = NULL;
+    waveform->opened = 0;
+    pool_owner_init(&waveform->owner);
+
+    waveform->cache_path = NULL;
+    waveform->file_size = 0;
+    waveform->file_mtime = 0;
+
+    waveform->nb_buckets = nb_buckets;
+    atomic_init(&waveform->filled, 0);
+    atomic_init(&waveform->done, 0);
+    atomic_init(&waveform->cancel, 0);
+
+    waveform->bucket = 0;
+    waveform->min = FLT_MAX;
+    waveform->max = -FLT_MAX;
+    waveform->sum_sq = 0;
+    waveform->count = 0;
+    waveform->sample_time = 0;
+
+    pool_group_init(&waveform->group);
+
+    return waveform;
+}
+
+int waveform_load(Waveform *waveform, const char *filename) {
+    FILE *file = fopen(waveform->cache_path, "rb");
+    if (!file) {
+        return -1;
+    }
+
+    WaveformCacheHeader header;
+    char path[1024];
+    int ok = fread(&header, sizeof(header), 1, file) == 1 &&
+             memcmp(header.magic, WAVEFORM_CACHE_MAGIC, 8) == 0 &&
+             header.file_size == waveform->file_size &&
+             header.file_mtime == waveform->file_mtime &&
+             header.nb_buckets == waveform->nb_buckets &&
+             header.path_len == (int32_t)strlen(filename) &&
+             header.path_len < (int32_t)sizeof(path) &&
+             fread(path, 1, header.path_len, file) == (size_t)header.path_len &&
+             memcmp(path, filename, header.path_len) == 0 &&
+             fread(waveform->peaks, sizeof(WaveformPeak), waveform->nb_buckets,
+                   file) == (size_t)waveform->nb_buckets;
+    fclose(file);
+
+    if (!ok) {
+        memset(waveform->peaks, 0, waveform->nb_buckets * sizeof(WaveformPeak));
+        return -1;
+    }
+
+    atomic_store(&waveform->filled, waveform->nb_buckets);
+    atomic_store(&waveform->done, 1);
+
+    return 0;
+}
+
+void waveform_save(Waveform *waveform) {
+    if (!waveform->cache_path) {
+        return;
+    }
+
+    const char *filename = waveform->media->filename;
+    WaveformCacheHeader header = {.file_size = waveform->file_size,
+                                  .file_mtime = waveform->file_mtime,
+                                  .nb_buckets = waveform->nb_buckets,
+                                  .path_len = strlen(filename)};
+    memcpy(header.magic, WAVEFORM_CACHE_MAGIC, 8);
+
+    // Written aside and renamed, so a reader never sees half an entry.
+    char tmp_path[1100];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", waveform->cache_path);
+
+    FILE *file = fopen(tmp_path, "wb");
+    if (!file) {
+        printf("waveform_save: cannot open %s\n", tmp_path);
+        return;
+    }
+
+    int ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(filename, 1, header.path_len, file) ==
+                 (size_t)header.path_len &&
+             fwrite(waveform->peaks, sizeof(WaveformPeak), waveform->nb_buckets,
+                    file) == (size_t)waveform->nb_buckets;
+    ok = fclose(file) == 0 && ok;
+
+    if (!ok || rename(tmp_path, waveform->cache_path) < 0) {
+        printf("waveform_save: failed to write %s\n", waveform->cache_path);
+        remove(tmp_path);
+    }
+}
+
+// Folds `count` samples into the running min, max and sum of squares, eight
+// at a time.
+void waveform_scan(const float *samples, int count, float *min, float *max,
+                   double *sum_sq) {
+    WaveformVec vmin = (WaveformVec){0} + *min;
+    WaveformVec vmax = (WaveformVec){0} + *max;
+    WaveformVec vsum = {0};
+
+    int i = 0;
+    for (; i + WAVEFORM_LANES <= count; i += WAVEFORM_LANES) {
+        WaveformVec v;
+        memcpy(&v, samples + i, sizeof(v));
+
+        WaveformMask lt = v < vmin;
+        WaveformMask gt = v > vmax;
+        vmin = (WaveformVec)((lt & (WaveformMask)v) | (~lt & (WaveformMask)vmin));
+        vmax = (WaveformVec)((gt & (WaveformMask)v) | (~gt & (WaveformMask)vmax));
+        vsum += v * v;
+    }
+
+    double sum = 0;
+    for (int lane = 0; lane < WAVEFORM_LANES; lane++) {
+        *min = fminf(*min, vmin[lane]);
+        *max = fmaxf(*max, vmax[lane]);
+        sum += vsum[lane];
+    }
+
+    for (; i < count; i++) {
+        *min = fminf(*min, samples[i]);
+        *max = fmaxf(*max, samples[i]);
+        sum += (double)samples[i] * samples[i];
+    }
+
+    *sum_sq += sum;
+}
+
+// Publishes every bucket before `bucket`; the ones no sample fell in stay
+// silent.
+void waveform_finish_buckets(Waveform *waveform, int bucket) {
+    if (bucket > waveform->nb_buckets) {
+        bucket = waveform->nb_buckets;
+    }
+
+    while (waveform->bucket < bucket) {
+        WaveformPeak *peak = &waveform->peaks[waveform->bucket];
+        if (waveform->count > 0) {
+            peak->min = waveform->min;
+            peak->max = waveform->max;
+            peak->rms = sqrt(waveform->sum_sq / waveform->count);
+        }
+
+        waveform->bucket++;
+        waveform->min = FLT_MAX;
+        waveform->max = -FLT_MAX;
+        waveform->sum_sq = 0;
+        waveform->count = 0;
+    }
+
+    atomic_store_explicit(&waveform->filled, waveform->bucket,
+                          memory_order_release);
+}
+
+// Splits a converted (interleaved stereo float) frame over the buckets it
+// covers.
+void waveform_add_frame(Waveform *waveform, AVFrame *frame) {
+    Media *media = waveform->media;
+    AVStream *stream = media->fmt_ctx->streams[media->audio_stream_idx];
+    double duration = (double)media->fmt_ctx->duration / AV_TIME_BASE;
+    int sample_rate = media->out_sample_rate;
+
+    if (frame->best_effort_timestamp != AV_NOPTS_VALUE) {
+        int64_t start =
+            stream->start_time != AV_NOPTS_VALUE ? stream->start_time : 0;
+        waveform->sample_time =
+            (frame->best_effort_timestamp - start) * av_q2d(stream->time_base);
+    }
+
+    const float *samples = (const float *)frame->data[0];
+    int remaining = frame->nb_samples;
+
+    while (remaining > 0) {
+        int bucket = waveform->sample_time * waveform->nb_buckets / duration;
+        if (bucket < waveform->bucket) {
+            bucket = waveform->bucket;
+        }
+        if (bucket >= waveform->nb_buckets) {
+            break;
+        }
+        waveform_finish_buckets(waveform, bucket);
+
+        double bucket_end = (bucket + 1) * duration / waveform->nb_buckets;
+        int n = ceil((bucket_end - waveform->sample_time) * sample_rate);
+        if (n < 1) {
+            n = 1;
+        }
+        if (n > remaining) {
+            n = remaining;
+        }
+
+        waveform_scan(samples, n * 2, &waveform->min, &waveform->max,
+                      &waveform->sum_sq);
+        waveform->count += n * 2;
+
+        samples += n * 2;
+        remaining -= n;
+        waveform->sample_time += (double)n / sample_rate;
+    }
+}
+
+void waveform_job(void *arg) {
+    Waveform *waveform = arg;
+    Media *media = waveform->media;
+
+    if (!waveform->opened) {
+        if (media_init(media, 0, 0, AV_PIX_FMT_NONE, waveform->path) < 0) {
+            printf("waveform_job: media_init failed\n");
+            atomic_store(&waveform->done, 1);
+            return;
+        }
+
+        // Only the audio is read.
+        for (int i = 0; i < (int)media->fmt_ctx->nb_streams; i++) {
+            if (i != media->audio_stream_idx) {
+                media->fmt_ctx->streams[i]->discard = AVDISCARD_ALL;
+            }
+        }
+        waveform->opened = 1;
+    }
+
+    int64_t start = av_gettime_relative();
+    int ret = 0;
+
+    while (!atomic_load(&waveform->cancel) &&
+           av_gettime_relative() - start < WAVEFORM_SLICE_TIME) {
+        if ((ret = media_read_frame(media)) < 0) {
+            break;
+        }
+
+        if (media->pkt->stream_index != media->audio_stream_idx) {
+            continue;
+        }
+
+        ret = media_decode(media);
+        if (ret < 0 && ret != MEDIA_ERR_MORE_DATA) {
+            break;
+        }
+        ret = 0;
+
+        Node *node;
+        while ((node = fq_dequeue(media->queue))) {
+            if (node->type == FRAME_TYPE_AUDIO) {
+                waveform_add_frame(waveform, node->frame);
+            }
+            node_free(node);
+        }
+    }
+
+    if (atomic_load(&waveform->cancel)) {
+        return;
+    }
+
+    if (ret == 0) {
+        PoolTask task = {.run = waveform_job,
+                         .arg = waveform,
+                         .priority = POOL_PRIORITY_BACKGROUND,
+                         .deadline = POOL_NO_DEADLINE,
+                         .owner = &waveform->owner,
+                         .group = &waveform->group};
+        if (pool_submit(pool_global(), task) == 0) {
+            return;
+        }
+    }
+
+    // Whatever is left after the last sample is silence.
+    waveform_finish_buckets(waveform, waveform->nb_buckets);
+    if (ret == MEDIA_ERR_EOF) {
+        waveform_save(waveform);
+    }
+    atomic_store(&waveform->done, 1);
+}
+
+int waveform_init(Waveform *waveform, Media *media) {
+    if (!waveform || !media) {
+        printf("waveform_init: waveform or media is NULL\n");
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    if (media->audio_stream_idx < 0 || media->fmt_ctx->duration <= 0) {
+        return MEDIA_ERR_NO_STREAM;
+    }
+
+    if (disk_cache_identity(media->filename, &waveform->file_size,
+                            &waveform->file_mtime) == 0) {
+        waveform->cache_path =
+            disk_cache_path("waveform", "bin", media->filename,
+                            waveform->file_size, waveform->file_mtime);
+    }
+
+    if (waveform->cache_path && waveform_load(waveform, media->filename) == 0) {
+        return 0;
+    }
+
+    waveform->media = media_alloc();
+    if (!waveform->media) {
+        printf("waveform_init: media_alloc failed\n");
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    waveform->media->io_mode = media->io_mode;
+    waveform->media->io_buffer_size = media->io_buffer_size;
+    waveform->media->fast_open = 1;
+
+    waveform->path = strdup(media->filename);
+    if (!waveform->path) {
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    PoolTask task = {.run = waveform_job,
+                     .arg = waveform,
+                     .priority = POOL_PRIORITY_BACKGROUND,
+                     .deadline = POOL_NO_DEADLINE,
+                     .owner = &waveform->owner,
+                     .group = &waveform->group};
+    if (pool_submit(pool_global(), task) < 0) {
+        printf("waveform_init: pool_submit failed\n");
+        return MEDIA_ERR_INTERNAL;
+    }
+
+    return 0;
+}
+
+int waveform_filled(Waveform *waveform) {
+    if (!waveform) {
+        return 0;
+    }
+
+    return atomic_load_explicit(&waveform->filled, memory_order_acquire);
+}
+
+void waveform_free(Waveform *waveform) {
+    if (!waveform) {
+        return;
+    }
+
+    atomic_store(&waveform->cancel, 1);
+    pool_group_wait(pool_global(), &waveform->group);
+    pool_group_destroy(&waveform->group);
+
+    media_free(waveform->media);
+    free(waveform->path);
+    free(waveform->cache_path);
+    free(waveform->peaks);
+    free(waveform);
+}
@@ -0,0 +1,67 @@
+// Amplitude overview of a whole media, drawn under the progress bar. The audio
+// is decoded from start to end by a background task on the thread pool, with
+// its own demuxer, and reduced to a fixed number of buckets (min, max and RMS
+// of the samples in each). Buckets are published as soon as they are final, so
+// the overview grows while it is computed, and the finished result is saved to
+// a cache on disk, so reopening the same file shows it at once.
+#ifndef WAVEFORM_H
+#define WAVEFORM_H
+
+#include <stdatomic.h>
+
+#include "media.h"
+#include "pool.h"
+
+#define WAVEFORM_BUCKETS 2048
+
+// How long the task decodes (microseconds) before it queues itself again, so
+// it never holds a worker that playback may need.
+#define WAVEFORM_SLICE_TIME 20000
+
+typedef struct {
+    float min, max, rms;
+} WaveformPeak;
+
+typedef struct Waveform {
+    // Private decoding instance, reading the audio stream only. It opens
+    // `path` in the first task, so opening it never blocks the caller.
+    Media *media;
+    char *path;
+    int opened;
+    PoolOwner owner;
+
+    // Where the overview is cached, or NULL if it cannot be. Entries are only
+    // valid for the size and modification time the file had.
+    char *cache_path;
+    int64_t file_size, file_mtime;
+
+    int nb_buckets;
+    WaveformPeak *peaks;
+
+    // Buckets [0, filled) are final and can be read from any thread.
+    atomic_int filled;
+    atomic_int done, cancel;
+
+    // Bucket being accumulated by the task, and the time (seconds from the
+    // start of the stream) of the next sample.
+    int bucket;
+    float min, max;
+    double sum_sq;
+    int64_t count;
+    double sample_time;
+
+    PoolGroup group;
+} Waveform;
+
+Waveform *waveform_alloc(int nb_buckets);
+
+// Loads the overview of `media` from the cache, or starts computing it.
+int waveform_init(Waveform *waveform, Media *media);
+
+// Number of buckets that can be drawn.
+int waveform_filled(Waveform *waveform);
+
+// Stops the task, waiting for its current slice.
+void waveform_free(Waveform *waveform);
+
+#endif  // WAVEFORM_H